@@ -2,7 +2,9 @@
 #define COMMON_HPP_INCLUDED
 
 // Standard Library
+#include <algorithm>
 #include <cmath>
+#include <deque>
 #include <iomanip>
 #include <iostream>
 #include <memory>
@@ -31,9 +33,35 @@ namespace fs = boost::filesystem;
 namespace po = boost::program_options;
 
 // Custom
+#include "vf/arena.hpp"
+#include "vf/audio_decoder.hpp"
 #include "vf/ext/al.hpp"
 #include "vf/ext/av.hpp"
+#include "vf/benchmark.hpp"
+#include "vf/clock.hpp"
+#include "vf/control.hpp"
+#include "vf/converter.hpp"
+#include "vf/demuxer.hpp"
+#include "vf/disk_cache.hpp"
+#include "vf/downmix.hpp"
+#include "vf/dsp.hpp"
+#include "vf/eq.hpp"
+#include "vf/fingerprint.hpp"
 #include "vf/format.hpp"
+#include "vf/http.hpp"
+#include "vf/library.hpp"
+#include "vf/log.hpp"
+#include "vf/loudness.hpp"
+#include "vf/memory.hpp"
+#include "vf/mpsc_queue.hpp"
+#include "vf/pcm_cache.hpp"
+#include "vf/peaks.hpp"
+#include "vf/pipeline.hpp"
+#include "vf/realtime.hpp"
+#include "vf/shared_cache.hpp"
+#include "vf/stretch.hpp"
+#include "vf/terminal.hpp"
+#include "vf/trace.hpp"
 
 namespace al = vf::ext::al;
 namespace av = vf::ext::av;
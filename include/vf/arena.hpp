@@ -0,0 +1,109 @@
+#ifndef VF_ARENA_HPP_INCLUDED
+#define VF_ARENA_HPP_INCLUDED
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+namespace vf {
+
+// A single block of memory that buffers are carved from. Every buffer starts
+// on a cache line of its own, so buffers written by different threads never
+// share a line. Growing at least doubles the capacity, which keeps the number
+// of reallocations logarithmic in the largest size ever requested, and
+// releases every buffer carved so far.
+class Arena
+{
+public:
+    static constexpr std::size_t Alignment = 64;
+    
+    explicit Arena(std::size_t capacity = 0):
+        _storage{},
+        _data{nullptr},
+        _capacity{0},
+        _used{0},
+        _growths{0}
+    {
+        reserve(capacity);
+    }
+    
+    Arena(Arena const& other) = delete;
+    Arena& operator=(Arena const& other) = delete;
+    
+    static inline std::size_t aligned(std::size_t bytes)
+    {
+        return (bytes + Alignment - 1) / Alignment * Alignment;
+    }
+    
+    // Makes room for at least the given number of bytes. Returns true if the
+    // arena had to grow, which invalidates all buffers.
+    bool reserve(std::size_t bytes)
+    {
+        if (bytes <= _capacity)
+        {
+            return false;
+        }
+        
+        auto capacity = std::max(aligned(bytes), 2 * _capacity);
+        _storage.reset(new uint8_t[capacity + Alignment - 1]);
+        auto address = reinterpret_cast<std::uintptr_t>(_storage.get());
+        _data = reinterpret_cast<uint8_t*>((address + Alignment - 1) / Alignment * Alignment);
+        _capacity = capacity;
+        _used = 0;
+        ++_growths;
+        return true;
+    }
+    
+    // Releases all buffers, keeping the memory.
+    inline void reset()
+    {
+        _used = 0;
+    }
+    
+    template <typename T>
+    T* allocate(std::size_t count)
+    {
+        auto bytes = aligned(count * sizeof(T));
+        if (bytes > _capacity - _used)
+        {
+            throw std::runtime_error("Arena is exhausted.");
+        }
+        
+        auto result = reinterpret_cast<T*>(_data + _used);
+        _used += bytes;
+        return result;
+    }
+    
+    inline uint8_t* data() const
+    {
+        return _data;
+    }
+    
+    inline std::size_t capacity() const
+    {
+        return _capacity;
+    }
+    
+    inline std::size_t used() const
+    {
+        return _used;
+    }
+    
+    inline std::size_t growths() const
+    {
+        return _growths;
+    }
+
+private:
+    std::unique_ptr<uint8_t[]> _storage;
+    uint8_t* _data;
+    std::size_t _capacity;
+    std::size_t _used;
+    std::size_t _growths;
+};
+
+} // vf
+
+#endif // VF_ARENA_HPP_INCLUDED
\ No newline at end of file
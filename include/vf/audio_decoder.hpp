@@ -0,0 +1,201 @@
+#ifndef VF_AUDIO_DECODER_HPP_INCLUDED
+#define VF_AUDIO_DECODER_HPP_INCLUDED
+
+#include <memory>
+
+#include "ext/al.hpp"
+#include "ext/av.hpp"
+#include "format.hpp"
+#include "http.hpp"
+
+namespace vf {
+
+namespace al = ext::al;
+namespace av = ext::av;
+
+// Decodes the best audio stream of a file, or of an http:// URL that is
+// read ahead by an http::Stream and cannot seek.
+class AudioDecoder
+{
+public:
+    AudioDecoder(std::string const& path):
+        _network{},
+        _io{},
+        _formatContext{av::FormatContext::Null},
+        _audioStream{},
+        _audioCodecContext{av::CodecContext::Null}
+    {
+        if (http::isUrl(path))
+        {
+            _network.reset(new http::Stream{path});
+            _io.reset(new av::IOContext{[this](uint8_t* data, int size) { return _network->read(data, size); }});
+            _formatContext.open(*_io, path);
+        }
+        else
+        {
+            _formatContext.open(path);
+        }
+        _formatContext.maxAnalyzeDuration(1.5);
+        _formatContext.findStreamInfo();
+        
+        _audioStream = av::Stream{_formatContext.findBestStream(av::MediaType::Audio)};
+        _audioCodecContext.open(_audioStream);
+    }
+    
+    ~AudioDecoder()
+    {
+        _audioCodecContext.close();
+        
+        _formatContext.close();
+    }
+    
+    inline av::CodecContext& audioCodec()
+    {
+        return _audioCodecContext;
+    }
+    
+    inline av::CodecContext const& audioCodec() const
+    {
+        return _audioCodecContext;
+    }
+    
+    inline av::Stream const& audioStream() const
+    {
+        return _audioStream;
+    }
+    
+    // The stream the source is read from over the network, or null.
+    inline http::Stream const* network() const
+    {
+        return _network.get();
+    }
+    
+    // Makes reading from the network fail at once instead of waiting for
+    // data. The decoder cannot read on afterwards.
+    inline void interrupt()
+    {
+        if (_network)
+        {
+            _network->close();
+        }
+    }
+    
+    // Seconds of the audio stream, or of the whole file if the stream does
+    // not say; zero or less if unknown.
+    inline double duration() const
+    {
+        auto duration = _audioStream.duration();
+        return duration > 0.0 ? duration : _formatContext.duration();
+    }
+    
+    // Looks up a tag on the audio stream, then on the container.
+    std::string tag(char const* key) const
+    {
+        auto value = _audioStream.metadata(key);
+        if (value == nullptr)
+        {
+            value = _formatContext.metadata(key);
+        }
+        return value ? value : "";
+    }
+    
+    // Only valid before the first packet has been read.
+    inline void seek(double seconds)
+    {
+        _formatContext.seek(_audioStream, seconds);
+    }
+    
+    // Demuxing half: reads the next packet of the audio stream.
+    bool readPacket(av::Packet& packet)
+    {
+        try
+        {
+            while (true)
+            {
+                packet = av::Packet{};
+                _formatContext.readFrame(packet);
+                if (packet.streamIndex() == _audioStream.index())
+                {
+                    return true;
+                }
+            }
+        }
+        catch (std::runtime_error&)
+        {
+            return false;
+        }
+    }
+    
+    // Decoding half: returns true if the packet completed a frame.
+    bool decodePacket(av::Packet const& packet, av::Frame& frame)
+    {
+        return _audioCodecContext.decodeAudio(frame, packet);
+    }
+    
+    bool readAudioFrame(av::Frame& frame)
+    {
+        av::Packet packet;
+        while (readPacket(packet))
+        {
+            if (decodePacket(packet, frame))
+            {
+                return true;
+            }
+        }
+        
+        return false;
+    }
+
+private:
+    // Declared first, so they outlive the format context.
+    std::unique_ptr<http::Stream> _network;
+    std::unique_ptr<av::IOContext> _io;
+    av::FormatContext _formatContext;
+    av::Stream _audioStream;
+    av::CodecContext _audioCodecContext;
+    
+    friend std::ostream& operator<<(std::ostream& os, AudioDecoder const& decoder)
+    {
+        os << vf::format(
+            "Audio: %s (%d, %d)",
+            decoder.audioCodec().codec().longName(),
+            decoder.audioCodec().channels(),
+            decoder.audioCodec().sampleRate()
+        ) << std::endl;
+        
+        return os;
+    }
+};
+
+al::Format convert(av::SampleFormat format, int channels)
+{
+    switch (format)
+    {
+        case av::SampleFormat::U8:
+        case av::SampleFormat::U8P:
+        {
+            switch (channels)
+            {
+                case 1: return al::Format::MONO8;
+                case 2: return al::Format::STEREO8;
+                default: break;
+            }
+            break;
+        }
+        case av::SampleFormat::S16:
+        case av::SampleFormat::S16P:
+            switch (channels)
+            {
+                case 1: return al::Format::MONO16;
+                case 2: return al::Format::STEREO16;
+                default: break;
+            }
+            break;
+        default: break;
+    }
+    throw std::runtime_error("Incompatible format.");
+}
+
+} // vf
+
+#endif // VF_AUDIO_DECODER_HPP_INCLUDED
\ No newline at end of file
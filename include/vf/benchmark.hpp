@@ -0,0 +1,71 @@
+#ifndef VF_BENCHMARK_HPP_INCLUDED
+#define VF_BENCHMARK_HPP_INCLUDED
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "format.hpp"
+
+namespace vf {
+namespace benchmark {
+
+using Clock = std::chrono::steady_clock;
+
+// Runs the function several times and returns the fastest run in seconds.
+template<typename TFunction>
+double measure(TFunction function, int runs = 5)
+{
+    auto best = std::numeric_limits<double>::max();
+    for (int i = 0; i < runs; ++i)
+    {
+        auto start = Clock::now();
+        function();
+        auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        best = std::min(best, elapsed);
+    }
+    return best;
+}
+
+// Prints the processing time per second of audio and the share of one core
+// that realtime playback would take.
+inline void report(std::string const& name, double seconds, double audioSeconds)
+{
+    std::cout << vf::format(
+        "%-28s %9.3f ms per second of audio, %6.3f%% of one core",
+        name,
+        1000.0 * seconds / audioSeconds,
+        100.0 * seconds / audioSeconds
+    ) << std::endl;
+}
+
+// A deterministic test signal: a sweep plus a little noise, interleaved.
+inline std::vector<float> signal(int sampleRate, int channels, double seconds)
+{
+    auto frames = static_cast<std::size_t>(sampleRate * seconds);
+    std::vector<float> samples(frames * channels);
+    
+    uint32_t noise = 22222;
+    auto phase = 0.0;
+    for (std::size_t i = 0; i < frames; ++i)
+    {
+        auto frequency = 50.0 + 10000.0 * i / frames;
+        phase += 2.0 * M_PI * frequency / sampleRate;
+        for (int c = 0; c < channels; ++c)
+        {
+            noise = noise * 1664525u + 1013904223u;
+            samples[i * channels + c] = static_cast<float>(0.5 * std::sin(phase + c) + 0.01 * (static_cast<int32_t>(noise) / 2147483648.0));
+        }
+    }
+    return samples;
+}
+
+} // benchmark
+} // vf
+
+#endif // VF_BENCHMARK_HPP_INCLUDED
\ No newline at end of file
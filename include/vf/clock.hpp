@@ -0,0 +1,192 @@
+#ifndef VF_CLOCK_HPP_INCLUDED
+#define VF_CLOCK_HPP_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+namespace vf {
+
+// The position of playback in seconds, readable from any thread without
+// locks and without asking the device. The output thread now and then
+// measures how far the device has played and publishes an anchor: a
+// position, the time it was taken and the rate at which it advances.
+// Readers extrapolate from the latest anchor with the monotonic clock, so
+// positions are continuous between the coarse updates of the device.
+//
+// Small differences between measured and extrapolated positions, which is
+// how the device clock drifts from the system clock, are slewed out by
+// running the clock slightly faster or slower instead of jumping. Larger
+// ones, such as after an underrun, snap the clock to the measurement.
+//
+// Anchors are published under a sequence lock: the writer makes the
+// sequence odd while it stores the fields, and readers retry until they
+// read the same even sequence before and after the fields.
+class PlaybackClock
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    
+    // Errors up to SnapThreshold seconds are corrected over SlewTime seconds
+    // at a rate off by no more than MaxSlew.
+    static constexpr double SnapThreshold = 0.05;
+    static constexpr double SlewTime = 0.5;
+    static constexpr double MaxSlew = 0.01;
+    
+    PlaybackClock():
+        _sequence{0},
+        _position{0.0},
+        _time{0},
+        _rate{0.0},
+        _limit{0.0},
+        _base{0.0},
+        _origin{0.0},
+        _speed{1.0},
+        _corrections{0},
+        _snaps{0},
+        _worstError{0.0}
+    {}
+    
+    PlaybackClock(PlaybackClock const& other) = delete;
+    PlaybackClock& operator=(PlaybackClock const& other) = delete;
+    
+    // Seconds into the current stream. Lock-free and cheap enough to call for
+    // every video frame.
+    double position() const
+    {
+        for (;;)
+        {
+            auto sequence = _sequence.load(std::memory_order_acquire);
+            if ((sequence & 1) == 0)
+            {
+                auto position = _position.load(std::memory_order_relaxed);
+                auto time = _time.load(std::memory_order_relaxed);
+                auto rate = _rate.load(std::memory_order_relaxed);
+                auto limit = _limit.load(std::memory_order_relaxed);
+                auto base = _base.load(std::memory_order_relaxed);
+                auto origin = _origin.load(std::memory_order_relaxed);
+                auto speed = _speed.load(std::memory_order_relaxed);
+                
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (_sequence.load(std::memory_order_relaxed) == sequence)
+                {
+                    auto played = std::min(extrapolate(position, time, rate, now()), limit);
+                    return origin + std::max(0.0, played - base) * speed;
+                }
+            }
+        }
+    }
+    
+    // Publishes a measurement of the device, in seconds since the output was
+    // created. The limit is everything submitted so far, which the clock
+    // never runs past. Only called by the output thread.
+    void update(double measured, double limit, bool running)
+    {
+        auto time = now();
+        auto rate = _rate.load(std::memory_order_relaxed);
+        auto predicted = std::min(extrapolate(_position.load(std::memory_order_relaxed), _time.load(std::memory_order_relaxed), rate, time), _limit.load(std::memory_order_relaxed));
+        auto error = measured - predicted;
+        
+        auto position = measured;
+        if (!running)
+        {
+            rate = 0.0;
+        }
+        else if (rate == 0.0 || std::abs(error) > SnapThreshold)
+        {
+            if (rate != 0.0)
+            {
+                ++_snaps;
+            }
+            rate = 1.0;
+        }
+        else
+        {
+            auto slew = error / SlewTime;
+            position = predicted;
+            rate = 1.0 + (slew > 0.0 ? std::min(slew, double{MaxSlew}) : std::max(slew, -MaxSlew));
+            ++_corrections;
+            _worstError = std::max(_worstError, std::abs(error));
+        }
+        
+        publish(position, time, rate, limit, _base.load(std::memory_order_relaxed), _origin.load(std::memory_order_relaxed), _speed.load(std::memory_order_relaxed));
+    }
+    
+    // Makes the audio submitted from now on start at the given position of a
+    // stream, played at the given speed. Only called by the output thread.
+    void mark(double submitted, double origin, double speed = 1.0)
+    {
+        publish(
+            _position.load(std::memory_order_relaxed),
+            _time.load(std::memory_order_relaxed),
+            _rate.load(std::memory_order_relaxed),
+            _limit.load(std::memory_order_relaxed),
+            submitted,
+            origin,
+            speed
+        );
+    }
+    
+    inline unsigned long snaps() const
+    {
+        return _snaps;
+    }
+    
+    inline unsigned long corrections() const
+    {
+        return _corrections;
+    }
+    
+    inline double worstError() const
+    {
+        return _worstError;
+    }
+
+private:
+    static inline int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+    
+    static inline double extrapolate(double position, int64_t time, double rate, int64_t now)
+    {
+        return position + rate * static_cast<double>(now - time) * 1e-9;
+    }
+    
+    void publish(double position, int64_t time, double rate, double limit, double base, double origin, double speed)
+    {
+        auto sequence = _sequence.load(std::memory_order_relaxed);
+        _sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        
+        _position.store(position, std::memory_order_relaxed);
+        _time.store(time, std::memory_order_relaxed);
+        _rate.store(rate, std::memory_order_relaxed);
+        _limit.store(limit, std::memory_order_relaxed);
+        _base.store(base, std::memory_order_relaxed);
+        _origin.store(origin, std::memory_order_relaxed);
+        _speed.store(speed, std::memory_order_relaxed);
+        
+        _sequence.store(sequence + 2, std::memory_order_release);
+    }
+    
+    std::atomic<uint64_t> _sequence;
+    std::atomic<double> _position;
+    std::atomic<int64_t> _time;
+    std::atomic<double> _rate;
+    std::atomic<double> _limit;
+    std::atomic<double> _base;
+    std::atomic<double> _origin;
+    std::atomic<double> _speed;
+    
+    // Only touched by the output thread.
+    unsigned long _corrections;
+    unsigned long _snaps;
+    double _worstError;
+};
+
+} // vf
+
+#endif // VF_CLOCK_HPP_INCLUDED
\ No newline at end of file
@@ -15,4 +15,10 @@
 
 #endif
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+
+#define SIMD_SSE2
+
+#endif
+
 #endif // VF_CONFIG_HPP_INCLUDED
\ No newline at end of file
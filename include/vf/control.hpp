@@ -0,0 +1,324 @@
+#ifndef VF_CONTROL_HPP_INCLUDED
+#define VF_CONTROL_HPP_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <istream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+
+#include "format.hpp"
+#include "mpsc_queue.hpp"
+#include "queue.hpp"
+#include "realtime.hpp"
+
+namespace vf {
+namespace control {
+
+using Clock = std::chrono::steady_clock;
+using Protocol = boost::asio::local::stream_protocol;
+
+// One line of the protocol, "name argument", waiting to be applied by the
+// thread that owns playback. The reply is a single line as well.
+struct Command
+{
+    std::string name;
+    std::string argument;
+    std::promise<std::string> reply;
+    
+    static std::shared_ptr<Command> Parse(std::string const& line)
+    {
+        auto command = std::make_shared<Command>();
+        auto space = line.find(' ');
+        command->name = line.substr(0, space);
+        command->argument = space == std::string::npos ? "" : line.substr(space + 1);
+        return command;
+    }
+};
+
+using CommandQueue = BoundedQueue<std::shared_ptr<Command>>;
+
+// Accepts connections on a Unix domain socket and hands every line it
+// receives to the command queue. Connections are served one line at a time
+// on a single thread, which waits for the reply before reading on, so
+// commands are applied in the order they arrive.
+class Server
+{
+public:
+    Server(std::string const& path, CommandQueue& commands):
+        _path{path},
+        _commands(commands),
+        _service{},
+        _acceptor{_service},
+        _thread{},
+        _count{0},
+        _total{0},
+        _worst{0}
+    {
+        // A socket left behind by a daemon that did not shut down cleanly.
+        boost::system::error_code error;
+        boost::filesystem::remove(_path, error);
+        
+        Protocol::endpoint endpoint{_path};
+        _acceptor.open(endpoint.protocol());
+        _acceptor.bind(endpoint);
+        _acceptor.listen();
+        
+        accept();
+        _thread = std::thread{[this] { _service.run(); }};
+    }
+    
+    Server(Server const& other) = delete;
+    Server& operator=(Server const& other) = delete;
+    
+    // Commands nobody took from the queue are failed first, so a reply
+    // that is waited for on the io thread always comes, even when playback
+    // ended with an exception.
+    ~Server()
+    {
+        _commands.close();
+        std::shared_ptr<Command> command;
+        while (_commands.pop(command))
+        {
+            command->reply.set_value("error shutting down");
+        }
+        
+        _service.stop();
+        _thread.join();
+        
+        boost::system::error_code error;
+        boost::filesystem::remove(_path, error);
+    }
+
+private:
+    struct Connection
+    {
+        Connection(boost::asio::io_service& service):
+            socket{service},
+            buffer{}
+        {}
+        
+        Protocol::socket socket;
+        boost::asio::streambuf buffer;
+    };
+    
+    void accept()
+    {
+        auto connection = std::make_shared<Connection>(_service);
+        _acceptor.async_accept(connection->socket, [this, connection](boost::system::error_code const& error)
+        {
+            if (!error)
+            {
+                read(connection);
+            }
+            accept();
+        });
+    }
+    
+    void read(std::shared_ptr<Connection> connection)
+    {
+        boost::asio::async_read_until(connection->socket, connection->buffer, '\n', [this, connection](boost::system::error_code const& error, std::size_t)
+        {
+            if (error)
+            {
+                return;
+            }
+            
+            std::istream stream{&connection->buffer};
+            std::string line;
+            std::getline(stream, line);
+            
+            auto reply = handle(line) + "\n";
+            boost::system::error_code writeError;
+            boost::asio::write(connection->socket, boost::asio::buffer(reply), writeError);
+            if (!writeError)
+            {
+                read(connection);
+            }
+        });
+    }
+    
+    // Measures the time from receiving a command to having its reply.
+    std::string handle(std::string const& line)
+    {
+        auto start = Clock::now();
+        
+        auto command = Command::Parse(line);
+        auto reply = command->reply.get_future();
+        if (!_commands.push(command))
+        {
+            return "error shutting down";
+        }
+        std::string result;
+        try
+        {
+            result = reply.get();
+        }
+        catch (std::future_error&)
+        {
+            // Dropped unanswered by a playback thread that gave up.
+            return "error shutting down";
+        }
+        
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+        _count.store(_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        _total.store(_total.load(std::memory_order_relaxed) + elapsed, std::memory_order_relaxed);
+        if (elapsed > _worst.load(std::memory_order_relaxed))
+        {
+            _worst.store(elapsed, std::memory_order_relaxed);
+        }
+        
+        return result;
+    }
+    
+    std::string _path;
+    CommandQueue& _commands;
+    boost::asio::io_service _service;
+    Protocol::acceptor _acceptor;
+    std::thread _thread;
+    
+    std::atomic<unsigned long> _count;
+    std::atomic<long long> _total;
+    std::atomic<long long> _worst;
+    
+    friend std::ostream& operator<<(std::ostream& os, Server const& server)
+    {
+        auto count = server._count.load(std::memory_order_relaxed);
+        os << vf::format(
+            "Control: %d commands, latency %.1f us average, %d us worst",
+            count,
+            count > 0 ? static_cast<double>(server._total.load(std::memory_order_relaxed)) / count : 0.0,
+            server._worst.load(std::memory_order_relaxed)
+        ) << std::endl;
+        
+        return os;
+    }
+};
+
+// A change to playback requested from within the process, such as by a
+// key. Small and copyable, so it is passed by value.
+struct Action
+{
+    enum class Type
+    {
+        Pause,
+        Seek,
+        Volume,
+        Next,
+        Quit,
+    };
+    
+    Type type;
+    double value;
+    Clock::time_point time;
+};
+
+// Carries actions from any thread to the output thread, which applies them
+// between blocks and while it waits for a buffer. Posting and applying go
+// through a lock-free queue, so neither side ever blocks on the other; if
+// the queue is full, the action is dropped and counted. Applying measures
+// how long actions waited and how long the output thread spent on them.
+class Actions
+{
+public:
+    explicit Actions(std::size_t capacity = 64):
+        _actions{capacity},
+        _dropped{0},
+        _latency{},
+        _worstApply{0}
+    {}
+    
+    Actions(Actions const& other) = delete;
+    Actions& operator=(Actions const& other) = delete;
+    
+    bool post(Action::Type type, double value = 0.0)
+    {
+        if (!_actions.tryPush({type, value, Clock::now()}))
+        {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+    
+    // Only to be called by the output thread.
+    template<typename TFunction>
+    void apply(TFunction function)
+    {
+        Action action;
+        if (!_actions.tryPop(action))
+        {
+            return;
+        }
+        
+        auto start = Clock::now();
+        do
+        {
+            _latency.record(std::chrono::duration<double>(start - action.time).count());
+            function(action);
+        }
+        while (_actions.tryPop(action));
+        
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+        if (elapsed > _worstApply.load(std::memory_order_relaxed))
+        {
+            _worstApply.store(elapsed, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    MpscQueue<Action> _actions;
+    std::atomic<unsigned long> _dropped;
+    realtime::LatencyHistogram _latency;
+    std::atomic<long long> _worstApply;
+    
+    friend std::ostream& operator<<(std::ostream& os, Actions const& actions)
+    {
+        os << vf::format(
+            "Actions: %d applied, %d dropped, latency %.1f us p50, %.1f us p99, %.1f us worst, applying %d us worst",
+            actions._latency.count(),
+            actions._dropped.load(std::memory_order_relaxed),
+            actions._latency.percentile(0.50) * 1e6,
+            actions._latency.percentile(0.99) * 1e6,
+            actions._latency.worst() * 1e6,
+            actions._worstApply.load(std::memory_order_relaxed)
+        ) << std::endl;
+        
+        return os;
+    }
+};
+
+// Sends a command to a running daemon and returns its reply.
+inline std::string send(std::string const& path, std::string const& line)
+{
+    boost::asio::io_service service;
+    Protocol::socket socket{service};
+    
+    boost::system::error_code error;
+    socket.connect(Protocol::endpoint{path}, error);
+    if (error)
+    {
+        throw std::runtime_error(vf::format("no daemon listening on %s", path));
+    }
+    
+    boost::asio::write(socket, boost::asio::buffer(line + "\n"));
+    
+    boost::asio::streambuf buffer;
+    boost::asio::read_until(socket, buffer, '\n');
+    
+    std::istream stream{&buffer};
+    std::string reply;
+    std::getline(stream, reply);
+    return reply;
+}
+
+} // control
+} // vf
+
+#endif // VF_CONTROL_HPP_INCLUDED
\ No newline at end of file
@@ -0,0 +1,132 @@
+#ifndef VF_CONVERTER_HPP_INCLUDED
+#define VF_CONVERTER_HPP_INCLUDED
+
+#include <cstdint>
+
+#include "arena.hpp"
+#include "ext/av.hpp"
+
+namespace vf {
+
+// Converts decoded frames to interleaved float at the output rate. The
+// samples land in a buffer carved from an arena of the converter, sized when
+// the decoder is opened for one frame of the codec plus what the resampler
+// may still hold back. Codecs without a fixed frame size start out with
+// DefaultFrameSize. The buffer only grows for a frame that would not fit.
+class Converter
+{
+public:
+    static constexpr int DefaultFrameSize = 4096;
+    
+    Converter(ext::av::CodecContext const& codecContext, int outputRate, ext::swr::Quality quality):
+        Converter(
+            codecContext.channelLayout() ? codecContext.channelLayout() : av_get_default_channel_layout(codecContext.channels()),
+            codecContext.sampleFormat(),
+            codecContext.sampleRate(),
+            codecContext.channels(),
+            codecContext.frameSize(),
+            outputRate,
+            quality
+        )
+    {}
+    
+    Converter(ext::av::Stream const& stream, int outputRate, ext::swr::Quality quality):
+        Converter(
+            stream.channelLayout(),
+            stream.sampleFormat(),
+            stream.sampleRate(),
+            stream.channels(),
+            stream.frameSize(),
+            outputRate,
+            quality
+        )
+    {}
+    
+    Converter(uint64_t layout, ext::av::SampleFormat format, int inputRate, int channels, int frameSize, int outputRate, ext::swr::Quality quality):
+        _resampler{layout, format, inputRate, outputRate, quality, ext::av::SampleFormat::FLT},
+        _inputRate{inputRate},
+        _channels{channels},
+        _arena{},
+        _samples{nullptr},
+        _capacity{0}
+    {
+        if (frameSize <= 0)
+        {
+            frameSize = DefaultFrameSize;
+        }
+        reserve(outputFrames(frameSize));
+    }
+    
+    Converter(Converter const& other) = delete;
+    Converter& operator=(Converter const& other) = delete;
+    
+    inline int channels() const
+    {
+        return _channels;
+    }
+    
+    inline int outputRate() const
+    {
+        return _resampler.outputRate();
+    }
+    
+    inline float* data() const
+    {
+        return _samples;
+    }
+    
+    inline Arena const& arena() const
+    {
+        return _arena;
+    }
+    
+    // Makes room for at least the given number of frames in data().
+    void reserve(int frames)
+    {
+        if (frames <= _capacity)
+        {
+            return;
+        }
+        
+        auto frameBytes = static_cast<std::size_t>(_channels) * sizeof(float);
+        _arena.reserve(static_cast<std::size_t>(frames) * frameBytes);
+        _arena.reset();
+        _capacity = static_cast<int>(_arena.capacity() / frameBytes);
+        _samples = _arena.allocate<float>(static_cast<std::size_t>(_capacity) * _channels);
+    }
+    
+    // Returns the number of frames converted into data().
+    int convert(ext::av::Frame const& frame)
+    {
+        reserve(outputFrames(frame.numberSamples()));
+        auto data = reinterpret_cast<uint8_t*>(_samples);
+        return _resampler.convert(frame, &data, _capacity);
+    }
+    
+    // Drains the resampler at the end of the stream.
+    int flush()
+    {
+        reserve(outputFrames(0));
+        auto data = reinterpret_cast<uint8_t*>(_samples);
+        return _resampler.convert(nullptr, 0, &data, _capacity);
+    }
+
+private:
+    // Output frames of converting the given number of input frames, on top
+    // of those the resampler still holds back.
+    inline int outputFrames(int frames) const
+    {
+        return static_cast<int>(_resampler.delay() + av_rescale_rnd(frames, _resampler.outputRate(), _inputRate, AV_ROUND_UP));
+    }
+    
+    ext::swr::Context _resampler;
+    int _inputRate;
+    int _channels;
+    Arena _arena;
+    float* _samples;
+    int _capacity;
+};
+
+} // vf
+
+#endif // VF_CONVERTER_HPP_INCLUDED
\ No newline at end of file
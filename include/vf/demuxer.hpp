@@ -0,0 +1,250 @@
+#ifndef VF_DEMUXER_HPP_INCLUDED
+#define VF_DEMUXER_HPP_INCLUDED
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ext/av.hpp"
+#include "format.hpp"
+#include "queue.hpp"
+
+namespace vf {
+
+// Reads a file once and decodes any number of its streams concurrently. The
+// demuxer thread dispatches each packet by stream index to the queue of the
+// decoder that selected the stream, and drops the packets of other streams.
+// Every decoder runs on a thread of its own and hands its frames to a
+// handler on that thread. A full queue holds up the demuxer and with it the
+// other decoders, so queues are bounded by duration to keep streams of
+// different packet rates in step.
+class Demuxer
+{
+public:
+    using Handler = std::function<void(ext::av::Frame const&)>;
+    
+    struct Options
+    {
+        std::size_t packetBytes;
+        double packetDuration;
+    };
+    
+    Demuxer(std::string const& path, Options const& options):
+        _options(options),
+        _formatContext{ext::av::FormatContext::Null},
+        _decoders{},
+        _demuxError{},
+        _stopped{false},
+        _thread{}
+    {
+        _formatContext.open(path);
+        _formatContext.maxAnalyzeDuration(1.5);
+        _formatContext.findStreamInfo();
+        
+        _decoders.resize(static_cast<std::size_t>(_formatContext.streamCount()));
+    }
+    
+    Demuxer(Demuxer const& other) = delete;
+    Demuxer& operator=(Demuxer const& other) = delete;
+    
+    ~Demuxer()
+    {
+        _stopped = true;
+        for (auto& decoder: _decoders)
+        {
+            if (decoder)
+            {
+                decoder->packets.clear();
+            }
+        }
+        if (_thread.joinable())
+        {
+            _thread.join();
+        }
+        for (auto& decoder: _decoders)
+        {
+            if (decoder)
+            {
+                if (decoder->thread.joinable())
+                {
+                    decoder->thread.join();
+                }
+                decoder->codecContext.close();
+            }
+        }
+        
+        _formatContext.close();
+    }
+    
+    inline int streamCount() const
+    {
+        return _formatContext.streamCount();
+    }
+    
+    inline ext::av::Stream stream(int index) const
+    {
+        return _formatContext.stream(index);
+    }
+    
+    // Opens a decoder for the stream. Only valid before start().
+    void select(int index, Handler handler)
+    {
+        auto& slot = _decoders.at(static_cast<std::size_t>(index));
+        if (slot)
+        {
+            throw std::runtime_error(vf::format("Stream %d is already selected.", index));
+        }
+        
+        std::unique_ptr<Decoder> decoder{new Decoder{stream(index), std::move(handler), _options}};
+        decoder->codecContext.open(decoder->stream);
+        slot = std::move(decoder);
+    }
+    
+    void start()
+    {
+        for (auto& decoder: _decoders)
+        {
+            if (decoder)
+            {
+                auto* d = decoder.get();
+                d->thread = std::thread{[d] { decode(*d); }};
+            }
+        }
+        _thread = std::thread{[this] { demux(); }};
+    }
+    
+    // Waits until all selected streams are decoded and rethrows the first
+    // error of the demuxer or a decoder.
+    void wait()
+    {
+        _thread.join();
+        for (auto& decoder: _decoders)
+        {
+            if (decoder)
+            {
+                decoder->thread.join();
+            }
+        }
+        
+        if (_demuxError)
+        {
+            std::rethrow_exception(_demuxError);
+        }
+        for (auto& decoder: _decoders)
+        {
+            if (decoder && decoder->error)
+            {
+                std::rethrow_exception(decoder->error);
+            }
+        }
+    }
+
+private:
+    struct Decoder
+    {
+        Decoder(ext::av::Stream const& stream, Handler handler, Options const& options):
+            stream(stream),
+            codecContext{ext::av::CodecContext::Null},
+            packets{{std::numeric_limits<std::size_t>::max(), options.packetBytes, options.packetDuration}},
+            handler{std::move(handler)},
+            error{},
+            thread{}
+        {}
+        
+        ext::av::Stream stream;
+        ext::av::CodecContext codecContext;
+        BoundedQueue<ext::av::Packet> packets;
+        Handler handler;
+        std::exception_ptr error;
+        std::thread thread;
+    };
+    
+    void demux()
+    {
+        VF_TRACE_THREAD("demux");
+        
+        try
+        {
+            while (!_stopped)
+            {
+                ext::av::Packet packet;
+                try
+                {
+                    _formatContext.readFrame(packet);
+                }
+                catch (std::runtime_error&)
+                {
+                    break;
+                }
+                
+                auto index = static_cast<std::size_t>(packet.streamIndex());
+                if (index >= _decoders.size() || !_decoders[index])
+                {
+                    continue;
+                }
+                
+                // A decoder that failed has closed its queue and is skipped.
+                auto& decoder = *_decoders[index];
+                packet.duplicate();
+                auto size = static_cast<std::size_t>(packet.size());
+                auto duration = packet.duration() * decoder.stream.timeBase();
+                decoder.packets.push(std::move(packet), size, duration);
+            }
+        }
+        catch (...)
+        {
+            _demuxError = std::current_exception();
+        }
+        
+        for (auto& decoder: _decoders)
+        {
+            if (decoder)
+            {
+                decoder->packets.close();
+            }
+        }
+    }
+    
+    static void decode(Decoder& decoder)
+    {
+        VF_TRACE_THREAD("decode");
+        
+        try
+        {
+            auto video = decoder.stream.type() == ext::av::MediaType::Video;
+            
+            ext::av::Frame frame;
+            ext::av::Packet packet;
+            while (decoder.packets.pop(packet))
+            {
+                auto available = video ? decoder.codecContext.decodeVideo(frame, packet) : decoder.codecContext.decodeAudio(frame, packet);
+                if (available)
+                {
+                    decoder.handler(frame);
+                }
+            }
+        }
+        catch (...)
+        {
+            decoder.error = std::current_exception();
+            decoder.packets.clear();
+        }
+    }
+    
+    Options _options;
+    ext::av::FormatContext _formatContext;
+    std::vector<std::unique_ptr<Decoder>> _decoders;
+    std::exception_ptr _demuxError;
+    std::atomic<bool> _stopped;
+    std::thread _thread;
+};
+
+} // vf
+
+#endif // VF_DEMUXER_HPP_INCLUDED
\ No newline at end of file
@@ -0,0 +1,295 @@
+#ifndef VF_DISK_CACHE_HPP_INCLUDED
+#define VF_DISK_CACHE_HPP_INCLUDED
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "ext/al.hpp"
+#include "fingerprint.hpp"
+#include "format.hpp"
+
+namespace vf {
+
+// Stores decoded audio as raw files in a cache directory, one file per
+// source. A file starts with a fixed 64 byte header followed by the samples
+// exactly as they are uploaded, so a cached source can be mapped into memory
+// and handed to OpenAL without decoding.
+class DiskCache
+{
+public:
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t format;
+        uint32_t sampleRate;
+        uint32_t channels;
+        uint64_t fingerprint;
+        uint64_t sourceSize;
+        int64_t sourceModified;
+        uint64_t dataSize;
+        uint8_t reserved[8];
+    };
+    
+    static_assert(sizeof(Header) == 64, "Wrong size!");
+    
+    static constexpr char const* Magic = "VFPCM\r\n\x1a";
+    static constexpr uint32_t Version = 1;
+    
+    // Identifies a source by its location, size and modification time, and
+    // the processing applied to it by its variant.
+    struct Source
+    {
+        std::string path;
+        uint64_t size;
+        int64_t modified;
+        std::string variant;
+        
+        inline uint64_t fingerprint() const
+        {
+            return vf::fingerprint(path, size, modified, variant);
+        }
+    };
+    
+    // A cached source mapped read-only into memory.
+    class Entry
+    {
+    public:
+        Entry(std::string const& path):
+            _mapping{path.c_str(), boost::interprocess::read_only},
+            _region{_mapping, boost::interprocess::read_only}
+        {
+            _region.advise(boost::interprocess::mapped_region::advice_sequential);
+        }
+        
+        inline Header const& header() const
+        {
+            return *static_cast<Header const*>(_region.get_address());
+        }
+        
+        inline ext::al::Format format() const
+        {
+            return static_cast<ext::al::Format>(header().format);
+        }
+        
+        inline int sampleRate() const
+        {
+            return static_cast<int>(header().sampleRate);
+        }
+        
+        inline uint8_t const* data() const
+        {
+            return static_cast<uint8_t const*>(_region.get_address()) + sizeof(Header);
+        }
+        
+        inline std::size_t size() const
+        {
+            return static_cast<std::size_t>(header().dataSize);
+        }
+    
+    private:
+        friend class DiskCache;
+        
+        bool valid(Source const& source) const
+        {
+            if (_region.get_size() < sizeof(Header))
+            {
+                return false;
+            }
+            
+            auto const& h = header();
+            return std::memcmp(h.magic, Magic, sizeof(h.magic)) == 0
+                && h.version == Version
+                && h.fingerprint == source.fingerprint()
+                && h.sourceSize == source.size
+                && h.sourceModified == source.modified
+                && h.dataSize <= _region.get_size() - sizeof(Header);
+        }
+        
+        boost::interprocess::file_mapping _mapping;
+        boost::interprocess::mapped_region _region;
+    };
+    
+    // Streams samples into a temporary file that is moved into place by
+    // commit(). An uncommitted writer removes its file again.
+    class Writer
+    {
+    public:
+        Writer(Writer const& other) = delete;
+        Writer& operator=(Writer const& other) = delete;
+        
+        ~Writer()
+        {
+            if (!_committed)
+            {
+                _stream.close();
+                boost::system::error_code error;
+                boost::filesystem::remove(_temporary, error);
+            }
+        }
+        
+        inline void write(uint8_t const* data, std::size_t size)
+        {
+            _stream.write(reinterpret_cast<char const*>(data), size);
+            _header.dataSize += size;
+        }
+        
+        bool commit()
+        {
+            _stream.seekp(0);
+            _stream.write(reinterpret_cast<char const*>(&_header), sizeof(_header));
+            _stream.close();
+            
+            if (!_stream)
+            {
+                return false;
+            }
+            
+            boost::system::error_code error;
+            boost::filesystem::rename(_temporary, _path, error);
+            _committed = !error;
+            if (_committed)
+            {
+                ++_cache._writes;
+            }
+            return _committed;
+        }
+    
+    private:
+        friend class DiskCache;
+        
+        Writer(DiskCache& cache, Source const& source, ext::al::Format format, int sampleRate, int channels):
+            _cache(cache),
+            _path{cache.path(source)},
+            _temporary{boost::filesystem::unique_path(_path.string() + ".%%%%%%.tmp")},
+            _stream{},
+            _header(),
+            _committed{false}
+        {
+            std::memcpy(_header.magic, Magic, sizeof(_header.magic));
+            _header.version = Version;
+            _header.format = static_cast<uint32_t>(format);
+            _header.sampleRate = static_cast<uint32_t>(sampleRate);
+            _header.channels = static_cast<uint32_t>(channels);
+            _header.fingerprint = source.fingerprint();
+            _header.sourceSize = source.size;
+            _header.sourceModified = source.modified;
+            _header.dataSize = 0;
+            
+            _stream.open(_temporary.string(), std::ios::binary | std::ios::trunc);
+            _stream.write(reinterpret_cast<char const*>(&_header), sizeof(_header));
+        }
+        
+        DiskCache& _cache;
+        boost::filesystem::path _path;
+        boost::filesystem::path _temporary;
+        std::ofstream _stream;
+        Header _header;
+        bool _committed;
+    };
+    
+    explicit DiskCache(std::string const& directory):
+        _directory{directory},
+        _hits{0},
+        _misses{0},
+        _writes{0}
+    {
+        if (enabled())
+        {
+            boost::filesystem::create_directories(_directory);
+        }
+    }
+    
+    DiskCache(DiskCache const& other) = delete;
+    DiskCache& operator=(DiskCache const& other) = delete;
+    
+    inline bool enabled() const
+    {
+        return !_directory.empty();
+    }
+    
+    std::unique_ptr<Entry const> find(Source const& source)
+    {
+        if (!enabled())
+        {
+            return {};
+        }
+        
+        auto file = path(source);
+        
+        boost::system::error_code error;
+        if (!boost::filesystem::is_regular_file(file, error))
+        {
+            ++_misses;
+            return {};
+        }
+        
+        try
+        {
+            std::unique_ptr<Entry> entry{new Entry{file.string()}};
+            if (entry->valid(source))
+            {
+                ++_hits;
+                return std::move(entry);
+            }
+        }
+        catch (boost::interprocess::interprocess_exception&)
+        {
+        }
+        
+        ++_misses;
+        return {};
+    }
+    
+    std::unique_ptr<Writer> writer(Source const& source, ext::al::Format format, int sampleRate, int channels)
+    {
+        if (!enabled())
+        {
+            return {};
+        }
+        
+        std::unique_ptr<Writer> result{new Writer{*this, source, format, sampleRate, channels}};
+        if (!result->_stream)
+        {
+            return {};
+        }
+        return result;
+    }
+
+private:
+    boost::filesystem::path path(Source const& source) const
+    {
+        return _directory / vf::format("%016x.pcm", source.fingerprint());
+    }
+    
+    boost::filesystem::path _directory;
+    
+    std::atomic<unsigned long> _hits;
+    std::atomic<unsigned long> _misses;
+    std::atomic<unsigned long> _writes;
+    
+    friend std::ostream& operator<<(std::ostream& os, DiskCache const& cache)
+    {
+        os << vf::format(
+            "Disk Cache: %d hits, %d misses, %d writes",
+            cache._hits.load(),
+            cache._misses.load(),
+            cache._writes.load()
+        ) << std::endl;
+        
+        return os;
+    }
+};
+
+} // vf
+
+#endif // VF_DISK_CACHE_HPP_INCLUDED
\ No newline at end of file
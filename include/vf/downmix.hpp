@@ -0,0 +1,338 @@
+#ifndef VF_DOWNMIX_HPP_INCLUDED
+#define VF_DOWNMIX_HPP_INCLUDED
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "arena.hpp"
+#include "config.hpp"
+#include "format.hpp"
+#include "ext/av.hpp"
+
+#if defined(SIMD_SSE2)
+
+#include <emmintrin.h>
+
+#endif
+
+namespace vf {
+namespace downmix {
+
+// The output is always interleaved stereo.
+static constexpr int Outputs = 2;
+
+// Gains from every input channel to the left and right output, in the
+// order the channels are interleaved.
+struct Matrix
+{
+    int inputs;
+    std::vector<float> left;
+    std::vector<float> right;
+};
+
+inline bool identity(Matrix const& matrix)
+{
+    return matrix.inputs == 2 &&
+        matrix.left[0] == 1.0f && matrix.left[1] == 0.0f &&
+        matrix.right[0] == 0.0f && matrix.right[1] == 1.0f;
+}
+
+// The usual ITU style downmix: centre and surround channels at -3 dB, the
+// LFE dropped, and the matrix scaled so no output can exceed the loudest
+// input. Unknown layouts are taken to be the default for their number of
+// channels; mono goes to both sides at full level.
+inline Matrix standard(uint64_t layout, int channels)
+{
+    if (layout == 0 || av_get_channel_layout_nb_channels(layout) != channels)
+    {
+        layout = static_cast<uint64_t>(av_get_default_channel_layout(channels));
+    }
+    
+    Matrix matrix{channels, std::vector<float>(channels, 0.0f), std::vector<float>(channels, 0.0f)};
+    if (channels == 1)
+    {
+        matrix.left[0] = 1.0f;
+        matrix.right[0] = 1.0f;
+        return matrix;
+    }
+    
+    auto const half = static_cast<float>(M_SQRT1_2);
+    auto input = 0;
+    for (uint64_t bit = 1; bit != 0 && input < channels; bit <<= 1)
+    {
+        if ((layout & bit) == 0)
+        {
+            continue;
+        }
+        
+        switch (bit)
+        {
+            case AV_CH_FRONT_LEFT:
+            case AV_CH_FRONT_LEFT_OF_CENTER:
+                matrix.left[input] = 1.0f;
+                break;
+            case AV_CH_FRONT_RIGHT:
+            case AV_CH_FRONT_RIGHT_OF_CENTER:
+                matrix.right[input] = 1.0f;
+                break;
+            case AV_CH_FRONT_CENTER:
+                matrix.left[input] = half;
+                matrix.right[input] = half;
+                break;
+            case AV_CH_BACK_LEFT:
+            case AV_CH_SIDE_LEFT:
+                matrix.left[input] = half;
+                break;
+            case AV_CH_BACK_RIGHT:
+            case AV_CH_SIDE_RIGHT:
+                matrix.right[input] = half;
+                break;
+            case AV_CH_BACK_CENTER:
+                matrix.left[input] = 0.5f;
+                matrix.right[input] = 0.5f;
+                break;
+            default:
+                break;
+        }
+        ++input;
+    }
+    
+    auto sum = std::max(
+        std::accumulate(matrix.left.begin(), matrix.left.end(), 0.0f),
+        std::accumulate(matrix.right.begin(), matrix.right.end(), 0.0f)
+    );
+    if (sum > 1.0f)
+    {
+        for (int i = 0; i < channels; ++i)
+        {
+            matrix.left[i] /= sum;
+            matrix.right[i] /= sum;
+        }
+    }
+    return matrix;
+}
+
+// Reads matrices from a text file. Each line holds the number of input
+// channels followed by a gain for each of them; the first line for a
+// number of channels is the left output, the second the right one, such as
+// "6 1 0 0.5 0 0.7 0" and "6 0 1 0.5 0 0 0.7" for 5.1. Empty lines and
+// lines starting with # are skipped.
+inline std::vector<Matrix> load(std::string const& path)
+{
+    std::ifstream stream{path};
+    if (!stream)
+    {
+        throw std::runtime_error(vf::format("Failed to open downmix file %s.", path));
+    }
+    
+    std::vector<Matrix> matrices;
+    std::string line;
+    for (int number = 1; std::getline(stream, line); ++number)
+    {
+        std::istringstream fields{line};
+        std::string first;
+        if (!(fields >> first) || first[0] == '#')
+        {
+            continue;
+        }
+        
+        auto inputs = std::atoi(first.c_str());
+        std::vector<float> row(inputs > 0 ? inputs : 0);
+        for (auto& gain: row)
+        {
+            fields >> gain;
+        }
+        if (inputs <= 0 || !fields)
+        {
+            throw std::runtime_error(vf::format("Invalid downmix row in %s line %d.", path, number));
+        }
+        
+        auto match = std::find_if(matrices.begin(), matrices.end(), [inputs](Matrix const& matrix) { return matrix.inputs == inputs; });
+        if (match == matrices.end())
+        {
+            matrices.push_back({inputs, row, {}});
+        }
+        else if (match->right.empty())
+        {
+            match->right = row;
+        }
+        else
+        {
+            throw std::runtime_error(vf::format("More than two rows for %d channels in %s line %d.", inputs, path, number));
+        }
+    }
+    
+    for (auto const& matrix: matrices)
+    {
+        if (matrix.right.empty())
+        {
+            throw std::runtime_error(vf::format("Missing right row for %d channels in %s.", matrix.inputs, path));
+        }
+    }
+    return matrices;
+}
+
+// The gains of the matrices, for telling processed audio apart.
+inline std::string describe(std::vector<Matrix> const& matrices)
+{
+    std::string result;
+    for (auto const& matrix: matrices)
+    {
+        result += vf::format("%d", matrix.inputs);
+        for (auto rows: {&matrix.left, &matrix.right})
+        {
+            for (auto gain: *rows)
+            {
+                result += vf::format(" %g", gain);
+            }
+        }
+        result += ";";
+    }
+    return result;
+}
+
+// The matrix given for the number of channels, or the standard one.
+inline Matrix select(std::vector<Matrix> const& matrices, uint64_t layout, int channels)
+{
+    for (auto const& matrix: matrices)
+    {
+        if (matrix.inputs == channels)
+        {
+            return matrix;
+        }
+    }
+    return standard(layout, channels);
+}
+
+// Applies a matrix to interleaved frames. Four frames are mixed at a time:
+// each input channel of the four is gathered into a vector and added to
+// the left and right sums with its gains, which are kept broadcast to all
+// lanes. The sums are interleaved and either stored as float or quantized
+// to 16 bit on the way out, so mixing and quantizing read and write the
+// samples once. The gains are laid out when the mixer is made.
+class Mixer
+{
+public:
+    explicit Mixer(Matrix const& matrix):
+        _inputs{matrix.inputs},
+        _identity{downmix::identity(matrix)},
+        _arena{2 * Arena::aligned(static_cast<std::size_t>(matrix.inputs) * 4 * sizeof(float))},
+        _left{_arena.allocate<float>(static_cast<std::size_t>(matrix.inputs) * 4)},
+        _right{_arena.allocate<float>(static_cast<std::size_t>(matrix.inputs) * 4)}
+    {
+        for (int c = 0; c < _inputs; ++c)
+        {
+            std::fill(_left + 4 * c, _left + 4 * c + 4, matrix.left[c]);
+            std::fill(_right + 4 * c, _right + 4 * c + 4, matrix.right[c]);
+        }
+    }
+    
+    Mixer(Mixer const& other) = delete;
+    Mixer& operator=(Mixer const& other) = delete;
+    
+    inline int inputs() const
+    {
+        return _inputs;
+    }
+    
+    // Stereo that passes through unchanged.
+    inline bool identity() const
+    {
+        return _identity;
+    }
+    
+    void process(float const* src, std::size_t frames, int16_t* dst) const
+    {
+        std::size_t i = 0;
+#if defined(SIMD_SSE2)
+        auto factor = _mm_set1_ps(32767.0f);
+        auto upper = _mm_set1_ps(1.0f);
+        auto lower = _mm_set1_ps(-1.0f);
+        for (; i + 4 <= frames; i += 4)
+        {
+            __m128 left;
+            __m128 right;
+            mix(src + i * _inputs, left, right);
+            left = _mm_mul_ps(_mm_min_ps(_mm_max_ps(left, lower), upper), factor);
+            right = _mm_mul_ps(_mm_min_ps(_mm_max_ps(right, lower), upper), factor);
+            auto packed = _mm_packs_epi32(
+                _mm_cvtps_epi32(_mm_unpacklo_ps(left, right)),
+                _mm_cvtps_epi32(_mm_unpackhi_ps(left, right))
+            );
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2 * i), packed);
+        }
+#endif
+        for (; i < frames; ++i)
+        {
+            float left;
+            float right;
+            mix(src + i * _inputs, left, right);
+            dst[2 * i] = static_cast<int16_t>(std::lrint(std::min(1.0f, std::max(-1.0f, left)) * 32767.0f));
+            dst[2 * i + 1] = static_cast<int16_t>(std::lrint(std::min(1.0f, std::max(-1.0f, right)) * 32767.0f));
+        }
+    }
+    
+    void process(float const* src, std::size_t frames, float* dst) const
+    {
+        std::size_t i = 0;
+#if defined(SIMD_SSE2)
+        for (; i + 4 <= frames; i += 4)
+        {
+            __m128 left;
+            __m128 right;
+            mix(src + i * _inputs, left, right);
+            _mm_storeu_ps(dst + 2 * i, _mm_unpacklo_ps(left, right));
+            _mm_storeu_ps(dst + 2 * i + 4, _mm_unpackhi_ps(left, right));
+        }
+#endif
+        for (; i < frames; ++i)
+        {
+            mix(src + i * _inputs, dst[2 * i], dst[2 * i + 1]);
+        }
+    }
+
+private:
+#if defined(SIMD_SSE2)
+    inline void mix(float const* frames, __m128& left, __m128& right) const
+    {
+        auto n = _inputs;
+        left = _mm_setzero_ps();
+        right = _mm_setzero_ps();
+        for (int c = 0; c < n; ++c)
+        {
+            auto samples = _mm_set_ps(frames[3 * n + c], frames[2 * n + c], frames[n + c], frames[c]);
+            left = _mm_add_ps(left, _mm_mul_ps(samples, _mm_load_ps(_left + 4 * c)));
+            right = _mm_add_ps(right, _mm_mul_ps(samples, _mm_load_ps(_right + 4 * c)));
+        }
+    }
+#endif
+
+    inline void mix(float const* frame, float& left, float& right) const
+    {
+        left = 0.0f;
+        right = 0.0f;
+        for (int c = 0; c < _inputs; ++c)
+        {
+            left += frame[c] * _left[4 * c];
+            right += frame[c] * _right[4 * c];
+        }
+    }
+    
+    int _inputs;
+    bool _identity;
+    Arena _arena;
+    float* _left;
+    float* _right;
+};
+
+} // downmix
+} // vf
+
+#endif // VF_DOWNMIX_HPP_INCLUDED
\ No newline at end of file
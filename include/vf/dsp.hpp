@@ -0,0 +1,594 @@
+#ifndef VF_DSP_HPP_INCLUDED
+#define VF_DSP_HPP_INCLUDED
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+#include "eq.hpp"
+
+#if defined(SIMD_SSE2)
+
+#include <emmintrin.h>
+
+#endif
+
+namespace vf {
+namespace dsp {
+
+inline float decibelsToGain(float decibels)
+{
+    return std::pow(10.0f, decibels / 20.0f);
+}
+
+// Multiplies samples by a constant gain.
+inline void scale(float* samples, std::size_t count, float gain)
+{
+    std::size_t i = 0;
+#if defined(SIMD_SSE2)
+    auto g = _mm_set1_ps(gain);
+    for (; i + 8 <= count; i += 8)
+    {
+        _mm_storeu_ps(samples + i, _mm_mul_ps(_mm_loadu_ps(samples + i), g));
+        _mm_storeu_ps(samples + i + 4, _mm_mul_ps(_mm_loadu_ps(samples + i + 4), g));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        samples[i] *= gain;
+    }
+}
+
+// Largest absolute sample value.
+inline float peak(float const* samples, std::size_t count)
+{
+    std::size_t i = 0;
+    auto result = 0.0f;
+#if defined(SIMD_SSE2)
+    auto mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    auto max = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4)
+    {
+        max = _mm_max_ps(max, _mm_and_ps(_mm_loadu_ps(samples + i), mask));
+    }
+    max = _mm_max_ps(max, _mm_shuffle_ps(max, max, _MM_SHUFFLE(1, 0, 3, 2)));
+    max = _mm_max_ps(max, _mm_shuffle_ps(max, max, _MM_SHUFFLE(2, 3, 0, 1)));
+    result = _mm_cvtss_f32(max);
+#endif
+    for (; i < count; ++i)
+    {
+        result = std::max(result, std::abs(samples[i]));
+    }
+    return result;
+}
+
+// Sum of the products of two sequences, accumulated in four lanes.
+inline float dot(float const* a, float const* b, std::size_t count)
+{
+    std::size_t i = 0;
+    auto result = 0.0f;
+#if defined(SIMD_SSE2)
+    auto sum0 = _mm_setzero_ps();
+    auto sum1 = _mm_setzero_ps();
+    for (; i + 8 <= count; i += 8)
+    {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    auto sum = _mm_add_ps(sum0, sum1);
+    sum = _mm_add_ps(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_ps(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    result = _mm_cvtss_f32(sum);
+#endif
+    for (; i < count; ++i)
+    {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
+// Converts float samples in [-1, 1] to signed 16 bit, saturating the rest.
+inline void quantize(float const* src, int16_t* dst, std::size_t count)
+{
+    std::size_t i = 0;
+#if defined(SIMD_SSE2)
+    auto factor = _mm_set1_ps(32767.0f);
+    auto upper = _mm_set1_ps(1.0f);
+    auto lower = _mm_set1_ps(-1.0f);
+    for (; i + 8 <= count; i += 8)
+    {
+        auto a = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i), lower), upper);
+        auto b = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i + 4), lower), upper);
+        auto packed = _mm_packs_epi32(
+            _mm_cvtps_epi32(_mm_mul_ps(a, factor)),
+            _mm_cvtps_epi32(_mm_mul_ps(b, factor))
+        );
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), packed);
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        auto value = std::min(1.0f, std::max(-1.0f, src[i]));
+        dst[i] = static_cast<int16_t>(std::lrint(value * 32767.0f));
+    }
+}
+
+// Look-ahead peak limiter. Frames are delayed by the look-ahead length L.
+// The gain needed to keep each frame below the threshold goes through a
+// sliding minimum and a moving average, both over L + 1 frames, with a
+// release follower in between. The average starts ramping down L frames
+// before a peak, and it never exceeds what the delayed frame needs. So the
+// output stays below the threshold and the gain changes without steps.
+// All state is allocated up front.
+//
+// Frames are processed in chunks. The gain each frame of a chunk requires is
+// worked out four frames at a time, and the delayed frames are scaled and
+// swapped with the new ones four samples at a time, in runs of consecutive
+// delay line slots. The minimum, release and average in between carry state
+// from one frame to the next and stay scalar, at a few operations a frame.
+class Limiter
+{
+public:
+    static constexpr std::size_t ChunkFrames = 256;
+    
+    Limiter(int channels, int sampleRate, float threshold = 0.98f, float lookahead = 0.005f, float release = 0.05f):
+        _channels{channels},
+        _length{std::max(1, static_cast<int>(lookahead * sampleRate))},
+        _threshold{threshold},
+        _window{_length + 1},
+        _release{1.0f - std::exp(-1.0f / (release * sampleRate))},
+        _delay(static_cast<std::size_t>(_length * channels), 0.0f),
+        _position{0},
+        _required(static_cast<std::size_t>(_window), 1.0f),
+        _minimum(static_cast<std::size_t>(_window), 0),
+        _minimumBegin{0},
+        _minimumSize{0},
+        _smoothed(static_cast<std::size_t>(_window), 1.0f),
+        _sum{static_cast<double>(_window)},
+        _envelope{1.0f},
+        _slot{0},
+        _reduction{1.0f},
+        _gains(ChunkFrames),
+        _expanded(ChunkFrames * static_cast<std::size_t>(channels))
+    {}
+    
+    // Number of frames the output lags behind the input.
+    inline int latency() const
+    {
+        return _length;
+    }
+    
+    // Lowest gain applied so far.
+    inline float reduction() const
+    {
+        return _reduction;
+    }
+    
+    void process(float* samples, std::size_t frames)
+    {
+        for (std::size_t offset = 0; offset < frames; offset += ChunkFrames)
+        {
+            auto count = frames - offset < ChunkFrames ? frames - offset : ChunkFrames;
+            auto* chunk = samples + offset * _channels;
+            
+            require(chunk, count);
+            for (std::size_t frame = 0; frame < count; ++frame)
+            {
+                _gains[frame] = next(_gains[frame]);
+            }
+            apply(chunk, count);
+        }
+    }
+    
+    // Pushes silence through to get out the frames still in the delay line.
+    void flush(float* samples, std::size_t frames)
+    {
+        std::fill(samples, samples + frames * _channels, 0.0f);
+        process(samples, frames);
+    }
+
+private:
+    // The gain each frame needs to stay below the threshold.
+    void require(float const* samples, std::size_t frames)
+    {
+        auto* gains = _gains.data();
+        auto channels = static_cast<std::size_t>(_channels);
+        std::size_t i = 0;
+#if defined(SIMD_SSE2)
+        auto mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        auto threshold = _mm_set1_ps(_threshold);
+        auto one = _mm_set1_ps(1.0f);
+        for (; i + 4 <= frames; i += 4)
+        {
+            __m128 level;
+            if (channels == 2)
+            {
+                auto a = _mm_and_ps(_mm_loadu_ps(samples + 2 * i), mask);
+                auto b = _mm_and_ps(_mm_loadu_ps(samples + 2 * i + 4), mask);
+                level = _mm_max_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+            }
+            else
+            {
+                level = _mm_set_ps(
+                    peak(samples + (i + 3) * channels, channels),
+                    peak(samples + (i + 2) * channels, channels),
+                    peak(samples + (i + 1) * channels, channels),
+                    peak(samples + i * channels, channels)
+                );
+            }
+            auto over = _mm_cmpgt_ps(level, threshold);
+            auto gain = _mm_or_ps(_mm_and_ps(over, _mm_div_ps(threshold, level)), _mm_andnot_ps(over, one));
+            _mm_storeu_ps(gains + i, gain);
+        }
+#endif
+        for (; i < frames; ++i)
+        {
+            auto level = peak(samples + i * channels, channels);
+            gains[i] = level > _threshold ? _threshold / level : 1.0f;
+        }
+    }
+    
+    // Plays the delayed frames at their gains and keeps the new ones in
+    // their delay line slots, which are reused oldest first.
+    void apply(float* samples, std::size_t frames)
+    {
+        auto channels = static_cast<std::size_t>(_channels);
+        auto* expanded = _expanded.data();
+        std::size_t i = 0;
+#if defined(SIMD_SSE2)
+        if (channels == 2)
+        {
+            for (; i + 4 <= frames; i += 4)
+            {
+                auto gain = _mm_loadu_ps(&_gains[i]);
+                _mm_storeu_ps(expanded + 2 * i, _mm_unpacklo_ps(gain, gain));
+                _mm_storeu_ps(expanded + 2 * i + 4, _mm_unpackhi_ps(gain, gain));
+            }
+        }
+#endif
+        for (; i < frames; ++i)
+        {
+            std::fill(expanded + i * channels, expanded + (i + 1) * channels, _gains[i]);
+        }
+        
+        for (std::size_t done = 0; done < frames;)
+        {
+            auto run = std::min(frames - done, static_cast<std::size_t>(_length - _position));
+            auto count = run * channels;
+            auto* current = samples + done * channels;
+            auto* delayed = &_delay[static_cast<std::size_t>(_position) * channels];
+            auto const* gains = expanded + done * channels;
+            
+            std::size_t j = 0;
+#if defined(SIMD_SSE2)
+            for (; j + 4 <= count; j += 4)
+            {
+                auto input = _mm_loadu_ps(current + j);
+                _mm_storeu_ps(current + j, _mm_mul_ps(_mm_loadu_ps(delayed + j), _mm_loadu_ps(gains + j)));
+                _mm_storeu_ps(delayed + j, input);
+            }
+#endif
+            for (; j < count; ++j)
+            {
+                auto input = current[j];
+                current[j] = delayed[j] * gains[j];
+                delayed[j] = input;
+            }
+            
+            done += run;
+            _position = static_cast<int>((_position + run) % static_cast<std::size_t>(_length));
+        }
+    }
+    
+    float next(float required)
+    {
+        // Sliding minimum kept as a monotonic queue of ring slots. The entry
+        // written a window ago leaves the queue as its slot is reused.
+        auto slot = static_cast<std::size_t>(_slot);
+        if (_minimumSize > 0 && _minimum[static_cast<std::size_t>(_minimumBegin)] == _slot)
+        {
+            _minimumBegin = (_minimumBegin + 1) % _window;
+            --_minimumSize;
+        }
+        _required[slot] = required;
+        
+        while (_minimumSize > 0 && _required[static_cast<std::size_t>(_minimum[back()])] >= required)
+        {
+            --_minimumSize;
+        }
+        _minimum[static_cast<std::size_t>((_minimumBegin + _minimumSize) % _window)] = _slot;
+        ++_minimumSize;
+        
+        auto minimum = _required[static_cast<std::size_t>(_minimum[static_cast<std::size_t>(_minimumBegin)])];
+        
+        // Instant attack, exponential release.
+        _envelope = minimum < _envelope ? minimum : _envelope + (minimum - _envelope) * _release;
+        
+        // Moving average over the window.
+        _sum += _envelope - _smoothed[slot];
+        _smoothed[slot] = _envelope;
+        _slot = (_slot + 1) % _window;
+        
+        auto gain = static_cast<float>(_sum / _window);
+        _reduction = std::min(_reduction, gain);
+        return gain;
+    }
+    
+    inline std::size_t back() const
+    {
+        return static_cast<std::size_t>((_minimumBegin + _minimumSize - 1) % _window);
+    }
+    
+    int _channels;
+    int _length;
+    float _threshold;
+    int _window;
+    float _release;
+    
+    std::vector<float> _delay;
+    int _position;
+    
+    std::vector<float> _required;
+    std::vector<int> _minimum;
+    int _minimumBegin;
+    int _minimumSize;
+    std::vector<float> _smoothed;
+    double _sum;
+    float _envelope;
+    int _slot;
+    
+    float _reduction;
+    
+    std::vector<float> _gains;
+    std::vector<float> _expanded;
+};
+
+// The float processing applied to decoded audio before quantization: a
+// constant gain (volume and ReplayGain), the equalizer filters and the
+// limiter. Blocks are processed in short batches so each batch stays in L1
+// between stages.
+class Chain
+{
+public:
+    static constexpr std::size_t BatchFrames = 256;
+    
+    struct Settings
+    {
+        float gain;
+        bool limit;
+        std::vector<eq::Filter> filters;
+    };
+    
+    Chain(int channels, int sampleRate, Settings const& settings):
+        _channels{channels},
+        _settings(settings),
+        _equalizer{channels, sampleRate, settings.filters},
+        _limiter{channels, sampleRate}
+    {}
+    
+    inline int channels() const
+    {
+        return _channels;
+    }
+    
+    inline Settings const& settings() const
+    {
+        return _settings;
+    }
+    
+    inline Limiter const& limiter() const
+    {
+        return _limiter;
+    }
+    
+    // Number of frames still held back after the last block.
+    inline std::size_t latency() const
+    {
+        return _settings.limit ? static_cast<std::size_t>(_limiter.latency()) : 0;
+    }
+    
+    void process(float* samples, std::size_t frames)
+    {
+        for (std::size_t offset = 0; offset < frames; offset += BatchFrames)
+        {
+            auto count = frames - offset < BatchFrames ? frames - offset : BatchFrames;
+            auto* batch = samples + offset * _channels;
+            
+            if (_settings.gain != 1.0f)
+            {
+                scale(batch, count * _channels, _settings.gain);
+            }
+            if (_equalizer.size() > 0)
+            {
+                _equalizer.process(batch, count);
+            }
+            if (_settings.limit)
+            {
+                _limiter.process(batch, count);
+            }
+        }
+    }
+    
+    // Writes the frames still held back into samples, which must have room
+    // for latency() frames, and returns their number.
+    std::size_t flush(float* samples)
+    {
+        auto frames = latency();
+        if (frames > 0)
+        {
+            _limiter.flush(samples, frames);
+        }
+        return frames;
+    }
+
+private:
+    int _channels;
+    Settings _settings;
+    eq::Cascade _equalizer;
+    Limiter _limiter;
+};
+
+enum class Curve
+{
+    Linear,
+    EqualPower,
+    SCurve,
+};
+
+inline char const* name(Curve curve)
+{
+    switch (curve)
+    {
+        case Curve::Linear: return "linear";
+        case Curve::EqualPower: return "power";
+        case Curve::SCurve: return "scurve";
+    }
+    return "";
+}
+
+inline Curve parse(std::string const& name)
+{
+    for (auto curve: {Curve::Linear, Curve::EqualPower, Curve::SCurve})
+    {
+        if (name == dsp::name(curve)) return curve;
+    }
+    throw std::runtime_error("Unknown crossfade curve " + name);
+}
+
+// Joins consecutive streams of interleaved float samples, fading the end of
+// each stream out over the start of the next. The last length() frames of
+// the current stream are held back until it is known whether the stream
+// ends there. If a stream ends early, the fade covers what there is, so the
+// transition stays sample accurate. Linear fades keep the amplitude
+// constant, equal power fades the energy of uncorrelated material.
+class Crossfade
+{
+public:
+    Crossfade(int channels, std::size_t length, Curve curve):
+        _channels{channels},
+        _length{length},
+        _curve{curve},
+        _pending{},
+        _begin{0},
+        _held{},
+        _faded{0}
+    {}
+    
+    inline std::size_t length() const
+    {
+        return _length;
+    }
+    
+    // Starts the next stream. What is held back of the previous one is
+    // faded out over its start.
+    void next()
+    {
+        _held.assign(_pending.begin() + _begin, _pending.end());
+        _pending.clear();
+        _begin = 0;
+        _faded = 0;
+    }
+    
+    // Queues samples of the current stream, mixing in the fade.
+    void push(float const* samples, std::size_t frames)
+    {
+        auto offset = _pending.size();
+        _pending.insert(_pending.end(), samples, samples + frames * _channels);
+        mix(&_pending[offset], frames);
+    }
+    
+    // Ends the current stream. If it was shorter than the fade, the rest of
+    // the previous stream fades out on its own.
+    void end()
+    {
+        auto held = _held.size() / _channels;
+        if (_faded < held)
+        {
+            auto offset = _pending.size();
+            _pending.resize(offset + (held - _faded) * _channels, 0.0f);
+            mix(&_pending[offset], held - _faded);
+        }
+        _held.clear();
+    }
+    
+    // Frames that can be played: all but the held back ones, or everything
+    // after the last stream.
+    inline std::size_t available(bool last = false) const
+    {
+        auto frames = (_pending.size() - _begin) / _channels;
+        return last ? frames : (frames > _length ? frames - _length : 0);
+    }
+    
+    inline float const* data() const
+    {
+        return _pending.data() + _begin;
+    }
+    
+    // Drops played frames. The storage is compacted once half of it is
+    // played, so each sample moves at most once on average.
+    void consume(std::size_t frames)
+    {
+        _begin += frames * _channels;
+        if (2 * _begin >= _pending.size())
+        {
+            _pending.erase(_pending.begin(), _pending.begin() + _begin);
+            _begin = 0;
+        }
+    }
+
+private:
+    void mix(float* samples, std::size_t frames)
+    {
+        auto held = _held.size() / _channels;
+        auto pi = static_cast<float>(M_PI);
+        for (std::size_t i = 0; i < frames && _faded < held; ++i, ++_faded)
+        {
+            auto t = (_faded + 0.5f) / held;
+            
+            float in;
+            float out;
+            switch (_curve)
+            {
+                case Curve::EqualPower:
+                    in = std::sin(0.5f * pi * t);
+                    out = std::cos(0.5f * pi * t);
+                    break;
+                case Curve::SCurve:
+                    in = 0.5f - 0.5f * std::cos(pi * t);
+                    out = 1.0f - in;
+                    break;
+                default:
+                    in = t;
+                    out = 1.0f - t;
+                    break;
+            }
+            
+            auto* frame = samples + i * _channels;
+            auto const* previous = &_held[_faded * _channels];
+            for (int c = 0; c < _channels; ++c)
+            {
+                frame[c] = frame[c] * in + previous[c] * out;
+            }
+        }
+    }
+    
+    int _channels;
+    std::size_t _length;
+    Curve _curve;
+    
+    std::vector<float> _pending;
+    std::size_t _begin;
+    std::vector<float> _held;
+    std::size_t _faded;
+};
+
+} // dsp
+} // vf
+
+#endif // VF_DSP_HPP_INCLUDED
\ No newline at end of file
@@ -0,0 +1,340 @@
+#ifndef VF_EQ_HPP_INCLUDED
+#define VF_EQ_HPP_INCLUDED
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "arena.hpp"
+#include "config.hpp"
+#include "format.hpp"
+
+#if defined(SIMD_SSE2)
+
+#include <emmintrin.h>
+
+#endif
+
+namespace vf {
+namespace eq {
+
+enum class Type
+{
+    Peak,
+    LowShelf,
+    HighShelf,
+    LowPass,
+    HighPass,
+};
+
+inline char const* name(Type type)
+{
+    switch (type)
+    {
+        case Type::Peak: return "peak";
+        case Type::LowShelf: return "lowshelf";
+        case Type::HighShelf: return "highshelf";
+        case Type::LowPass: return "lowpass";
+        case Type::HighPass: return "highpass";
+    }
+    return "";
+}
+
+inline Type parse(std::string const& name)
+{
+    for (auto type: {Type::Peak, Type::LowShelf, Type::HighShelf, Type::LowPass, Type::HighPass})
+    {
+        if (name == eq::name(type)) return type;
+    }
+    throw std::runtime_error("Unknown filter type " + name);
+}
+
+// The gain in dB only applies to peaks and shelves.
+struct Filter
+{
+    Type type;
+    double frequency;
+    double q;
+    double gain;
+};
+
+// Normalized biquad coefficients, a0 being one.
+struct Coefficients
+{
+    float b0;
+    float b1;
+    float b2;
+    float a1;
+    float a2;
+};
+
+// Coefficients after the Audio EQ Cookbook by Robert Bristow-Johnson.
+inline Coefficients design(Filter const& filter, int sampleRate)
+{
+    if (filter.frequency <= 0.0 || filter.frequency >= sampleRate / 2.0 || filter.q <= 0.0)
+    {
+        throw std::runtime_error(vf::format("Invalid %s filter at %g Hz with Q %g for %d Hz.", name(filter.type), filter.frequency, filter.q, sampleRate));
+    }
+    
+    auto a = std::pow(10.0, filter.gain / 40.0);
+    auto w0 = 2.0 * M_PI * filter.frequency / sampleRate;
+    auto cos = std::cos(w0);
+    auto alpha = std::sin(w0) / (2.0 * filter.q);
+    auto shelf = 2.0 * std::sqrt(a) * alpha;
+    
+    double b0, b1, b2, a0, a1, a2;
+    switch (filter.type)
+    {
+        case Type::Peak:
+            b0 = 1.0 + alpha * a;
+            b1 = -2.0 * cos;
+            b2 = 1.0 - alpha * a;
+            a0 = 1.0 + alpha / a;
+            a1 = -2.0 * cos;
+            a2 = 1.0 - alpha / a;
+            break;
+        case Type::LowShelf:
+            b0 = a * ((a + 1.0) - (a - 1.0) * cos + shelf);
+            b1 = 2.0 * a * ((a - 1.0) - (a + 1.0) * cos);
+            b2 = a * ((a + 1.0) - (a - 1.0) * cos - shelf);
+            a0 = (a + 1.0) + (a - 1.0) * cos + shelf;
+            a1 = -2.0 * ((a - 1.0) + (a + 1.0) * cos);
+            a2 = (a + 1.0) + (a - 1.0) * cos - shelf;
+            break;
+        case Type::HighShelf:
+            b0 = a * ((a + 1.0) + (a - 1.0) * cos + shelf);
+            b1 = -2.0 * a * ((a - 1.0) + (a + 1.0) * cos);
+            b2 = a * ((a + 1.0) + (a - 1.0) * cos - shelf);
+            a0 = (a + 1.0) - (a - 1.0) * cos + shelf;
+            a1 = 2.0 * ((a - 1.0) - (a + 1.0) * cos);
+            a2 = (a + 1.0) - (a - 1.0) * cos - shelf;
+            break;
+        case Type::LowPass:
+            b0 = (1.0 - cos) / 2.0;
+            b1 = 1.0 - cos;
+            b2 = (1.0 - cos) / 2.0;
+            a0 = 1.0 + alpha;
+            a1 = -2.0 * cos;
+            a2 = 1.0 - alpha;
+            break;
+        default:
+            b0 = (1.0 + cos) / 2.0;
+            b1 = -(1.0 + cos);
+            b2 = (1.0 + cos) / 2.0;
+            a0 = 1.0 + alpha;
+            a1 = -2.0 * cos;
+            a2 = 1.0 - alpha;
+            break;
+    }
+    
+    return {
+        static_cast<float>(b0 / a0),
+        static_cast<float>(b1 / a0),
+        static_cast<float>(b2 / a0),
+        static_cast<float>(a1 / a0),
+        static_cast<float>(a2 / a0)
+    };
+}
+
+// Reads filters from a text file, one per line as "type frequency q gain",
+// such as "peak 1000 1.4 -3" or "highpass 30 0.71". Empty lines and lines
+// starting with # are skipped.
+inline std::vector<Filter> load(std::string const& path)
+{
+    std::ifstream stream{path};
+    if (!stream)
+    {
+        throw std::runtime_error(vf::format("Failed to open equalizer file %s.", path));
+    }
+    
+    std::vector<Filter> filters;
+    std::string line;
+    for (int number = 1; std::getline(stream, line); ++number)
+    {
+        std::istringstream fields{line};
+        std::string type;
+        if (!(fields >> type) || type[0] == '#')
+        {
+            continue;
+        }
+        
+        Filter filter{parse(type), 0.0, 0.0, 0.0};
+        if (!(fields >> filter.frequency >> filter.q))
+        {
+            throw std::runtime_error(vf::format("Missing frequency or Q in %s line %d.", path, number));
+        }
+        auto shaping = filter.type == Type::Peak || filter.type == Type::LowShelf || filter.type == Type::HighShelf;
+        if (shaping && !(fields >> filter.gain))
+        {
+            throw std::runtime_error(vf::format("Missing gain in %s line %d.", path, number));
+        }
+        filters.push_back(filter);
+    }
+    return filters;
+}
+
+// The filters as written in the file, for telling processed audio apart.
+inline std::string describe(std::vector<Filter> const& filters)
+{
+    std::string result;
+    for (auto const& filter: filters)
+    {
+        result += vf::format("%s %g %g %g;", name(filter.type), filter.frequency, filter.q, filter.gain);
+    }
+    return result;
+}
+
+// Runs interleaved frames through a series of biquads, each applied to
+// every channel, in transposed direct form II. Filters of a series depend
+// on each other, so they are pipelined: every filter and channel is a lane
+// of its own, and in each step every filter takes what the one before it
+// put out in the step before. Lanes are updated four at a time, across
+// channels and filters alike. Filters start and stop one frame apart at the
+// edges of each block, so the output is not delayed.
+//
+// Coefficients and state live in an arena allocated up front; processing
+// never allocates.
+class Cascade
+{
+public:
+    Cascade(int channels, int sampleRate, std::vector<Filter> const& filters):
+        _channels{static_cast<std::size_t>(channels)},
+        _filters{filters.size()},
+        _lanes{(_channels * _filters + 3) / 4 * 4},
+        _arena{9 * Arena::aligned(_lanes * sizeof(float))},
+        _b0{_arena.allocate<float>(_lanes)},
+        _b1{_arena.allocate<float>(_lanes)},
+        _b2{_arena.allocate<float>(_lanes)},
+        _a1{_arena.allocate<float>(_lanes)},
+        _a2{_arena.allocate<float>(_lanes)},
+        _z1{_arena.allocate<float>(_lanes)},
+        _z2{_arena.allocate<float>(_lanes)},
+        _input{_arena.allocate<float>(_lanes)},
+        _output{_arena.allocate<float>(_lanes)}
+    {
+        std::fill(_arena.data(), _arena.data() + _arena.used(), 0);
+        
+        for (std::size_t f = 0; f < _filters; ++f)
+        {
+            auto coefficients = design(filters[f], sampleRate);
+            for (std::size_t c = 0; c < _channels; ++c)
+            {
+                auto lane = f * _channels + c;
+                _b0[lane] = coefficients.b0;
+                _b1[lane] = coefficients.b1;
+                _b2[lane] = coefficients.b2;
+                _a1[lane] = coefficients.a1;
+                _a2[lane] = coefficients.a2;
+            }
+        }
+    }
+    
+    Cascade(Cascade const& other) = delete;
+    Cascade& operator=(Cascade const& other) = delete;
+    
+    inline std::size_t size() const
+    {
+        return _filters;
+    }
+    
+    void process(float* samples, std::size_t frames)
+    {
+        if (_filters == 0 || frames == 0)
+        {
+            return;
+        }
+
+#if defined(SIMD_SSE2)
+        // Decaying filter state would otherwise turn denormal and slow.
+        auto csr = _mm_getcsr();
+        _mm_setcsr(csr | 0x8040);
+#endif
+
+        auto lag = _filters - 1;
+        auto last = lag * _channels;
+        for (std::size_t t = 0; t < frames + lag; ++t)
+        {
+            std::memmove(_input + _channels, _output, last * sizeof(float));
+            if (t < frames)
+            {
+                std::memcpy(_input, samples + t * _channels, _channels * sizeof(float));
+            }
+            
+            if (t >= lag && t < frames)
+            {
+                step(0, _lanes);
+            }
+            else
+            {
+                auto first = t >= frames ? t - frames + 1 : 0;
+                step(first * _channels, (std::min(t, lag) + 1) * _channels);
+            }
+            
+            if (t >= lag)
+            {
+                std::memcpy(samples + (t - lag) * _channels, _output + last, _channels * sizeof(float));
+            }
+        }
+
+#if defined(SIMD_SSE2)
+        _mm_setcsr(csr);
+#endif
+    }
+
+private:
+    // Updates the lanes in the given range; a full range is a multiple of
+    // four, padded with lanes that stay silent.
+    inline void step(std::size_t begin, std::size_t end)
+    {
+        std::size_t lane = begin;
+#if defined(SIMD_SSE2)
+        if (begin == 0 && end == _lanes)
+        {
+            for (; lane < end; lane += 4)
+            {
+                auto x = _mm_load_ps(_input + lane);
+                auto y = _mm_add_ps(_mm_mul_ps(_mm_load_ps(_b0 + lane), x), _mm_load_ps(_z1 + lane));
+                auto z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_load_ps(_b1 + lane), x), _mm_mul_ps(_mm_load_ps(_a1 + lane), y)), _mm_load_ps(_z2 + lane));
+                auto z2 = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(_b2 + lane), x), _mm_mul_ps(_mm_load_ps(_a2 + lane), y));
+                _mm_store_ps(_output + lane, y);
+                _mm_store_ps(_z1 + lane, z1);
+                _mm_store_ps(_z2 + lane, z2);
+            }
+        }
+#endif
+        for (; lane < end; ++lane)
+        {
+            auto x = _input[lane];
+            auto y = _b0[lane] * x + _z1[lane];
+            _z1[lane] = _b1[lane] * x - _a1[lane] * y + _z2[lane];
+            _z2[lane] = _b2[lane] * x - _a2[lane] * y;
+            _output[lane] = y;
+        }
+    }
+    
+    std::size_t _channels;
+    std::size_t _filters;
+    std::size_t _lanes;
+    
+    Arena _arena;
+    float* _b0;
+    float* _b1;
+    float* _b2;
+    float* _a1;
+    float* _a2;
+    float* _z1;
+    float* _z2;
+    float* _input;
+    float* _output;
+};
+
+} // eq
+} // vf
+
+#endif // VF_EQ_HPP_INCLUDED
\ No newline at end of file
@@ -2,12 +2,18 @@
 #define VF_EXT_AL_HPP_INCLUDED
 
 #include "../config.hpp"
+#include "../trace.hpp"
 
 #if defined(PLATFORM_APPLE)
 
 #include <OpenAL/al.h>
 #include <OpenAL/alc.h>
 
+#else
+
+#include <AL/al.h>
+#include <AL/alc.h>
+
 #endif
 
 namespace vf {
@@ -56,6 +62,19 @@ enum class Format
     STEREO16 = AL_FORMAT_STEREO16,
 };
 
+// Bytes per sample frame.
+inline int frameSize(Format format)
+{
+    switch (format)
+    {
+        case Format::MONO8: return 1;
+        case Format::MONO16:
+        case Format::STEREO8: return 2;
+        case Format::STEREO16: return 4;
+    }
+    return 0;
+}
+
 class Resource
 {
 public:
@@ -88,6 +107,14 @@ public:
         }
     }
     
+    // Mixing rate of the device, or 0 if the implementation does not say.
+    inline int frequency() const
+    {
+        ALCint value = 0;
+        alcGetIntegerv(_device, ALC_FREQUENCY, 1, &value);
+        return value;
+    }
+    
 private:
     ALCdevice* _device;
 };
@@ -145,8 +172,14 @@ public:
         alDeleteBuffers(1, &_id);
     }
     
+    inline ALuint id() const
+    {
+        return _id;
+    }
+    
     inline void data(Format format, ALvoid const* data, ALsizei size, ALsizei freq = 44100)
     {
+        VF_TRACE_SCOPE("alBufferData");
         alBufferData(_id, static_cast<ALenum>(format), data, size, freq);
     }
 
@@ -158,6 +191,8 @@ static_assert(sizeof(Buffer) == sizeof(ALuint), "Wrong size!");
 
 class Source: public Resource
 {
+    friend class SourceLatency;
+
 public:
     Source()
     {
@@ -232,6 +267,21 @@ public:
         alSourceStop(_id);
     }
     
+    // Playback position within the queued buffers, processed or not.
+    inline double secondsOffset()
+    {
+        float value;
+        alGetSourcef(_id, AL_SEC_OFFSET, &value);
+        return value;
+    }
+    
+    inline int buffersQueued()
+    {
+        ALint value;
+        alGetSourcei(_id, AL_BUFFERS_QUEUED, &value);
+        return value;
+    }
+    
     inline int buffersProcessed()
     {
         ALint value;
@@ -241,11 +291,13 @@ public:
     
     inline void queueBuffer(ALuint buffer)
     {
+        VF_TRACE_SCOPE("queueBuffer");
         alSourceQueueBuffers(_id, 1, &buffer);
     }
     
     inline unsigned int unqueueBuffer()
     {
+        VF_TRACE_SCOPE("unqueueBuffer");
         ALuint buffer;
         alSourceUnqueueBuffers(_id, 1, &buffer);
         return buffer;
@@ -260,6 +312,58 @@ private:
     ALuint _id;
 };
 
+// Reads the playback position of a source together with the latency of the
+// device behind it, from the AL_SOFT_source_latency extension. Needs a
+// current context.
+class SourceLatency
+{
+public:
+    struct NullType {};
+    static constexpr NullType Null{};
+    
+    // Without a context, for an output that has no source.
+    SourceLatency(NullType):
+        _getSourcedv(nullptr)
+    {}
+    
+    SourceLatency():
+        _getSourcedv(nullptr)
+    {
+        if (alIsExtensionPresent("AL_SOFT_source_latency"))
+        {
+            _getSourcedv = reinterpret_cast<GetSourcedv>(alGetProcAddress("alGetSourcedvSOFT"));
+        }
+    }
+    
+    inline bool available() const
+    {
+        return _getSourcedv != nullptr;
+    }
+    
+    // Returns false if the extension is missing.
+    inline bool query(Source const& source, double& offset, double& latency) const
+    {
+        if (!available())
+        {
+            return false;
+        }
+        
+        ALdouble values[2] = {0.0, 0.0};
+        _getSourcedv(source._id, SecondsOffsetLatency, values);
+        offset = values[0];
+        latency = values[1];
+        return true;
+    }
+
+private:
+    using GetSourcedv = void (AL_APIENTRY*)(ALuint, ALenum, ALdouble*);
+    
+    // AL_SEC_OFFSET_LATENCY_SOFT, which al.h only declares with alext.h.
+    static constexpr ALenum SecondsOffsetLatency = 0x1201;
+    
+    GetSourcedv _getSourcedv;
+};
+
 }
 }
 }
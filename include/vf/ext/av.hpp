@@ -1,12 +1,22 @@
 #ifndef VF_EXT_AV_HPP_INCLUDED
 #define VF_EXT_AV_HPP_INCLUDED
 
+#include <cmath>
+#include <functional>
+#include <mutex>
+
+#include "../log.hpp"
+#include "../thread_pool.hpp"
+#include "../trace.hpp"
+
 extern "C"
 {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/avutil.h>
+#include <libavutil/imgutils.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
 }
@@ -42,6 +52,7 @@ enum class SampleFormat
 
 enum class PixelFormat
 {
+    YUV420P = PIX_FMT_YUV420P,
     RGB24 = PIX_FMT_RGB24,
     RGBA = PIX_FMT_RGBA,
     BGRA = PIX_FMT_BGRA,
@@ -49,6 +60,88 @@ enum class PixelFormat
     ARGB = PIX_FMT_ARGB,
 };
 
+// Lets libavcodec serialize codec opening when decoders are created on
+// several threads at once. Must be called before the first decoder opens.
+inline void registerLockManager()
+{
+    auto manager = [](void** mutex, AVLockOp op) -> int
+    {
+        switch (op)
+        {
+            case AV_LOCK_CREATE:
+                *mutex = new std::mutex;
+                break;
+            case AV_LOCK_OBTAIN:
+                static_cast<std::mutex*>(*mutex)->lock();
+                break;
+            case AV_LOCK_RELEASE:
+                static_cast<std::mutex*>(*mutex)->unlock();
+                break;
+            case AV_LOCK_DESTROY:
+                delete static_cast<std::mutex*>(*mutex);
+                *mutex = nullptr;
+                break;
+        }
+        return 0;
+    };
+    
+    if (av_lockmgr_register(manager) < 0)
+    {
+        throw std::runtime_error("Failed to register lock manager.");
+    }
+}
+
+inline int logLevel(log::Level level)
+{
+    switch (level)
+    {
+        case log::Level::Error: return AV_LOG_ERROR;
+        case log::Level::Warning: return AV_LOG_WARNING;
+        case log::Level::Info: return AV_LOG_INFO;
+        case log::Level::Debug: return AV_LOG_DEBUG;
+    }
+    return AV_LOG_ERROR;
+}
+
+inline log::Level logLevel(int level)
+{
+    if (level <= AV_LOG_ERROR) return log::Level::Error;
+    if (level <= AV_LOG_WARNING) return log::Level::Warning;
+    if (level <= AV_LOG_INFO) return log::Level::Info;
+    return log::Level::Debug;
+}
+
+// Hands messages of libav to the current logger instead of printing them on
+// the thread that raised them. The level set with av_log_set_level() still
+// applies, so parts that silence libav stay silent.
+inline void logCallback(void* context, int level, char const* format, va_list arguments)
+{
+    if (level > av_log_get_level())
+    {
+        return;
+    }
+    
+    auto logger = log::Logger::current().load(std::memory_order_acquire);
+    if (logger == nullptr)
+    {
+        av_log_default_callback(context, level, format, arguments);
+        return;
+    }
+    
+    auto mapped = logLevel(level);
+    if (logger->enabled(mapped))
+    {
+        auto avClass = context ? *static_cast<AVClass**>(context) : nullptr;
+        logger->write(mapped, avClass ? avClass->class_name : "av", format, arguments);
+    }
+}
+
+inline void routeLogs(log::Level level)
+{
+    av_log_set_level(logLevel(level));
+    av_log_set_callback(logCallback);
+}
+
 class Resource
 {
 public:
@@ -92,6 +185,11 @@ public:
     {
         // Observing only, no ownership
     }
+    
+    inline bool valid() const
+    {
+        return _codec != nullptr;
+    }
 
     inline char const* longName() const
     {
@@ -142,10 +240,60 @@ public:
         return static_cast<double>(_stream->duration) * tb.num / tb.den;
     }
     
+    // Seconds of the first timestamp, zero if unknown.
+    inline double startTime() const
+    {
+        auto const& tb = _stream->time_base;
+        return _stream->start_time == AV_NOPTS_VALUE ? 0.0 : static_cast<double>(_stream->start_time) * tb.num / tb.den;
+    }
+    
     inline int index() const
     {
         return _stream->index;
     }
+    
+    inline MediaType type() const
+    {
+        return static_cast<MediaType>(_stream->codec->codec_type);
+    }
+    
+    inline int channels() const
+    {
+        return _stream->codec->channels;
+    }
+    
+    inline int sampleRate() const
+    {
+        return _stream->codec->sample_rate;
+    }
+    
+    inline SampleFormat sampleFormat() const
+    {
+        return static_cast<SampleFormat>(_stream->codec->sample_fmt);
+    }
+    
+    // Samples per frame, or 0 if frames vary in size.
+    inline int frameSize() const
+    {
+        return _stream->codec->frame_size;
+    }
+    
+    inline uint64_t channelLayout() const
+    {
+        return _stream->codec->channel_layout ? _stream->codec->channel_layout : av_get_default_channel_layout(_stream->codec->channels);
+    }
+    
+    inline double timeBase() const
+    {
+        auto const& tb = _stream->time_base;
+        return static_cast<double>(tb.num) / tb.den;
+    }
+    
+    inline char const* metadata(char const* key) const
+    {
+        auto entry = av_dict_get(_stream->metadata, key, nullptr, 0);
+        return entry ? entry->value : nullptr;
+    }
 
 private:
     Stream(AVStream* stream):
@@ -161,7 +309,8 @@ class Frame: public Resource
     
 public:
     Frame():
-        _frame(nullptr)
+        _frame(nullptr),
+        _buffer(nullptr)
     {
         _frame = avcodec_alloc_frame();
         
@@ -180,8 +329,8 @@ public:
         _frame->nb_samples = numberSamples;
         
         auto buffer_size = av_samples_get_buffer_size(NULL, channels, numberSamples, _format, 0);
-        auto buffer = static_cast<uint8_t*>(av_malloc(buffer_size));
-        if (avcodec_fill_audio_frame(_frame, channels, _format, buffer, buffer_size, 0) < 0)
+        _buffer = static_cast<uint8_t*>(av_malloc(buffer_size));
+        if (avcodec_fill_audio_frame(_frame, channels, _format, _buffer, buffer_size, 0) < 0)
         {
             throw std::runtime_error("Failed to create av::Frame.");
         }
@@ -192,8 +341,8 @@ public:
     {
         auto _format = static_cast<AVPixelFormat>(format);
         auto num_bytes = avpicture_get_size(_format, width, height);
-        auto buffer = static_cast<uint8_t*>(av_malloc(num_bytes*sizeof(uint8_t)));
-        if (avpicture_fill((AVPicture*)_frame, buffer, _format, width, height) < 0)
+        _buffer = static_cast<uint8_t*>(av_malloc(num_bytes*sizeof(uint8_t)));
+        if (avpicture_fill((AVPicture*)_frame, _buffer, _format, width, height) < 0)
         {
             throw std::runtime_error("Failed to create av::Frame.");
         }
@@ -202,9 +351,12 @@ public:
         _frame->height = height;
     }
     
+    // Frames decoded into use buffers of the codec; only the buffer of a
+    // frame allocated with a format is owned.
     ~Frame()
     {
         avcodec_free_frame(&_frame);
+        av_free(_buffer);
     }
     
     inline void defaults()
@@ -282,6 +434,13 @@ public:
         return _frame->nb_samples;
     }
     
+    // Presentation time in the time base of the stream, as best guessed by
+    // the decoder; AV_NOPTS_VALUE if unknown.
+    inline int64_t timestamp() const
+    {
+        return _frame->best_effort_timestamp;
+    }
+    
     inline void numberSamples(int samples)
     {
         _frame->nb_samples = samples;
@@ -289,6 +448,7 @@ public:
     
 private:
     AVFrame* _frame;
+    uint8_t* _buffer;
 };
 
 class Packet: public Resource
@@ -307,6 +467,27 @@ public:
     {
         av_free_packet(&_packet);
     }
+    
+    Packet(Packet&& other):
+        Packet()
+    {
+        swap(*this, other);
+    }
+    
+    Packet& operator=(Packet&& other)
+    {
+        swap(*this, other);
+        return *this;
+    }
+    
+    // Makes the packet own its data, so it outlives the next read.
+    inline void duplicate()
+    {
+        if (av_dup_packet(&_packet) < 0)
+        {
+            throw std::runtime_error("Failed to duplicate av::Packet.");
+        }
+    }
 
     inline uint8_t* data() const
     {
@@ -333,8 +514,19 @@ public:
         return _packet.stream_index;
     }
     
+    inline int duration() const
+    {
+        return _packet.duration;
+    }
+
 private:
     AVPacket _packet;
+    
+    friend void swap(Packet& lhs, Packet& rhs)
+    {
+        using std::swap;
+        swap(lhs._packet, rhs._packet);
+    }
 };
 
 class CodecContext: public Resource
@@ -344,16 +536,19 @@ public:
     static constexpr NullType Null{};
 
     CodecContext(NullType):
-        _codecContext(nullptr)
+        _codecContext(nullptr),
+        _open(false)
     {}
     
+    // The context itself belongs to its stream, but a decoder opened on it
+    // has to be closed.
     ~CodecContext()
     {
-        // Observing only, no ownership
-        // Leak?
+        close();
     }
     
-    CodecContext(CodecContext&& other)
+    CodecContext(CodecContext&& other):
+        CodecContext(Null)
     {
         swap(*this, other);
     }
@@ -431,15 +626,21 @@ public:
         {
             throw std::runtime_error("Failed to initialize av::CodecContext.");
         }
+        _open = true;
     }
     
     inline void close()
     {
-        avcodec_close(_codecContext);
+        if (_open)
+        {
+            avcodec_close(_codecContext);
+            _open = false;
+        }
     }
     
     inline int decodeAudio(Frame& frame, Packet const& packet)
     {
+        VF_TRACE_SCOPE("decodeAudio");
         frame.defaults();
         
         auto isFrameAvailable = 0;
@@ -455,6 +656,7 @@ public:
     
     inline int decodeVideo(Frame& frame, Packet const& packet)
     {
+        VF_TRACE_SCOPE("decodeVideo");
         auto isFrameAvailable = 0;
         auto result = avcodec_decode_video2(_codecContext, frame._frame, &isFrameAvailable, &packet._packet);
         
@@ -474,16 +676,66 @@ public:
     
 private:
     CodecContext(AVCodecContext* codecContext):
-        _codecContext(codecContext)
+        _codecContext(codecContext),
+        _open(false)
     {}
     
     AVCodecContext* _codecContext;
+    bool _open;
     
     friend void swap(CodecContext& lhs, CodecContext& rhs)
     {
         using std::swap;
         swap(lhs._codecContext, rhs._codecContext);
+        swap(lhs._open, rhs._open);
+    }
+};
+
+// Feeds a container from a read function instead of a file or URL, such as
+// a network stream read elsewhere. The function returns the number of bytes
+// read, or zero at the end of the stream. The container cannot seek.
+class IOContext: public Resource
+{
+    friend class FormatContext;
+
+public:
+    using Read = std::function<int(uint8_t*, int)>;
+    
+    static constexpr int BufferSize = 32 * 1024;
+    
+    explicit IOContext(Read read):
+        _read(std::move(read)),
+        _context(nullptr)
+    {
+        auto buffer = static_cast<unsigned char*>(av_malloc(BufferSize));
+        if (buffer != nullptr)
+        {
+            _context = avio_alloc_context(buffer, BufferSize, 0, this, &IOContext::read, nullptr, nullptr);
+        }
+        
+        if (_context == nullptr)
+        {
+            av_free(buffer);
+            throw std::runtime_error("Failed to create av::IOContext.");
+        }
+    }
+    
+    ~IOContext()
+    {
+        // The buffer may have been replaced by the demuxer.
+        av_freep(&_context->buffer);
+        av_freep(&_context);
+    }
+
+private:
+    static int read(void* opaque, uint8_t* data, int size)
+    {
+        auto count = static_cast<IOContext*>(opaque)->_read(data, size);
+        return count > 0 ? count : AVERROR_EOF;
     }
+    
+    Read _read;
+    AVIOContext* _context;
 };
 
 class FormatContext: public Resource
@@ -492,9 +744,9 @@ public:
     struct NullType {};
     static constexpr NullType Null{};
 
-    static double TimeBaseToSeconds(int timeBase)
+    static double TimeBaseToSeconds(int64_t timeBase)
     {
-        return static_cast<double>(timeBase) * AV_TIME_BASE;
+        return static_cast<double>(timeBase) / AV_TIME_BASE;
     }
     
     static int SecondsToTimeBase(double seconds)
@@ -552,6 +804,12 @@ public:
         return maxAnalyzeDuration;
     }
     
+    // Bytes read to detect the container and its streams.
+    inline void probeSize(unsigned int bytes)
+    {
+        _formatContext->probesize = bytes;
+    }
+    
     inline void open(std::string const& path)
     {
         auto result = avformat_open_input(&_formatContext, path.c_str(), NULL, NULL);
@@ -562,13 +820,40 @@ public:
         }
     }
     
+    // Opens a container read through the I/O context, which must outlive
+    // it. The name is only used in messages.
+    inline void open(IOContext& io, std::string const& name)
+    {
+        if (_formatContext == nullptr)
+        {
+            _formatContext = avformat_alloc_context();
+        }
+        if (_formatContext == nullptr)
+        {
+            throw std::runtime_error("Failed to create av::FormatContext.");
+        }
+        _formatContext->pb = io._context;
+        _formatContext->flags |= AVFMT_FLAG_CUSTOM_IO;
+        
+        auto result = avformat_open_input(&_formatContext, name.c_str(), NULL, NULL);
+        
+        if (result != 0)
+        {
+            throw std::runtime_error("Failed to open input.");
+        }
+    }
+    
     inline void close()
     {
         avformat_close_input(&_formatContext);
     }
     
+    // Releases what the packet held before, so a packet can be reused for
+    // every read without leaking skipped packets.
     inline void readFrame(Packet& packet)
     {
+        VF_TRACE_SCOPE("readFrame");
+        av_free_packet(&packet._packet);
         auto result = av_read_frame(_formatContext, &packet._packet);
         
         if (result < 0)
@@ -577,6 +862,18 @@ public:
         }
     }
     
+    // Moves to the key frame at or before the position in the stream.
+    inline void seek(Stream const& stream, double seconds)
+    {
+        auto timestamp = static_cast<int64_t>(seconds / stream.timeBase());
+        auto result = av_seek_frame(_formatContext, stream.index(), timestamp, AVSEEK_FLAG_BACKWARD);
+        
+        if (result < 0)
+        {
+            throw std::runtime_error("Failed to seek.");
+        }
+    }
+    
     inline void findStreamInfo()
     {
         auto result = avformat_find_stream_info(_formatContext, nullptr);
@@ -587,6 +884,22 @@ public:
         }
     }
     
+    inline char const* metadata(char const* key) const
+    {
+        auto entry = av_dict_get(_formatContext->metadata, key, nullptr, 0);
+        return entry ? entry->value : nullptr;
+    }
+    
+    inline int streamCount() const
+    {
+        return static_cast<int>(_formatContext->nb_streams);
+    }
+    
+    inline Stream stream(int index) const
+    {
+        return {_formatContext->streams[index]};
+    }
+    
     inline Stream findBestStream(MediaType mediaType)
     {
         auto result = av_find_best_stream(_formatContext, static_cast<AVMediaType>(mediaType), -1, -1, nullptr, 0);
@@ -613,78 +926,352 @@ private:
 
 namespace sws {
 
+// Scales pictures in horizontal bands, each on a worker of the pool. Every
+// band has a context of its own, made for the band padded above and below by
+// more rows than the widest filter reaches. Its rows are thus filtered from
+// the same source rows as with one context for the whole picture, and the
+// padding is dropped when the band is copied out.
+//
+// Bands start on rows where source and destination line up exactly and the
+// ordered dither pattern repeats, so each band has the vertical scale and
+// filter phase of the whole picture. swscale steps through the source in
+// 1/65536 of a row, which is only exact if the reduced ratio of the heights
+// has a power of two below it; other pictures, and those converted on a
+// single thread, are handled by one context as sws_scale does.
 class Context
 {
 public:
-    Context(av::Frame const& src, av::Frame const& dst, int flags = SWS_BILINEAR):
-        _context{nullptr}
-    {
-        _context = sws_getContext(
-            src.width(), src.height(), static_cast<AVPixelFormat>(src.format()),
-            dst.width(), dst.height(), static_cast<AVPixelFormat>(dst.format()),
-            flags,
-            nullptr, nullptr, nullptr
-        );
+    Context(av::Frame const& src, av::Frame const& dst, int flags = SWS_BILINEAR, unsigned int threads = 1):
+        _bands{},
+        _pool{}
+    {
+        auto srcFormat = static_cast<AVPixelFormat>(src.format());
+        auto dstFormat = static_cast<AVPixelFormat>(dst.format());
+        auto srcHeight = src.height();
+        auto dstHeight = dst.height();
         
-        if (_context == nullptr)
+        auto step = Step(srcHeight, dstHeight, Alignment(srcFormat), Alignment(dstFormat));
+        auto units = step > 0 ? dstHeight / step : 1;
+        auto padding = 0;
+        if (step > 0)
         {
-            throw std::runtime_error("Failed to create sws::Context.");
+            // Sinc and spline filters are the widest at twenty taps per
+            // destination row when shrinking, and swscale pads filters by up
+            // to eight more.
+            auto ratio = std::max(1.0, static_cast<double>(srcHeight) / dstHeight);
+            auto reach = static_cast<int64_t>(std::ceil(10.0 * ratio)) + 8;
+            auto srcStep = static_cast<int64_t>(step) * srcHeight / dstHeight;
+            padding = static_cast<int>((reach + srcStep - 1) / srcStep);
+        }
+        auto count = static_cast<int>(std::max(1u, std::min(threads, static_cast<unsigned int>(units / std::max(1, padding)))));
+        
+        for (int i = 0; i < count; ++i)
+        {
+            Band band{};
+            band.dstBegin = (units * i / count) * step;
+            band.dstEnd = (i + 1 == count) ? dstHeight : (units * (i + 1) / count) * step;
+            band.dstFirst = std::max(0, band.dstBegin - padding * step);
+            auto dstLast = std::min(dstHeight, band.dstEnd + padding * step);
+            band.srcFirst = static_cast<int>(static_cast<int64_t>(band.dstFirst) * srcHeight / dstHeight);
+            band.srcLast = (dstLast == dstHeight) ? srcHeight : static_cast<int>(static_cast<int64_t>(dstLast) * srcHeight / dstHeight);
+            
+            // Stored before its context is made, so free() finds it if
+            // anything below fails.
+            _bands.push_back(std::move(band));
+            auto& added = _bands.back();
+            added.context = sws_getContext(
+                src.width(), added.srcLast - added.srcFirst, srcFormat,
+                dst.width(), dstLast - added.dstFirst, dstFormat,
+                flags,
+                nullptr, nullptr, nullptr
+            );
+            
+            if (added.context == nullptr)
+            {
+                free();
+                throw std::runtime_error("Failed to create sws::Context.");
+            }
+            
+            if (count > 1)
+            {
+                added.scratch.reset(new av::Frame{static_cast<av::PixelFormat>(dstFormat), dst.width(), dstLast - added.dstFirst});
+            }
+        }
+        
+        if (_bands.size() > 1)
+        {
+            _pool.reset(new vf::ThreadPool{static_cast<unsigned int>(_bands.size())});
         }
     }
     
+    Context(Context const& other) = delete;
+    Context& operator=(Context const& other) = delete;
+    
     ~Context()
     {
-        sws_freeContext(_context);
+        free();
+    }
+    
+    inline unsigned int threads() const
+    {
+        return static_cast<unsigned int>(_bands.size());
     }
     
     inline int scale(av::Frame const& src, av::Frame& dst) const
     {
-        return sws_scale(
-            _context,
-            src.dataPtr(), src.lineSizePtr(), 0, src.height(),
-            dst.dataPtr(), dst.lineSizePtr()
-        );
+        if (!_pool)
+        {
+            return sws_scale(
+                _bands.front().context,
+                src.dataPtr(), src.lineSizePtr(), 0, src.height(),
+                dst.dataPtr(), dst.lineSizePtr()
+            );
+        }
+        
+        auto dstFormat = static_cast<AVPixelFormat>(dst.format());
+        auto srcDescriptor = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(src.format()));
+        auto dstDescriptor = av_pix_fmt_desc_get(dstFormat);
+        
+        _pool->parallelFor(static_cast<unsigned int>(_bands.size()), [&](unsigned int index)
+        {
+            auto const& band = _bands[index];
+            auto& scratch = *band.scratch;
+            
+            uint8_t const* srcData[AV_NUM_DATA_POINTERS];
+            for (int plane = 0; plane < AV_NUM_DATA_POINTERS; ++plane)
+            {
+                srcData[plane] = src.data(plane) ? src.data(plane) + Row(srcDescriptor, plane, band.srcFirst) * src.lineSize(plane) : nullptr;
+            }
+            
+            sws_scale(
+                band.context,
+                srcData, src.lineSizePtr(), 0, band.srcLast - band.srcFirst,
+                scratch.dataPtr(), scratch.lineSizePtr()
+            );
+            
+            for (int plane = 0; plane < 4 && dst.data(plane); ++plane)
+            {
+                auto bytes = av_image_get_linesize(dstFormat, dst.width(), plane);
+                if (bytes <= 0)
+                {
+                    continue;
+                }
+                
+                av_image_copy_plane(
+                    dst.data(plane) + Row(dstDescriptor, plane, band.dstBegin) * dst.lineSize(plane), dst.lineSize(plane),
+                    scratch.data(plane) + Row(dstDescriptor, plane, band.dstBegin - band.dstFirst) * scratch.lineSize(plane), scratch.lineSize(plane),
+                    bytes, Row(dstDescriptor, plane, band.dstEnd) - Row(dstDescriptor, plane, band.dstBegin)
+                );
+            }
+        });
+        
+        return dst.height();
     }
     
 private:
-    SwsContext* _context;
+    // The destination rows [dstBegin, dstEnd) are scaled with the padding
+    // from dstFirst on, out of the source rows [srcFirst, srcLast).
+    struct Band
+    {
+        SwsContext* context;
+        std::unique_ptr<av::Frame> scratch;
+        int srcFirst;
+        int srcLast;
+        int dstFirst;
+        int dstBegin;
+        int dstEnd;
+    };
+    
+    static int Alignment(AVPixelFormat format)
+    {
+        auto descriptor = av_pix_fmt_desc_get(format);
+        return descriptor ? 1 << descriptor->log2_chroma_h : 1;
+    }
+    
+    static int Gcd(int a, int b)
+    {
+        return b == 0 ? a : Gcd(b, a % b);
+    }
+    
+    // The fewest destination rows bands can start at, or zero if a picture
+    // cannot be split without changing how its rows are filtered. Bands
+    // start on whole chroma rows of both pictures and on multiples of eight
+    // rows, the period of the dither.
+    static int Step(int srcHeight, int dstHeight, int srcAlignment, int dstAlignment)
+    {
+        if (srcHeight <= 0 || dstHeight <= 0 || srcHeight % srcAlignment != 0 || dstHeight % dstAlignment != 0)
+        {
+            return 0;
+        }
+        
+        auto divisor = Gcd(srcHeight, dstHeight);
+        auto numerator = srcHeight / divisor;
+        auto denominator = dstHeight / divisor;
+        if ((denominator & (denominator - 1)) != 0 || denominator > 65536)
+        {
+            return 0;
+        }
+        
+        // Both are powers of two, so the larger one is a multiple of both.
+        auto step = std::max(denominator, 8 * dstAlignment);
+        while ((step / denominator * numerator) % srcAlignment != 0)
+        {
+            step *= 2;
+        }
+        return step;
+    }
+    
+    static int Row(AVPixFmtDescriptor const* descriptor, int plane, int row)
+    {
+        // Planes 1 and 2 carry the (possibly subsampled) chroma.
+        return (descriptor && (plane == 1 || plane == 2)) ? row >> descriptor->log2_chroma_h : row;
+    }
+    
+    void free()
+    {
+        for (auto& band: _bands)
+        {
+            sws_freeContext(band.context);
+        }
+        _bands.clear();
+    }
+    
+    std::vector<Band> _bands;
+    std::unique_ptr<vf::ThreadPool> _pool;
 };
 
 } // sws
 
 namespace swr {
 
+// Resampler filter presets, from linearly interpolated short filters to long
+// polyphase filters with a cutoff close to Nyquist.
+enum class Quality
+{
+    Fast,
+    Medium,
+    High,
+    Best,
+};
+
+inline char const* name(Quality quality)
+{
+    switch (quality)
+    {
+        case Quality::Fast: return "fast";
+        case Quality::Medium: return "medium";
+        case Quality::High: return "high";
+        case Quality::Best: return "best";
+    }
+    return "";
+}
+
+inline Quality parse(std::string const& name)
+{
+    for (auto quality: {Quality::Fast, Quality::Medium, Quality::High, Quality::Best})
+    {
+        if (name == swr::name(quality)) return quality;
+    }
+    throw std::runtime_error("Unknown resampler quality " + name);
+}
+
 class Context
 {
 public:
-    Context(av::CodecContext const& codecContext):
-        _context(nullptr)
+    Context(av::CodecContext const& codecContext, int outputRate = 0, Quality quality = Quality::High, av::SampleFormat outputFormat = av::SampleFormat::S16):
+        Context(
+            codecContext.channelLayout() ? codecContext.channelLayout() : av_get_default_channel_layout(codecContext.channels()),
+            codecContext.sampleFormat(),
+            codecContext.sampleRate(),
+            outputRate,
+            quality,
+            outputFormat
+        )
+    {}
+    
+    Context(uint64_t layout, av::SampleFormat format, int inputRate, int outputRate = 0, Quality quality = Quality::High, av::SampleFormat outputFormat = av::SampleFormat::S16):
+        _context(nullptr),
+        _outputRate(outputRate > 0 ? outputRate : inputRate)
     {
         _context = swr_alloc();
         
-        auto layout = codecContext.channelLayout();
-        if (!layout)
-        {
-            layout = av_get_default_channel_layout(codecContext.channels());
-        }
-        
         av_opt_set_int(_context, "in_channel_layout", layout, 0);
         av_opt_set_int(_context, "out_channel_layout", layout, 0);
-        av_opt_set_int(_context, "in_sample_rate", codecContext.sampleRate(), 0);
-        av_opt_set_int(_context, "out_sample_rate", codecContext.sampleRate(), 0);
-        av_opt_set_sample_fmt(_context, "in_sample_fmt", static_cast<AVSampleFormat>(codecContext.sampleFormat()), 0);
-        av_opt_set_sample_fmt(_context, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+        av_opt_set_int(_context, "in_sample_rate", inputRate, 0);
+        av_opt_set_int(_context, "out_sample_rate", _outputRate, 0);
+        av_opt_set_sample_fmt(_context, "in_sample_fmt", static_cast<AVSampleFormat>(format), 0);
+        av_opt_set_sample_fmt(_context, "out_sample_fmt", static_cast<AVSampleFormat>(outputFormat), 0);
+        
+        switch (quality)
+        {
+            case Quality::Fast:
+                av_opt_set_int(_context, "filter_size", 2, 0);
+                av_opt_set_int(_context, "phase_shift", 4, 0);
+                av_opt_set_int(_context, "linear_interp", 1, 0);
+                av_opt_set_double(_context, "cutoff", 0.8, 0);
+                break;
+            case Quality::Medium:
+                av_opt_set_int(_context, "filter_size", 8, 0);
+                av_opt_set_int(_context, "phase_shift", 8, 0);
+                av_opt_set_int(_context, "linear_interp", 1, 0);
+                av_opt_set_double(_context, "cutoff", 0.9, 0);
+                break;
+            case Quality::High:
+                av_opt_set_int(_context, "filter_size", 32, 0);
+                av_opt_set_int(_context, "phase_shift", 10, 0);
+                av_opt_set_int(_context, "linear_interp", 0, 0);
+                av_opt_set_double(_context, "cutoff", 0.97, 0);
+                break;
+            case Quality::Best:
+                av_opt_set_int(_context, "filter_size", 64, 0);
+                av_opt_set_int(_context, "phase_shift", 12, 0);
+                av_opt_set_int(_context, "linear_interp", 0, 0);
+                av_opt_set_double(_context, "cutoff", 0.99, 0);
+                break;
+        }
         
-        swr_init(_context);
+        if (swr_init(_context) < 0)
+        {
+            swr_free(&_context);
+            throw std::runtime_error("Failed to initialize swr::Context.");
+        }
     }
+        
+    Context(Context const& other) = delete;
+    Context& operator=(Context const& other) = delete;
     
     ~Context()
     {
         swr_free(&_context);
     }
     
+    inline int outputRate() const
+    {
+        return _outputRate;
+    }
+    
+    // Number of output samples still buffered inside the resampler.
+    inline int64_t delay() const
+    {
+        return swr_get_delay(_context, _outputRate);
+    }
+    
+    inline int convert(uint8_t const** src, int srcSamples, uint8_t** dst, int dstSamples)
+    {
+        VF_TRACE_SCOPE("convert");
+        return swr_convert(_context, dst, dstSamples, src, srcSamples);
+    }
+    
+    // Drains the samples buffered for filtering at the end of the stream.
+    inline int flush(av::Frame& dst)
+    {
+        VF_TRACE_SCOPE("convert");
+        return swr_convert(_context, dst.dataPtr(), dst.numberSamples(), nullptr, 0);
+    }
+    
     inline int convert(av::Frame const& src, uint8_t** data, int numberSamples)
     {
+        VF_TRACE_SCOPE("convert");
         return swr_convert(
             _context,
             data, numberSamples,
@@ -694,6 +1281,7 @@ public:
     
     inline int convert(av::Frame const& src, av::Frame& dst)
     {
+        VF_TRACE_SCOPE("convert");
         return swr_convert(
             _context,
             dst.dataPtr(), dst.numberSamples(),
@@ -703,6 +1291,7 @@ public:
     
 private:
     SwrContext* _context;
+    int _outputRate;
     
     friend std::ostream& operator<<(std::ostream& os, Context const& context)
     {
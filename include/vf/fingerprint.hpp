@@ -0,0 +1,56 @@
+#ifndef VF_FINGERPRINT_HPP_INCLUDED
+#define VF_FINGERPRINT_HPP_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace vf {
+
+// 64 bit FNV-1a, fed incrementally.
+class Fingerprint
+{
+public:
+    Fingerprint():
+        _hash{14695981039346656037ull}
+    {}
+    
+    inline Fingerprint& feed(void const* data, std::size_t size)
+    {
+        auto bytes = static_cast<uint8_t const*>(data);
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            _hash = (_hash ^ bytes[i]) * 1099511628211ull;
+        }
+        return *this;
+    }
+    
+    inline Fingerprint& feed(std::string const& value)
+    {
+        return feed(value.data(), value.size());
+    }
+    
+    template<typename T>
+    inline Fingerprint& feed(T const& value)
+    {
+        return feed(&value, sizeof(value));
+    }
+    
+    inline uint64_t value() const
+    {
+        return _hash;
+    }
+
+private:
+    uint64_t _hash;
+};
+
+// Identifies a file by its location, size and modification time.
+inline uint64_t fingerprint(std::string const& path, uint64_t size, int64_t modified, std::string const& variant = "")
+{
+    return Fingerprint{}.feed(path).feed(size).feed(modified).feed(variant).value();
+}
+
+} // vf
+
+#endif // VF_FINGERPRINT_HPP_INCLUDED
\ No newline at end of file
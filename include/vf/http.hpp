@@ -0,0 +1,590 @@
+#ifndef VF_HTTP_HPP_INCLUDED
+#define VF_HTTP_HPP_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <istream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "format.hpp"
+#include "log.hpp"
+
+namespace vf {
+namespace http {
+
+struct Url
+{
+    std::string host;
+    std::string port;
+    std::string path;
+};
+
+inline bool isUrl(std::string const& path)
+{
+    return path.compare(0, 7, "http://") == 0;
+}
+
+inline Url parse(std::string const& url)
+{
+    if (!isUrl(url))
+    {
+        throw std::runtime_error(vf::format("Unsupported URL %s.", url));
+    }
+    
+    auto slash = url.find('/', 7);
+    auto authority = url.substr(7, slash == std::string::npos ? std::string::npos : slash - 7);
+    Url result{authority, "80", slash == std::string::npos ? "/" : url.substr(slash)};
+    
+    auto colon = authority.rfind(':');
+    if (colon != std::string::npos)
+    {
+        result.host = authority.substr(0, colon);
+        result.port = authority.substr(colon + 1);
+    }
+    if (result.host.empty() || result.port.empty())
+    {
+        throw std::runtime_error(vf::format("Invalid URL %s.", url));
+    }
+    return result;
+}
+
+// Reads a resource over HTTP on a thread of its own, ahead of the demuxer,
+// into a ring buffer that read() takes from, so the demuxer is kept fed
+// while the network delivers in bursts. The ICY metadata that Icecast and
+// SHOUTcast servers interleave with the audio on request is stripped and
+// the title of the stream kept.
+//
+// A connection that drops, fails or stalls for longer than the timeout is
+// opened again after a pause that grows with every attempt in a row that
+// delivers nothing; after Retries of them the stream ends. If the server
+// told the length of the resource, the rest of it is asked for, and any
+// part it sends again is skipped. Live streams just carry on.
+class Stream
+{
+public:
+    static constexpr std::size_t BufferSize = 256 * 1024;
+    static constexpr double Timeout = 5.0;
+    static constexpr int Retries = 5;
+    static constexpr int Redirects = 5;
+    
+    explicit Stream(std::string const& url):
+        _url{parse(url)},
+        _buffer(BufferSize),
+        _head{0},
+        _size{0},
+        _ended{false},
+        _mutex{},
+        _readable{},
+        _writable{},
+        _name{},
+        _title{},
+        _received{0},
+        _reconnects{0},
+        _readWaits{0},
+        _running{true},
+        _service{},
+        _resolver{_service},
+        _socket{_service},
+        _deadline{_service},
+        _expired{false},
+        _offset{0},
+        _length{-1},
+        _live{false},
+        _thread{}
+    {
+        _deadline.expires_at(boost::posix_time::pos_infin);
+        check();
+        
+        _thread = std::thread{[this] { run(); }};
+    }
+    
+    Stream(Stream const& other) = delete;
+    Stream& operator=(Stream const& other) = delete;
+    
+    ~Stream()
+    {
+        close();
+        _thread.join();
+    }
+    
+    // Waits for data and copies up to size bytes of it; returns zero at the
+    // end of the stream.
+    int read(uint8_t* data, int size)
+    {
+        std::unique_lock<std::mutex> lock{_mutex};
+        if (_size == 0 && !_ended)
+        {
+            ++_readWaits;
+            _readable.wait(lock, [this] { return _size > 0 || _ended; });
+        }
+        
+        auto count = std::min({static_cast<std::size_t>(size), _size, _buffer.size() - _head});
+        std::memcpy(data, &_buffer[_head], count);
+        _head = (_head + count) % _buffer.size();
+        _size -= count;
+        
+        lock.unlock();
+        _writable.notify_one();
+        return static_cast<int>(count);
+    }
+    
+    // Ends the stream at once, waking a reader that waits for data.
+    void close()
+    {
+        _running.store(false, std::memory_order_relaxed);
+        _service.post([this]
+        {
+            boost::system::error_code error;
+            _resolver.cancel();
+            _socket.close(error);
+        });
+        
+        {
+            std::lock_guard<std::mutex> lock{_mutex};
+            _ended = true;
+        }
+        _readable.notify_all();
+        _writable.notify_all();
+    }
+    
+    // The title last announced in the ICY metadata.
+    std::string title() const
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        return _title;
+    }
+    
+    // Connections opened again after the first one ended or failed.
+    unsigned long reconnects() const
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        return _reconnects;
+    }
+
+private:
+    // Where the parser stands in the body of a response.
+    struct Body
+    {
+        std::size_t skip;
+        std::size_t interval;
+        std::size_t audio;
+        std::size_t metadata;
+        bool pending;
+        std::string text;
+    };
+    
+    void run()
+    {
+        auto failures = 0;
+        auto pause = 0.5;
+        while (_running.load(std::memory_order_relaxed))
+        {
+            auto delivered = _offset;
+            try
+            {
+                // Without a length, only a radio stream goes on after the
+                // connection ends.
+                fetch();
+                if (_length >= 0 ? _offset >= static_cast<uint64_t>(_length) : !_live)
+                {
+                    break;
+                }
+            }
+            catch (std::exception& e)
+            {
+                if (_running.load(std::memory_order_relaxed))
+                {
+                    vf::log::warning("Stream %s:%s%s: %s", _url.host, _url.port, _url.path, e.what());
+                }
+            }
+            
+            if (_offset > delivered)
+            {
+                failures = 0;
+                pause = 0.5;
+            }
+            else if (++failures > Retries)
+            {
+                vf::log::error("Giving up on stream %s:%s%s after %d attempts.", _url.host, _url.port, _url.path, failures);
+                break;
+            }
+            
+            std::unique_lock<std::mutex> lock{_mutex};
+            auto stopped = _writable.wait_for(lock, std::chrono::duration<double>(pause), [this]
+            {
+                return !_running.load(std::memory_order_relaxed);
+            });
+            if (stopped)
+            {
+                break;
+            }
+            ++_reconnects;
+            pause = std::min(2.0 * pause, double{Timeout});
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock{_mutex};
+            _ended = true;
+        }
+        _readable.notify_all();
+    }
+    
+    // Requests the resource and delivers its body until the connection
+    // ends, following redirects.
+    void fetch()
+    {
+        using boost::asio::ip::tcp;
+        
+        auto url = _url;
+        for (int redirects = 0; ; ++redirects)
+        {
+            boost::system::error_code ignored;
+            _socket.close(ignored);
+            
+            tcp::resolver::iterator endpoints;
+            wait([&](boost::system::error_code& error)
+            {
+                _resolver.async_resolve(tcp::resolver::query{url.host, url.port}, [&](boost::system::error_code const& result, tcp::resolver::iterator it)
+                {
+                    error = result;
+                    endpoints = it;
+                });
+            });
+            wait([&](boost::system::error_code& error)
+            {
+                boost::asio::async_connect(_socket, endpoints, [&](boost::system::error_code const& result, tcp::resolver::iterator)
+                {
+                    error = result;
+                });
+            });
+            
+            auto request = vf::format("GET %s HTTP/1.0\r\nHost: %s\r\nUser-Agent: Play\r\nAccept: */*\r\nIcy-MetaData: 1\r\n", url.path, url.host);
+            if (_offset > 0 && _length >= 0)
+            {
+                request += vf::format("Range: bytes=%d-\r\n", _offset);
+            }
+            request += "Connection: close\r\n\r\n";
+            wait([&](boost::system::error_code& error)
+            {
+                boost::asio::async_write(_socket, boost::asio::buffer(request), [&](boost::system::error_code const& result, std::size_t)
+                {
+                    error = result;
+                });
+            });
+            
+            boost::asio::streambuf response;
+            wait([&](boost::system::error_code& error)
+            {
+                boost::asio::async_read_until(_socket, response, "\r\n\r\n", [&](boost::system::error_code const& result, std::size_t)
+                {
+                    error = result;
+                });
+            });
+            
+            std::istream stream{&response};
+            std::string protocol;
+            int status = 0;
+            std::map<std::string, std::string> headers;
+            readHeaders(stream, protocol, status, headers);
+            _live = protocol == "ICY" || std::any_of(headers.begin(), headers.end(), [](std::pair<std::string const, std::string> const& header)
+            {
+                return header.first.compare(0, 4, "icy-") == 0;
+            });
+            
+            if (status >= 300 && status < 400 && headers.count("location"))
+            {
+                if (redirects >= Redirects)
+                {
+                    throw std::runtime_error("too many redirects");
+                }
+                url = parse(headers["location"]);
+                continue;
+            }
+            if (status != 200 && status != 206)
+            {
+                throw std::runtime_error(vf::format("HTTP status %d", status));
+            }
+            
+            Body body{0, 0, 0, 0, false, {}};
+            if (status == 206)
+            {
+                auto range = headers["content-range"];
+                auto total = range.rfind('/');
+                if (total != std::string::npos && range.compare(total + 1, std::string::npos, "*") != 0)
+                {
+                    _length = std::atoll(range.c_str() + total + 1);
+                }
+            }
+            else
+            {
+                // The server sends all of a resource of known length again,
+                // while a live stream goes on from where it is now.
+                body.skip = _length >= 0 ? static_cast<std::size_t>(_offset) : 0;
+                if (headers.count("content-length"))
+                {
+                    _length = std::atoll(headers["content-length"].c_str());
+                }
+            }
+            if (headers.count("icy-metaint"))
+            {
+                body.interval = static_cast<std::size_t>(std::atol(headers["icy-metaint"].c_str()));
+                body.audio = body.interval;
+            }
+            if (headers.count("icy-name"))
+            {
+                std::lock_guard<std::mutex> lock{_mutex};
+                _name = headers["icy-name"];
+            }
+            
+            // Part of the body may have arrived along with the headers.
+            auto start = boost::asio::buffer_cast<uint8_t const*>(response.data());
+            deliver(body, start, response.size());
+            response.consume(response.size());
+            
+            uint8_t chunk[16 * 1024];
+            while (_running.load(std::memory_order_relaxed))
+            {
+                std::size_t count = 0;
+                wait([&](boost::system::error_code& error)
+                {
+                    _socket.async_read_some(boost::asio::buffer(chunk), [&](boost::system::error_code const& result, std::size_t bytes)
+                    {
+                        error = result;
+                        count = bytes;
+                    });
+                });
+                if (count == 0)
+                {
+                    return;
+                }
+                deliver(body, chunk, count);
+            }
+            return;
+        }
+    }
+    
+    static void readHeaders(std::istream& stream, std::string& protocol, int& status, std::map<std::string, std::string>& headers)
+    {
+        // SHOUTcast answers "ICY 200 OK" instead of an HTTP status line.
+        std::string line;
+        std::getline(stream, line);
+        std::istringstream fields{line};
+        fields >> protocol >> status;
+        if (!fields)
+        {
+            throw std::runtime_error("invalid response");
+        }
+        
+        while (std::getline(stream, line) && line != "\r" && !line.empty())
+        {
+            auto colon = line.find(':');
+            if (colon == std::string::npos)
+            {
+                continue;
+            }
+            
+            auto name = line.substr(0, colon);
+            std::transform(name.begin(), name.end(), name.begin(), [](char c) { return static_cast<char>(std::tolower(c)); });
+            auto begin = line.find_first_not_of(" \t", colon + 1);
+            auto end = line.find_last_not_of(" \t\r");
+            headers[name] = begin == std::string::npos || end < begin ? "" : line.substr(begin, end - begin + 1);
+        }
+    }
+    
+    // Separates audio from metadata: every interval bytes of audio are
+    // followed by a byte giving the length of a metadata block in units of
+    // 16 bytes, which is mostly zero.
+    void deliver(Body& body, uint8_t const* data, std::size_t size)
+    {
+        while (size > 0)
+        {
+            std::size_t count;
+            if (body.interval == 0 || body.audio > 0)
+            {
+                count = body.interval == 0 ? size : std::min(size, body.audio);
+                audio(body, data, count);
+                if (body.interval > 0)
+                {
+                    body.audio -= count;
+                }
+            }
+            else if (!body.pending)
+            {
+                count = 1;
+                body.metadata = 16 * static_cast<std::size_t>(data[0]);
+                body.pending = true;
+            }
+            else
+            {
+                count = std::min(size, body.metadata);
+                body.text.append(reinterpret_cast<char const*>(data), count);
+                body.metadata -= count;
+            }
+            data += count;
+            size -= count;
+            
+            if (body.pending && body.metadata == 0)
+            {
+                announce(body.text);
+                body.text.clear();
+                body.pending = false;
+                body.audio = body.interval;
+            }
+        }
+    }
+    
+    // Takes the title from a metadata block like "StreamTitle='...';".
+    void announce(std::string const& text)
+    {
+        static char const Key[] = "StreamTitle='";
+        auto begin = text.find(Key);
+        if (begin == std::string::npos)
+        {
+            return;
+        }
+        begin += sizeof(Key) - 1;
+        auto end = text.find("';", begin);
+        auto title = text.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+        
+        {
+            std::lock_guard<std::mutex> lock{_mutex};
+            if (title == _title)
+            {
+                return;
+            }
+            _title = title;
+        }
+        vf::log::info("Now playing %s", title);
+    }
+    
+    // Appends audio to the ring buffer, waiting for room while it is full.
+    void audio(Body& body, uint8_t const* data, std::size_t size)
+    {
+        auto skipped = std::min(size, body.skip);
+        body.skip -= skipped;
+        data += skipped;
+        size -= skipped;
+        
+        std::unique_lock<std::mutex> lock{_mutex};
+        while (size > 0)
+        {
+            _writable.wait(lock, [this]
+            {
+                return _size < _buffer.size() || !_running.load(std::memory_order_relaxed);
+            });
+            if (!_running.load(std::memory_order_relaxed))
+            {
+                return;
+            }
+            
+            auto tail = (_head + _size) % _buffer.size();
+            auto count = std::min({size, _buffer.size() - _size, _buffer.size() - tail});
+            std::memcpy(&_buffer[tail], data, count);
+            _size += count;
+            _received += count;
+            _offset += count;
+            data += count;
+            size -= count;
+            _readable.notify_one();
+        }
+    }
+    
+    // Runs an asynchronous operation to completion on this thread. The
+    // deadline closes the socket if it takes longer than the timeout. The
+    // end of the stream is not an error.
+    template<typename TOperation>
+    void wait(TOperation operation)
+    {
+        _expired = false;
+        _deadline.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(Timeout * 1000)));
+        
+        boost::system::error_code error = boost::asio::error::would_block;
+        operation(error);
+        while (error == boost::asio::error::would_block)
+        {
+            _service.run_one();
+        }
+        
+        if (error && error != boost::asio::error::eof)
+        {
+            throw std::runtime_error(_expired ? "timed out" : error.message());
+        }
+    }
+    
+    // Waits for the deadline over and over, so the service never runs out
+    // of work.
+    void check()
+    {
+        if (_deadline.expires_at() <= boost::asio::deadline_timer::traits_type::now())
+        {
+            boost::system::error_code error;
+            _resolver.cancel();
+            _socket.close(error);
+            _expired = true;
+            _deadline.expires_at(boost::posix_time::pos_infin);
+        }
+        _deadline.async_wait([this](boost::system::error_code const&) { check(); });
+    }
+    
+    Url _url;
+    
+    std::vector<uint8_t> _buffer;
+    std::size_t _head;
+    std::size_t _size;
+    bool _ended;
+    mutable std::mutex _mutex;
+    std::condition_variable _readable;
+    std::condition_variable _writable;
+    
+    std::string _name;
+    std::string _title;
+    uint64_t _received;
+    unsigned long _reconnects;
+    unsigned long _readWaits;
+    
+    std::atomic<bool> _running;
+    boost::asio::io_service _service;
+    boost::asio::ip::tcp::resolver _resolver;
+    boost::asio::ip::tcp::socket _socket;
+    boost::asio::deadline_timer _deadline;
+    bool _expired;
+    uint64_t _offset;
+    int64_t _length;
+    bool _live;
+    
+    std::thread _thread;
+    
+    friend std::ostream& operator<<(std::ostream& os, Stream const& stream)
+    {
+        std::lock_guard<std::mutex> lock{stream._mutex};
+        os << vf::format(
+            "Stream: %s, %.1f KiB received, reconnected %d times, demuxer waited %d times, %d KiB buffered",
+            stream._name.empty() ? stream._url.host + stream._url.path : stream._name,
+            stream._received / 1024.0,
+            stream._reconnects,
+            stream._readWaits,
+            stream._size / 1024
+        ) << std::endl;
+        
+        return os;
+    }
+};
+
+} // http
+} // vf
+
+#endif // VF_HTTP_HPP_INCLUDED
\ No newline at end of file
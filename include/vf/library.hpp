@@ -0,0 +1,480 @@
+#ifndef VF_LIBRARY_HPP_INCLUDED
+#define VF_LIBRARY_HPP_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "ext/av.hpp"
+#include "format.hpp"
+#include "thread_pool.hpp"
+
+namespace vf {
+
+// Metadata of one file as found by the scanner.
+struct Track
+{
+    std::string path;
+    uint64_t size;
+    int64_t modified;
+    bool readable;
+    double duration;
+    std::string codec;
+    int channels;
+    int sampleRate;
+    std::string title;
+    std::string artist;
+    std::string album;
+};
+
+// A library of audio files kept in a binary index. The index is a 64 byte
+// header, a table of fixed size records sorted by path and a pool of
+// interned, null terminated strings the records refer to by offset. It is
+// mapped read-only, so opening a library costs no parsing at all. Rescanning
+// only probes files whose size or modification time changed.
+class Library
+{
+public:
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t recordCount;
+        uint64_t recordsOffset;
+        uint64_t stringsOffset;
+        uint64_t stringsSize;
+        uint8_t reserved[24];
+    };
+    
+    static_assert(sizeof(Header) == 64, "Wrong size!");
+    
+    struct Record
+    {
+        uint32_t path;
+        uint32_t codec;
+        uint32_t title;
+        uint32_t artist;
+        uint32_t album;
+        uint16_t channels;
+        uint16_t flags;
+        uint32_t sampleRate;
+        uint32_t reserved;
+        uint64_t size;
+        int64_t modified;
+        double duration;
+    };
+    
+    static_assert(sizeof(Record) == 56, "Wrong size!");
+    
+    static constexpr char const* Magic = "VFLIB\r\n\x1a";
+    static constexpr uint32_t Version = 1;
+    static constexpr uint16_t Unreadable = 1;
+    
+    // Probing reads little more than the first frames of a file.
+    static constexpr unsigned int ProbeBytes = 32 * 1024;
+    static constexpr double ProbeDuration = 0.5;
+    
+    explicit Library(std::string const& path):
+        _path{path},
+        _mapping{},
+        _region{},
+        _probed{0},
+        _unchanged{0},
+        _kept{0},
+        _unreadable{0}
+    {
+        map();
+    }
+    
+    Library(Library const& other) = delete;
+    Library& operator=(Library const& other) = delete;
+    
+    inline std::size_t size() const
+    {
+        return _region ? header().recordCount : 0;
+    }
+    
+    inline Record const& record(std::size_t index) const
+    {
+        return records()[index];
+    }
+    
+    inline char const* string(uint32_t offset) const
+    {
+        return static_cast<char const*>(_region->get_address()) + header().stringsOffset + offset;
+    }
+    
+    Track track(std::size_t index) const
+    {
+        auto const& r = record(index);
+        return {
+            string(r.path),
+            r.size,
+            r.modified,
+            (r.flags & Unreadable) == 0,
+            r.duration,
+            string(r.codec),
+            r.channels,
+            static_cast<int>(r.sampleRate),
+            string(r.title),
+            string(r.artist),
+            string(r.album)
+        };
+    }
+    
+    // Binary search over the records, which are sorted by path.
+    Record const* find(std::string const& path) const
+    {
+        auto begin = records();
+        auto end = begin + size();
+        auto it = std::lower_bound(begin, end, path, [this](Record const& record, std::string const& value)
+        {
+            return std::strcmp(string(record.path), value.c_str()) < 0;
+        });
+        return it != end && path == string(it->path) ? it : nullptr;
+    }
+    
+    // Walks the directories, probes new and changed files on the pool and
+    // replaces the index with the result. Files indexed under other roots
+    // stay as they are, as do those under directories that cannot be read,
+    // which are skipped with a warning.
+    void scan(std::vector<std::string> const& roots, ThreadPool& pool)
+    {
+        std::vector<Track> tracks;
+        std::vector<std::string> directories;
+        std::vector<std::string> skipped;
+        for (auto const& root: roots)
+        {
+            directories.push_back(normalize(boost::filesystem::absolute(root)));
+            walk(directories.back(), tracks, skipped);
+        }
+        
+        std::sort(tracks.begin(), tracks.end(), [](Track const& lhs, Track const& rhs)
+        {
+            return lhs.path < rhs.path;
+        });
+        tracks.erase(std::unique(tracks.begin(), tracks.end(), [](Track const& lhs, Track const& rhs)
+        {
+            return lhs.path == rhs.path;
+        }), tracks.end());
+        
+        std::vector<std::size_t> changed;
+        for (std::size_t i = 0; i < tracks.size(); ++i)
+        {
+            auto* previous = find(tracks[i].path);
+            if (previous && previous->size == tracks[i].size && previous->modified == tracks[i].modified)
+            {
+                tracks[i] = track(static_cast<std::size_t>(previous - records()));
+                ++_unchanged;
+            }
+            else
+            {
+                changed.push_back(i);
+            }
+        }
+        
+        pool.parallelFor(static_cast<unsigned int>(changed.size()), [&](unsigned int index)
+        {
+            auto& track = tracks[changed[index]];
+            track.readable = probe(track);
+            if (!track.readable)
+            {
+                ++_unreadable;
+            }
+        });
+        _probed += changed.size();
+        
+        auto scanned = tracks.size();
+        for (std::size_t i = 0; i < size(); ++i)
+        {
+            std::string path = string(record(i).path);
+            auto walked = std::any_of(directories.begin(), directories.end(), [&](std::string const& directory) { return within(path, directory); });
+            auto unread = std::any_of(skipped.begin(), skipped.end(), [&](std::string const& directory) { return within(path, directory); });
+            if (walked && !unread)
+            {
+                continue;
+            }
+            
+            auto it = std::lower_bound(tracks.begin(), tracks.begin() + scanned, path, [](Track const& track, std::string const& value)
+            {
+                return track.path < value;
+            });
+            if (it == tracks.begin() + scanned || it->path != path)
+            {
+                tracks.push_back(track(i));
+                ++_kept;
+            }
+        }
+        std::inplace_merge(tracks.begin(), tracks.begin() + scanned, tracks.end(), [](Track const& lhs, Track const& rhs)
+        {
+            return lhs.path < rhs.path;
+        });
+        
+        write(tracks);
+        map();
+    }
+
+private:
+    // The path without trailing separators or dots, as given.
+    static std::string normalize(boost::filesystem::path const& path)
+    {
+        auto result = path.string();
+        while (result.size() > 1 && (result.back() == '/' || result.back() == '\\' || (result.back() == '.' && (result[result.size() - 2] == '/' || result[result.size() - 2] == '\\'))))
+        {
+            result.pop_back();
+        }
+        return result;
+    }
+    
+    static bool within(std::string const& path, std::string const& directory)
+    {
+        auto last = directory.back();
+        return path.size() > directory.size()
+            && path.compare(0, directory.size(), directory) == 0
+            && (last == '/' || last == '\\' || path[directory.size()] == '/' || path[directory.size()] == '\\');
+    }
+    
+    // Collects the regular files below a directory without following links
+    // to directories. Directories that cannot be listed are skipped.
+    static void walk(std::string const& root, std::vector<Track>& tracks, std::vector<std::string>& skipped)
+    {
+        std::vector<boost::filesystem::path> pending{root};
+        while (!pending.empty())
+        {
+            auto directory = pending.back();
+            pending.pop_back();
+            
+            boost::system::error_code error;
+            boost::filesystem::directory_iterator it{directory, error}, end;
+            for (; !error && it != end; it.increment(error))
+            {
+                boost::system::error_code ignored;
+                if (boost::filesystem::is_directory(it->symlink_status(ignored)))
+                {
+                    pending.push_back(it->path());
+                    continue;
+                }
+                if (!boost::filesystem::is_regular_file(it->status(ignored)))
+                {
+                    continue;
+                }
+                
+                boost::system::error_code failed;
+                auto size = boost::filesystem::file_size(it->path(), failed);
+                auto modified = boost::filesystem::last_write_time(it->path(), failed);
+                if (!failed)
+                {
+                    tracks.push_back(Track{it->path().string(), size, modified, false, 0.0, "", 0, 0, "", "", ""});
+                }
+            }
+            
+            if (error)
+            {
+                vf::log::warning("Skipped %s: %s.", directory.string(), error.message());
+                skipped.push_back(directory.string());
+            }
+        }
+    }
+    
+    inline Header const& header() const
+    {
+        return *static_cast<Header const*>(_region->get_address());
+    }
+    
+    inline Record const* records() const
+    {
+        return _region ? reinterpret_cast<Record const*>(static_cast<char const*>(_region->get_address()) + header().recordsOffset) : nullptr;
+    }
+    
+    bool valid() const
+    {
+        auto size = _region->get_size();
+        if (size < sizeof(Header))
+        {
+            return false;
+        }
+        
+        auto const& h = header();
+        return std::memcmp(h.magic, Magic, sizeof(h.magic)) == 0
+            && h.version == Version
+            && h.recordsOffset + h.recordCount * sizeof(Record) <= h.stringsOffset
+            && h.stringsOffset + h.stringsSize <= size
+            && h.stringsSize > 0;
+    }
+    
+    void map()
+    {
+        _region.reset();
+        _mapping.reset();
+        
+        boost::system::error_code error;
+        if (!boost::filesystem::is_regular_file(_path, error) || boost::filesystem::file_size(_path, error) < sizeof(Header))
+        {
+            return;
+        }
+        
+        try
+        {
+            _mapping.reset(new boost::interprocess::file_mapping{_path.c_str(), boost::interprocess::read_only});
+            _region.reset(new boost::interprocess::mapped_region{*_mapping, boost::interprocess::read_only});
+            if (!valid())
+            {
+                _region.reset();
+                _mapping.reset();
+            }
+        }
+        catch (boost::interprocess::interprocess_exception&)
+        {
+            _region.reset();
+            _mapping.reset();
+        }
+    }
+    
+    static bool probe(Track& track)
+    {
+        try
+        {
+            ext::av::FormatContext formatContext;
+            formatContext.probeSize(ProbeBytes);
+            formatContext.maxAnalyzeDuration(ProbeDuration);
+            formatContext.open(track.path);
+            
+            try
+            {
+                formatContext.findStreamInfo();
+                auto stream = formatContext.findBestStream(ext::av::MediaType::Audio);
+                
+                auto tag = [&](char const* key) -> std::string
+                {
+                    auto value = stream.metadata(key);
+                    if (value == nullptr)
+                    {
+                        value = formatContext.metadata(key);
+                    }
+                    return value ? value : "";
+                };
+                
+                auto codec = stream.codec();
+                track.codec = codec.valid() ? codec.name() : "";
+                track.channels = stream.channels();
+                track.sampleRate = stream.sampleRate();
+                track.duration = std::max(0.0, formatContext.duration());
+                track.title = tag("title");
+                track.artist = tag("artist");
+                track.album = tag("album");
+            }
+            catch (...)
+            {
+                formatContext.close();
+                throw;
+            }
+            
+            formatContext.close();
+            return true;
+        }
+        catch (std::runtime_error&)
+        {
+            return false;
+        }
+    }
+    
+    // Writes the index next to the old one and moves it into place, so a
+    // concurrent reader keeps its mapping of the old file.
+    void write(std::vector<Track> const& tracks) const
+    {
+        std::string strings(1, '\0');
+        std::unordered_map<std::string, uint32_t> offsets;
+        offsets.emplace("", 0);
+        
+        auto intern = [&](std::string const& value) -> uint32_t
+        {
+            auto it = offsets.find(value);
+            if (it != offsets.end())
+            {
+                return it->second;
+            }
+            auto offset = static_cast<uint32_t>(strings.size());
+            strings.append(value.c_str(), value.size() + 1);
+            offsets.emplace(value, offset);
+            return offset;
+        };
+        
+        std::vector<Record> records;
+        records.reserve(tracks.size());
+        for (auto const& track: tracks)
+        {
+            Record record{};
+            record.path = intern(track.path);
+            record.codec = intern(track.codec);
+            record.title = intern(track.title);
+            record.artist = intern(track.artist);
+            record.album = intern(track.album);
+            record.channels = static_cast<uint16_t>(track.channels);
+            record.flags = track.readable ? 0 : Unreadable;
+            record.sampleRate = static_cast<uint32_t>(track.sampleRate);
+            record.size = track.size;
+            record.modified = track.modified;
+            record.duration = track.duration;
+            records.push_back(record);
+        }
+        
+        Header header{};
+        std::memcpy(header.magic, Magic, sizeof(header.magic));
+        header.version = Version;
+        header.recordCount = static_cast<uint32_t>(records.size());
+        header.recordsOffset = sizeof(Header);
+        header.stringsOffset = header.recordsOffset + records.size() * sizeof(Record);
+        header.stringsSize = strings.size();
+        
+        auto temporary = boost::filesystem::unique_path(_path + ".%%%%%%.tmp");
+        {
+            std::ofstream stream{temporary.string(), std::ios::binary | std::ios::trunc};
+            stream.write(reinterpret_cast<char const*>(&header), sizeof(header));
+            stream.write(reinterpret_cast<char const*>(records.data()), records.size() * sizeof(Record));
+            stream.write(strings.data(), strings.size());
+            if (!stream)
+            {
+                throw std::runtime_error("Failed to write library index.");
+            }
+        }
+        boost::filesystem::rename(temporary, _path);
+    }
+    
+    std::string _path;
+    std::unique_ptr<boost::interprocess::file_mapping> _mapping;
+    std::unique_ptr<boost::interprocess::mapped_region> _region;
+    
+    std::size_t _probed;
+    std::size_t _unchanged;
+    std::size_t _kept;
+    std::atomic<unsigned long> _unreadable;
+    
+    friend std::ostream& operator<<(std::ostream& os, Library const& library)
+    {
+        os << vf::format(
+            "Library: %d files, %d probed, %d unchanged, %d kept from other roots, %d unreadable, %d bytes of strings",
+            library.size(),
+            library._probed,
+            library._unchanged,
+            library._kept,
+            library._unreadable.load(),
+            library._region ? library.header().stringsSize : 0
+        ) << std::endl;
+        
+        return os;
+    }
+};
+
+} // vf
+
+#endif // VF_LIBRARY_HPP_INCLUDED
\ No newline at end of file
@@ -0,0 +1,459 @@
+#ifndef VF_LOG_HPP_INCLUDED
+#define VF_LOG_HPP_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+
+#include "format.hpp"
+#include "mpsc_queue.hpp"
+
+namespace vf {
+namespace log {
+
+using Clock = std::chrono::steady_clock;
+
+enum class Level
+{
+    Error,
+    Warning,
+    Info,
+    Debug,
+};
+
+inline char const* name(Level level)
+{
+    switch (level)
+    {
+        case Level::Error: return "error";
+        case Level::Warning: return "warning";
+        case Level::Info: return "info";
+        case Level::Debug: return "debug";
+    }
+    return "";
+}
+
+inline Level parse(std::string const& name)
+{
+    for (auto level: {Level::Error, Level::Warning, Level::Info, Level::Debug})
+    {
+        if (name == log::name(level)) return level;
+    }
+    throw std::runtime_error("Unknown log level " + name);
+}
+
+// An argument of a message, kept as it was passed until the writer formats
+// it. Strings are copied into the text of the record they belong to.
+struct Argument
+{
+    enum class Type
+    {
+        Signed,
+        Unsigned,
+        Real,
+        Text,
+    };
+    
+    struct Span
+    {
+        unsigned short offset;
+        unsigned short length;
+    };
+    
+    Type type;
+    union
+    {
+        long long integer;
+        unsigned long long natural;
+        double real;
+        Span text;
+    };
+};
+
+// A message as captured on the thread that logged it. The source and the
+// format are strings with static storage, such as the class name of a
+// libav context. Without a format, the text is the message itself.
+struct Record
+{
+    static constexpr std::size_t MaxArguments = 8;
+    
+    Level level;
+    Clock::time_point time;
+    std::thread::id thread;
+    char const* source;
+    char const* format;
+    std::size_t count;
+    Argument arguments[MaxArguments];
+    std::size_t used;
+    char text[256];
+};
+
+// Collects records from any thread in a lock-free queue and writes them out
+// on a thread of its own. Logging copies the format string pointer and the
+// arguments into a preallocated record and never blocks, allocates or
+// touches the stream; if the writer falls behind, records are dropped and
+// counted instead. Numbers are stored as they are and strings are copied
+// (and truncated to what fits in the record). Arguments of other types are
+// turned into text on the calling thread, which allocates. The writer
+// formats the message and adds the timestamp, level, source and thread to
+// every line. The first logger alive is the one the functions below and
+// libav write to.
+class Logger
+{
+public:
+    Logger(std::ostream& stream, Level level, std::size_t capacity = 1024):
+        _stream(stream),
+        _level{level},
+        _records{capacity},
+        _start{Clock::now()},
+        _running{true},
+        _dropped{0},
+        _threads{},
+        _thread{}
+    {
+        _thread = std::thread{[this] { run(); }};
+        
+        Logger* none = nullptr;
+        current().compare_exchange_strong(none, this);
+    }
+    
+    Logger(Logger const& other) = delete;
+    Logger& operator=(Logger const& other) = delete;
+    
+    ~Logger()
+    {
+        auto self = this;
+        current().compare_exchange_strong(self, nullptr);
+        
+        _running.store(false, std::memory_order_release);
+        _thread.join();
+    }
+    
+    static std::atomic<Logger*>& current()
+    {
+        static std::atomic<Logger*> logger{nullptr};
+        return logger;
+    }
+    
+    inline Level level() const
+    {
+        return _level.load(std::memory_order_relaxed);
+    }
+    
+    inline void level(Level level)
+    {
+        _level.store(level, std::memory_order_relaxed);
+    }
+    
+    inline bool enabled(Level level) const
+    {
+        return level <= this->level();
+    }
+    
+    void write(Level level, char const* source, char const* text)
+    {
+        capture(level, source, [text](char* buffer, std::size_t size)
+        {
+            return std::snprintf(buffer, size, "%s", text);
+        });
+    }
+    
+    void write(Level level, char const* source, char const* format, va_list arguments)
+    {
+        capture(level, source, [&](char* buffer, std::size_t size)
+        {
+            return std::vsnprintf(buffer, size, format, arguments);
+        });
+    }
+    
+    // Queues a message to be formatted on the writer thread.
+    template<typename... TArgs>
+    void defer(Level level, char const* source, char const* format, TArgs&&... args)
+    {
+        static_assert(sizeof...(TArgs) <= Record::MaxArguments, "Too many arguments!");
+        
+        auto time = Clock::now();
+        auto thread = std::this_thread::get_id();
+        auto pushed = _records.emplace([&](Record& record)
+        {
+            record.level = level;
+            record.time = time;
+            record.thread = thread;
+            record.source = source;
+            record.format = format;
+            record.count = 0;
+            record.used = 0;
+            
+            int expand[] = {0, (store(record, std::forward<TArgs>(args)), 0)...};
+            (void)expand;
+        });
+        if (!pushed)
+        {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    template<typename TFunction>
+    void capture(Level level, char const* source, TFunction render)
+    {
+        auto time = Clock::now();
+        auto thread = std::this_thread::get_id();
+        auto pushed = _records.emplace([&](Record& record)
+        {
+            record.level = level;
+            record.time = time;
+            record.thread = thread;
+            record.source = source;
+            record.format = nullptr;
+            record.count = 0;
+            record.used = 0;
+            
+            auto length = render(record.text, sizeof(record.text));
+            if (length >= static_cast<int>(sizeof(record.text)))
+            {
+                std::memcpy(record.text + sizeof(record.text) - 4, "...", 4);
+            }
+            else if (length < 0)
+            {
+                record.text[0] = '\0';
+            }
+        });
+        if (!pushed)
+        {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    
+    template<typename T>
+    static typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type
+    store(Record& record, T value)
+    {
+        auto& argument = record.arguments[record.count++];
+        argument.type = Argument::Type::Signed;
+        argument.integer = value;
+    }
+    
+    template<typename T>
+    static typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value>::type
+    store(Record& record, T value)
+    {
+        auto& argument = record.arguments[record.count++];
+        argument.type = Argument::Type::Unsigned;
+        argument.natural = value;
+    }
+    
+    template<typename T>
+    static typename std::enable_if<std::is_floating_point<T>::value>::type
+    store(Record& record, T value)
+    {
+        auto& argument = record.arguments[record.count++];
+        argument.type = Argument::Type::Real;
+        argument.real = value;
+    }
+    
+    static void store(Record& record, char value)
+    {
+        store(record, &value, 1);
+    }
+    
+    static void store(Record& record, char const* value)
+    {
+        store(record, value, std::strlen(value));
+    }
+    
+    static void store(Record& record, std::string const& value)
+    {
+        store(record, value.data(), value.size());
+    }
+    
+    template<typename T>
+    static typename std::enable_if<!std::is_arithmetic<T>::value && !std::is_convertible<T, char const*>::value && !std::is_convertible<T, std::string const&>::value>::type
+    store(Record& record, T const& value)
+    {
+        std::ostringstream stream;
+        stream << value;
+        store(record, stream.str());
+    }
+    
+    // Copies a string into the text of the record, terminated so that the
+    // writer can pass it on as it is. Once the text is full, strings are
+    // left empty; the last byte of a full text is always the terminator.
+    static void store(Record& record, char const* value, std::size_t length)
+    {
+        auto& argument = record.arguments[record.count++];
+        argument.type = Argument::Type::Text;
+        if (record.used >= sizeof(record.text))
+        {
+            argument.text.offset = static_cast<unsigned short>(sizeof(record.text) - 1);
+            argument.text.length = 0;
+            return;
+        }
+        
+        auto available = sizeof(record.text) - record.used - 1;
+        length = length < available ? length : available;
+        std::memcpy(record.text + record.used, value, length);
+        record.text[record.used + length] = '\0';
+        
+        argument.text.offset = static_cast<unsigned short>(record.used);
+        argument.text.length = static_cast<unsigned short>(length);
+        record.used += length + 1;
+    }
+    
+    void run()
+    {
+        Record record;
+        for (;;)
+        {
+            auto running = _running.load(std::memory_order_acquire);
+            
+            auto written = false;
+            while (_records.tryPop(record))
+            {
+                print(record);
+                written = true;
+            }
+            
+            auto dropped = _dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0)
+            {
+                _stream << vf::format("%.6f %s log: dropped %d messages", seconds(Clock::now()), name(Level::Warning), dropped) << '\n';
+                written = true;
+            }
+            
+            if (written)
+            {
+                _stream.flush();
+            }
+            else if (running)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            
+            if (!running)
+            {
+                break;
+            }
+        }
+    }
+    
+    // Messages of libav come with their line breaks, and some in pieces;
+    // empty pieces are skipped.
+    void print(Record const& record)
+    {
+        auto text = record.format ? compose(record) : std::string{record.text};
+        auto length = text.size();
+        while (length > 0 && (text[length - 1] == '\n' || text[length - 1] == '\r'))
+        {
+            --length;
+        }
+        if (length == 0)
+        {
+            return;
+        }
+        
+        auto thread = _threads.emplace(record.thread, static_cast<int>(_threads.size())).first->second;
+        _stream << vf::format("%.6f %s %s[%d]: ", seconds(record.time), name(record.level), record.source, thread);
+        _stream.write(text.data(), static_cast<std::streamsize>(length));
+        _stream << '\n';
+    }
+    
+    // A format that does not match its arguments is written as it is.
+    static std::string compose(Record const& record)
+    {
+        try
+        {
+            boost::format message{record.format};
+            for (std::size_t i = 0; i < record.count; ++i)
+            {
+                auto const& argument = record.arguments[i];
+                switch (argument.type)
+                {
+                    case Argument::Type::Signed: message % argument.integer; break;
+                    case Argument::Type::Unsigned: message % argument.natural; break;
+                    case Argument::Type::Real: message % argument.real; break;
+                    case Argument::Type::Text: message % (record.text + argument.text.offset); break;
+                }
+            }
+            return message.str();
+        }
+        catch (boost::io::format_error& e)
+        {
+            return vf::format("%s (%s)", record.format, e.what());
+        }
+    }
+    
+    inline double seconds(Clock::time_point time) const
+    {
+        return std::chrono::duration<double>(time - _start).count();
+    }
+    
+    std::ostream& _stream;
+    std::atomic<Level> _level;
+    MpscQueue<Record> _records;
+    Clock::time_point _start;
+    std::atomic<bool> _running;
+    std::atomic<unsigned long> _dropped;
+    
+    // Threads are numbered in the order they first log.
+    std::unordered_map<std::thread::id, int> _threads;
+    std::thread _thread;
+};
+
+// Queues a message if the level is enabled; the format must be a string
+// with static storage, such as a literal. Without a logger, errors and
+// warnings are formatted and go straight to std::cerr.
+template<typename... TArgs>
+void write(Level level, char const* format, TArgs&&... args)
+{
+    auto logger = Logger::current().load(std::memory_order_acquire);
+    if (logger == nullptr)
+    {
+        if (level <= Level::Warning)
+        {
+            std::cerr << vf::format(format, std::forward<TArgs>(args)...) << std::endl;
+        }
+    }
+    else if (logger->enabled(level))
+    {
+        logger->defer(level, "vf", format, std::forward<TArgs>(args)...);
+    }
+}
+
+template<typename... TArgs>
+void error(char const* format, TArgs&&... args)
+{
+    write(Level::Error, format, std::forward<TArgs>(args)...);
+}
+
+template<typename... TArgs>
+void warning(char const* format, TArgs&&... args)
+{
+    write(Level::Warning, format, std::forward<TArgs>(args)...);
+}
+
+template<typename... TArgs>
+void info(char const* format, TArgs&&... args)
+{
+    write(Level::Info, format, std::forward<TArgs>(args)...);
+}
+
+template<typename... TArgs>
+void debug(char const* format, TArgs&&... args)
+{
+    write(Level::Debug, format, std::forward<TArgs>(args)...);
+}
+
+} // log
+} // vf
+
+#endif // VF_LOG_HPP_INCLUDED
\ No newline at end of file
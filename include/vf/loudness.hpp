@@ -0,0 +1,442 @@
+#ifndef VF_LOUDNESS_HPP_INCLUDED
+#define VF_LOUDNESS_HPP_INCLUDED
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "config.hpp"
+#include "format.hpp"
+
+#if defined(SIMD_SSE2)
+
+#include <emmintrin.h>
+
+#endif
+
+namespace vf {
+namespace loudness {
+
+struct Result
+{
+    double integrated;
+    double range;
+    double truePeak;
+};
+
+// Second order IIR section in transposed direct form II.
+class Biquad
+{
+public:
+    Biquad(double b0, double b1, double b2, double a1, double a2):
+        _b0{b0}, _b1{b1}, _b2{b2}, _a1{a1}, _a2{a2},
+        _z1{0.0}, _z2{0.0}
+    {}
+    
+    inline double process(double x)
+    {
+        auto y = _b0 * x + _z1;
+        _z1 = _b1 * x - _a1 * y + _z2;
+        _z2 = _b2 * x - _a2 * y;
+        return y;
+    }
+
+private:
+    double _b0, _b1, _b2, _a1, _a2;
+    double _z1, _z2;
+};
+
+// EBU R128 / ITU-R BS.1770 meter for one stream: K-weighted integrated
+// loudness and loudness range from 100 ms segments, and true peak from 4x
+// oversampling. Input is interleaved float at the stream's own rate.
+class Meter
+{
+public:
+    static constexpr int Taps = 12;
+    static constexpr int Phases = 4;
+    static constexpr std::size_t BatchFrames = 1024;
+    
+    Meter(int channels, int sampleRate):
+        _channels{channels},
+        _filters{},
+        _weights(static_cast<std::size_t>(channels), 1.0),
+        _segmentLength{std::max(1, sampleRate / 10)},
+        _segmentPosition{0},
+        _segmentEnergy{0.0},
+        _segments{},
+        _momentary{},
+        _shortTerm{},
+        _coefficients(static_cast<std::size_t>(Phases * Taps)),
+        _history(static_cast<std::size_t>(channels * (Taps - 1)), 0.0f),
+        _scratch(BatchFrames + Taps - 1),
+        _peak{0.0f}
+    {
+        auto pi = std::acos(-1.0);
+        
+        // Stage 1: high shelf modelling the acoustic effect of the head.
+        auto f1 = 1681.974450955533;
+        auto g1 = 3.999843853973347;
+        auto q1 = 0.7071752369554196;
+        auto k1 = std::tan(pi * f1 / sampleRate);
+        auto vh = std::pow(10.0, g1 / 20.0);
+        auto vb = std::pow(vh, 0.4996667741545416);
+        auto n1 = 1.0 + k1 / q1 + k1 * k1;
+        
+        // Stage 2: the RLB high pass.
+        auto f2 = 38.13547087602444;
+        auto q2 = 0.5003270373238773;
+        auto k2 = std::tan(pi * f2 / sampleRate);
+        auto n2 = 1.0 + k2 / q2 + k2 * k2;
+        
+        for (int c = 0; c < channels; ++c)
+        {
+            _filters.emplace_back(
+                (vh + vb * k1 / q1 + k1 * k1) / n1,
+                2.0 * (k1 * k1 - vh) / n1,
+                (vh - vb * k1 / q1 + k1 * k1) / n1,
+                2.0 * (k1 * k1 - 1.0) / n1,
+                (1.0 - k1 / q1 + k1 * k1) / n1
+            );
+            _filters.emplace_back(
+                1.0,
+                -2.0,
+                1.0,
+                2.0 * (k2 * k2 - 1.0) / n2,
+                (1.0 - k2 / q2 + k2 * k2) / n2
+            );
+        }
+        
+        // 5.1 in FFmpeg order: the LFE does not count, surrounds weigh +1.5 dB.
+        if (channels == 6)
+        {
+            _weights[3] = 0.0;
+            _weights[4] = 1.41;
+            _weights[5] = 1.41;
+        }
+        
+        // Windowed sinc interpolator, stored per phase with reversed taps so
+        // each output is a dot product over consecutive input samples. It is
+        // centred on a tap, so phase 0 passes the samples through unchanged
+        // and the true peak is never below the sample peak, as BS.1770
+        // Annex 2 has it. The others fall a quarter sample apart between them.
+        auto length = Phases * Taps;
+        auto centre = length / 2;
+        for (int n = 0; n < length; ++n)
+        {
+            auto offset = n - centre;
+            auto t = static_cast<double>(offset) / Phases;
+            auto sinc = offset == 0 ? 1.0 : offset % Phases == 0 ? 0.0 : std::sin(pi * t) / (pi * t);
+            auto window = 0.5 + 0.5 * std::cos(pi * t / (Taps / 2));
+            auto phase = n % Phases;
+            auto tap = n / Phases;
+            _coefficients[static_cast<std::size_t>(phase * Taps + (Taps - 1 - tap))] = static_cast<float>(sinc * window);
+        }
+    }
+    
+    void process(float const* samples, std::size_t frames)
+    {
+        for (std::size_t offset = 0; offset < frames; offset += BatchFrames)
+        {
+            auto count = frames - offset < BatchFrames ? frames - offset : BatchFrames;
+            auto batch = samples + offset * _channels;
+            
+            measurePeak(batch, count);
+            measureLoudness(batch, count);
+        }
+    }
+    
+    // The last samples have not reached the centre of the interpolator yet
+    // and count as they are.
+    Result result() const
+    {
+        auto peak = _peak;
+        for (auto sample: _history)
+        {
+            peak = std::max(peak, std::abs(sample));
+        }
+        return {integrated(), range(), 20.0 * std::log10(std::max(peak, 1e-10f))};
+    }
+
+private:
+    // Loudness in LUFS, reported as the absolute gate for silence.
+    static double toLoudness(double energy)
+    {
+        return energy > 0.0 ? std::max(-70.0, -0.691 + 10.0 * std::log10(energy)) : -70.0;
+    }
+    
+    static double toEnergy(double loudness)
+    {
+        return std::pow(10.0, (loudness + 0.691) / 10.0);
+    }
+    
+    void measureLoudness(float const* samples, std::size_t frames)
+    {
+        for (std::size_t i = 0; i < frames; ++i)
+        {
+            auto frame = samples + i * _channels;
+            for (int c = 0; c < _channels; ++c)
+            {
+                auto& pre = _filters[static_cast<std::size_t>(2 * c)];
+                auto& rlb = _filters[static_cast<std::size_t>(2 * c + 1)];
+                auto y = rlb.process(pre.process(frame[c]));
+                _segmentEnergy += _weights[static_cast<std::size_t>(c)] * y * y;
+            }
+            
+            if (++_segmentPosition == _segmentLength)
+            {
+                endSegment();
+            }
+        }
+    }
+    
+    // Every 100 ms a 400 ms momentary block and, once available, a 3 s
+    // short-term block ends.
+    void endSegment()
+    {
+        _segments.push_back(_segmentEnergy / _segmentLength);
+        _segmentEnergy = 0.0;
+        _segmentPosition = 0;
+        
+        auto mean = [this](std::size_t count)
+        {
+            auto sum = 0.0;
+            for (auto i = _segments.size() - count; i < _segments.size(); ++i)
+            {
+                sum += _segments[i];
+            }
+            return sum / count;
+        };
+        
+        if (_segments.size() >= 4)
+        {
+            _momentary.push_back(mean(4));
+        }
+        if (_segments.size() >= 30)
+        {
+            _shortTerm.push_back(mean(30));
+            _segments.erase(_segments.begin());
+        }
+    }
+    
+    // Mean energy of the blocks above the absolute gate and above the gate
+    // relative to the mean of those.
+    static double gate(std::vector<double> const& blocks, double relative, std::vector<double>* gated = nullptr)
+    {
+        auto absolute = toEnergy(-70.0);
+        
+        auto sum = 0.0;
+        std::size_t count = 0;
+        for (auto energy: blocks)
+        {
+            if (energy > absolute)
+            {
+                sum += energy;
+                ++count;
+            }
+        }
+        if (count == 0)
+        {
+            return 0.0;
+        }
+        
+        auto threshold = std::max(absolute, sum / count * std::pow(10.0, relative / 10.0));
+        
+        sum = 0.0;
+        count = 0;
+        for (auto energy: blocks)
+        {
+            if (energy > threshold)
+            {
+                sum += energy;
+                ++count;
+                if (gated)
+                {
+                    gated->push_back(toLoudness(energy));
+                }
+            }
+        }
+        return count > 0 ? sum / count : 0.0;
+    }
+    
+    double integrated() const
+    {
+        return toLoudness(gate(_momentary, -10.0));
+    }
+    
+    double range() const
+    {
+        std::vector<double> loudness;
+        gate(_shortTerm, -20.0, &loudness);
+        if (loudness.size() < 2)
+        {
+            return 0.0;
+        }
+        
+        std::sort(loudness.begin(), loudness.end());
+        auto percentile = [&loudness](double p)
+        {
+            return loudness[static_cast<std::size_t>(p * (loudness.size() - 1) + 0.5)];
+        };
+        return percentile(0.95) - percentile(0.10);
+    }
+    
+    // Interpolates each channel by four and tracks the largest magnitude.
+    // Four consecutive outputs of a phase are computed per vector.
+    void measurePeak(float const* samples, std::size_t frames)
+    {
+        auto history = static_cast<std::size_t>(Taps - 1);
+        for (int c = 0; c < _channels; ++c)
+        {
+            auto* saved = &_history[static_cast<std::size_t>(c) * history];
+            std::copy(saved, saved + history, _scratch.begin());
+            for (std::size_t i = 0; i < frames; ++i)
+            {
+                _scratch[history + i] = samples[i * _channels + c];
+            }
+            
+            for (int phase = 0; phase < Phases; ++phase)
+            {
+                auto const* h = &_coefficients[static_cast<std::size_t>(phase * Taps)];
+                std::size_t i = 0;
+#if defined(SIMD_SSE2)
+                auto mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+                auto max = _mm_setzero_ps();
+                for (; i + 4 <= frames; i += 4)
+                {
+                    auto sum = _mm_setzero_ps();
+                    for (int k = 0; k < Taps; ++k)
+                    {
+                        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(h[k]), _mm_loadu_ps(&_scratch[i + k])));
+                    }
+                    max = _mm_max_ps(max, _mm_and_ps(sum, mask));
+                }
+                float lanes[4];
+                _mm_storeu_ps(lanes, max);
+                _peak = std::max(_peak, *std::max_element(lanes, lanes + 4));
+#endif
+                for (; i < frames; ++i)
+                {
+                    auto sum = 0.0f;
+                    for (int k = 0; k < Taps; ++k)
+                    {
+                        sum += h[k] * _scratch[i + k];
+                    }
+                    _peak = std::max(_peak, std::abs(sum));
+                }
+            }
+            
+            std::copy(_scratch.begin() + frames, _scratch.begin() + frames + history, saved);
+        }
+    }
+    
+    int _channels;
+    
+    std::vector<Biquad> _filters;
+    std::vector<double> _weights;
+    
+    int _segmentLength;
+    int _segmentPosition;
+    double _segmentEnergy;
+    std::vector<double> _segments;
+    std::vector<double> _momentary;
+    std::vector<double> _shortTerm;
+    
+    std::vector<float> _coefficients;
+    std::vector<float> _history;
+    std::vector<float> _scratch;
+    float _peak;
+};
+
+// Analysis results keyed by file fingerprint, stored as one line per file.
+// Only entries looked up or added since loading are written back, so files
+// that disappeared from the library drop out of the cache.
+class Cache
+{
+public:
+    explicit Cache(std::string const& path):
+        _path{path},
+        _loaded{},
+        _current{},
+        _mutex{}
+    {
+        std::ifstream stream{_path};
+        std::string line;
+        while (std::getline(stream, line))
+        {
+            std::istringstream fields{line};
+            uint64_t fingerprint;
+            Result result;
+            if (fields >> std::hex >> fingerprint >> std::dec >> result.integrated >> result.range >> result.truePeak)
+            {
+                _loaded[fingerprint] = result;
+            }
+        }
+    }
+    
+    Cache(Cache const& other) = delete;
+    Cache& operator=(Cache const& other) = delete;
+    
+    bool find(uint64_t fingerprint, Result& result)
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        
+        auto it = _loaded.find(fingerprint);
+        if (it == _loaded.end())
+        {
+            return false;
+        }
+        result = it->second;
+        _current[fingerprint] = result;
+        return true;
+    }
+    
+    void insert(uint64_t fingerprint, Result const& result)
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        _current[fingerprint] = result;
+    }
+    
+    void save() const
+    {
+        if (_path.empty())
+        {
+            return;
+        }
+        
+        std::lock_guard<std::mutex> lock{_mutex};
+        
+        auto temporary = _path + ".tmp";
+        {
+            std::ofstream stream{temporary, std::ios::trunc};
+            for (auto const& entry: _current)
+            {
+                stream << vf::format("%016x %.2f %.2f %.2f", entry.first, entry.second.integrated, entry.second.range, entry.second.truePeak) << std::endl;
+            }
+            if (!stream)
+            {
+                throw std::runtime_error("Failed to write loudness cache.");
+            }
+        }
+        std::rename(temporary.c_str(), _path.c_str());
+    }
+
+private:
+    std::string _path;
+    std::unordered_map<uint64_t, Result> _loaded;
+    std::unordered_map<uint64_t, Result> _current;
+    mutable std::mutex _mutex;
+};
+
+} // loudness
+} // vf
+
+#endif // VF_LOUDNESS_HPP_INCLUDED
\ No newline at end of file
@@ -0,0 +1,58 @@
+#ifndef VF_MEMORY_HPP_INCLUDED
+#define VF_MEMORY_HPP_INCLUDED
+
+#include <atomic>
+#include <cstddef>
+#include <fstream>
+
+#include "config.hpp"
+
+#if defined(PLATFORM_LINUX)
+
+#include <unistd.h>
+
+#endif
+
+namespace vf {
+namespace memory {
+
+// Calls of the global operator new and delete. They are only counted if the
+// executable replaces the operators and updates the counters.
+struct Counters
+{
+    std::atomic<unsigned long long> allocations;
+    std::atomic<unsigned long long> deallocations;
+    
+    inline unsigned long long live() const
+    {
+        return allocations.load(std::memory_order_relaxed) - deallocations.load(std::memory_order_relaxed);
+    }
+};
+
+// Zero initialized before any dynamic initialization, so it is safe to use
+// from operator new at any time.
+inline Counters& counters()
+{
+    static Counters instance;
+    return instance;
+}
+
+// Memory of the process that is resident, or 0 if unknown.
+inline std::size_t residentBytes()
+{
+#if defined(PLATFORM_LINUX)
+    std::ifstream statm{"/proc/self/statm"};
+    std::size_t size = 0;
+    std::size_t resident = 0;
+    if (statm >> size >> resident)
+    {
+        return resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    }
+#endif
+    return 0;
+}
+
+} // memory
+} // vf
+
+#endif // VF_MEMORY_HPP_INCLUDED
\ No newline at end of file
@@ -0,0 +1,114 @@
+#ifndef VF_MPSC_QUEUE_HPP_INCLUDED
+#define VF_MPSC_QUEUE_HPP_INCLUDED
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace vf {
+
+// A bounded, lock-free queue for any number of producers and one consumer.
+// Cells are preallocated in a ring and each carries a sequence number that
+// tells producers and the consumer whose turn it is, so neither side ever
+// blocks or allocates. A push into a full queue fails instead of waiting.
+template<typename T>
+class MpscQueue
+{
+public:
+    explicit MpscQueue(std::size_t capacity):
+        _cells{},
+        _mask{0},
+        _tail{0},
+        _head{0}
+    {
+        std::size_t size = 2;
+        while (size < capacity)
+        {
+            size *= 2;
+        }
+        _cells.reset(new Cell[size]);
+        _mask = size - 1;
+        
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            _cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    
+    MpscQueue(MpscQueue const& other) = delete;
+    MpscQueue& operator=(MpscQueue const& other) = delete;
+    
+    inline std::size_t capacity() const
+    {
+        return _mask + 1;
+    }
+    
+    // Claims a cell and fills it in place; returns false if the queue is full.
+    template<typename TFunction>
+    bool emplace(TFunction fill)
+    {
+        auto position = _tail.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            auto& cell = _cells[position & _mask];
+            auto sequence = cell.sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position);
+            if (difference == 0)
+            {
+                if (_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    fill(cell.item);
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = _tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    inline bool tryPush(T item)
+    {
+        return emplace([&item](T& cell) { cell = std::move(item); });
+    }
+    
+    // Only to be called by the single consumer.
+    bool tryPop(T& item)
+    {
+        auto& cell = _cells[_head & _mask];
+        if (cell.sequence.load(std::memory_order_acquire) != _head + 1)
+        {
+            return false;
+        }
+        
+        item = std::move(cell.item);
+        cell.sequence.store(_head + _mask + 1, std::memory_order_release);
+        ++_head;
+        return true;
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<std::size_t> sequence;
+        T item;
+    };
+    
+    std::unique_ptr<Cell[]> _cells;
+    std::size_t _mask;
+    
+    // Producers and the consumer each keep to a cache line of their own.
+    alignas(64) std::atomic<std::size_t> _tail;
+    alignas(64) std::size_t _head;
+};
+
+} // vf
+
+#endif // VF_MPSC_QUEUE_HPP_INCLUDED
\ No newline at end of file
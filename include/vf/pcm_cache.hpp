@@ -0,0 +1,167 @@
+#ifndef VF_PCM_CACHE_HPP_INCLUDED
+#define VF_PCM_CACHE_HPP_INCLUDED
+
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ext/al.hpp"
+#include "format.hpp"
+
+namespace vf {
+
+// Fully decoded audio in the format it is uploaded to OpenAL.
+struct PcmClip
+{
+    ext::al::Format format;
+    int sampleRate;
+    std::vector<uint8_t> data;
+};
+
+// Keeps decoded clips in memory under a byte budget, evicting the least
+// recently used clip first. Clips are shared, so an evicted clip stays valid
+// for as long as a reader holds on to it.
+class PcmCache
+{
+public:
+    // The variant describes the processing that produced the clip, so a
+    // change of output rate or gain does not hit stale clips.
+    struct Key
+    {
+        std::string path;
+        std::time_t modified;
+        std::string variant;
+        
+        inline bool operator==(Key const& other) const
+        {
+            return modified == other.modified && path == other.path && variant == other.variant;
+        }
+    };
+    
+    explicit PcmCache(std::size_t capacity):
+        _capacity{capacity},
+        _size{0},
+        _entries{},
+        _index{},
+        _mutex{},
+        _hits{0},
+        _misses{0},
+        _evictions{0}
+    {}
+    
+    PcmCache(PcmCache const& other) = delete;
+    PcmCache& operator=(PcmCache const& other) = delete;
+    
+    inline std::size_t capacity() const
+    {
+        return _capacity;
+    }
+    
+    inline std::size_t size() const
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        return _size;
+    }
+    
+    std::shared_ptr<PcmClip const> find(Key const& key)
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        
+        auto it = _index.find(key);
+        if (it == _index.end())
+        {
+            ++_misses;
+            return {};
+        }
+        
+        ++_hits;
+        _entries.splice(_entries.begin(), _entries, it->second);
+        return it->second->clip;
+    }
+    
+    // Returns false if the clip does not fit into the cache at all.
+    bool insert(Key const& key, std::shared_ptr<PcmClip const> clip)
+    {
+        auto bytes = clip->data.size();
+        if (bytes > _capacity)
+        {
+            return false;
+        }
+        
+        std::lock_guard<std::mutex> lock{_mutex};
+        
+        auto it = _index.find(key);
+        if (it != _index.end())
+        {
+            _size -= it->second->clip->data.size();
+            _entries.erase(it->second);
+            _index.erase(it);
+        }
+        
+        while (_size + bytes > _capacity)
+        {
+            auto& last = _entries.back();
+            _size -= last.clip->data.size();
+            _index.erase(last.key);
+            _entries.pop_back();
+            ++_evictions;
+        }
+        
+        _entries.push_front(Entry{key, std::move(clip)});
+        _index.emplace(key, _entries.begin());
+        _size += bytes;
+        
+        return true;
+    }
+
+private:
+    struct Entry
+    {
+        Key key;
+        std::shared_ptr<PcmClip const> clip;
+    };
+    
+    struct KeyHash
+    {
+        inline std::size_t operator()(Key const& key) const
+        {
+            return std::hash<std::string>()(key.path) ^ (std::hash<std::time_t>()(key.modified) << 1) ^ (std::hash<std::string>()(key.variant) << 2);
+        }
+    };
+    
+    std::size_t _capacity;
+    std::size_t _size;
+    std::list<Entry> _entries;
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> _index;
+    mutable std::mutex _mutex;
+    
+    unsigned long _hits;
+    unsigned long _misses;
+    unsigned long _evictions;
+    
+    friend std::ostream& operator<<(std::ostream& os, PcmCache const& cache)
+    {
+        std::lock_guard<std::mutex> lock{cache._mutex};
+        
+        os << vf::format(
+            "Cache: %d hits, %d misses, %d evictions, %d clips, %d/%d bytes",
+            cache._hits,
+            cache._misses,
+            cache._evictions,
+            cache._entries.size(),
+            cache._size,
+            cache._capacity
+        ) << std::endl;
+        
+        return os;
+    }
+};
+
+} // vf
+
+#endif // VF_PCM_CACHE_HPP_INCLUDED
\ No newline at end of file
@@ -0,0 +1,453 @@
+#ifndef VF_PEAKS_HPP_INCLUDED
+#define VF_PEAKS_HPP_INCLUDED
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "audio_decoder.hpp"
+#include "config.hpp"
+#include "converter.hpp"
+#include "log.hpp"
+#include "thread_pool.hpp"
+
+#if defined(SIMD_SSE2)
+
+#include <emmintrin.h>
+
+#endif
+
+namespace vf {
+namespace peaks {
+
+// Frames summarized by a bin of the finest level, and how many bins of a
+// level make up one of the next. Levels are added until one fits a screen.
+static constexpr uint32_t BinFrames = 256;
+static constexpr uint32_t Factor = 4;
+static constexpr std::size_t ScreenBins = 1024;
+
+// Decoding starts this many seconds before a chunk, so that codecs that
+// depend on earlier frames have settled by the time it begins.
+static constexpr double Preroll = 0.2;
+
+// Chunks are at least this many seconds long, so seeking does not dominate.
+static constexpr double MinimumChunk = 30.0;
+
+// The extremes and the mean square of the samples of a bin, taken over all
+// channels.
+struct Peak
+{
+    float min;
+    float max;
+    float power;
+};
+
+// A bin as stored: minimum, maximum and RMS as 16 bit fractions of full
+// scale.
+struct Bin
+{
+    int16_t min;
+    int16_t max;
+    int16_t rms;
+};
+
+static_assert(sizeof(Bin) == 6, "Wrong size!");
+
+// A peak file is a 64 byte header, a table of levels from the finest to the
+// coarsest and the bins of every level. Bin i of level l covers the frames
+// from i * BinFrames * Factor^l on.
+struct Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t sampleRate;
+    uint32_t channels;
+    uint32_t binFrames;
+    uint32_t factor;
+    uint32_t levelCount;
+    uint64_t frames;
+    uint64_t levelsOffset;
+    uint8_t reserved[16];
+};
+
+static_assert(sizeof(Header) == 64, "Wrong size!");
+
+struct Level
+{
+    uint64_t offset;
+    uint64_t count;
+};
+
+static_assert(sizeof(Level) == 16, "Wrong size!");
+
+static constexpr char const* Magic = "VFPKS\r\n\x1a";
+static constexpr uint32_t Version = 1;
+
+struct Peaks
+{
+    int sampleRate;
+    int channels;
+    uint64_t frames;
+    unsigned int chunks;
+    std::vector<std::vector<Bin>> levels;
+};
+
+// Collects interleaved frames into bins of BinFrames frames each.
+class Summary
+{
+public:
+    explicit Summary(int channels):
+        _channels{static_cast<std::size_t>(channels)},
+        _peaks{},
+        _frames{0}
+    {
+        reset();
+    }
+    
+    Summary(Summary const& other) = delete;
+    Summary& operator=(Summary const& other) = delete;
+    
+    void add(float const* samples, std::size_t frames)
+    {
+        while (frames > 0)
+        {
+            auto run = std::min(frames, BinFrames - _frames);
+            scan(samples, run * _channels);
+            samples += run * _channels;
+            frames -= run;
+            _frames += run;
+            if (_frames == BinFrames)
+            {
+                close();
+            }
+        }
+    }
+    
+    void silence(std::size_t frames)
+    {
+        while (frames > 0)
+        {
+            auto run = std::min(frames, BinFrames - _frames);
+            _min = std::min(_min, 0.0f);
+            _max = std::max(_max, 0.0f);
+            frames -= run;
+            _frames += run;
+            if (_frames == BinFrames)
+            {
+                close();
+            }
+        }
+    }
+    
+    // The bins so far, the last one possibly short.
+    std::vector<Peak> finish()
+    {
+        if (_frames > 0)
+        {
+            close();
+        }
+        return std::move(_peaks);
+    }
+
+private:
+    inline void scan(float const* samples, std::size_t count)
+    {
+        std::size_t i = 0;
+#if defined(SIMD_SSE2)
+        if (count >= 4)
+        {
+            auto min = _mm_set1_ps(_min);
+            auto max = _mm_set1_ps(_max);
+            auto energy = _mm_setzero_ps();
+            for (; i + 4 <= count; i += 4)
+            {
+                auto x = _mm_loadu_ps(samples + i);
+                min = _mm_min_ps(min, x);
+                max = _mm_max_ps(max, x);
+                energy = _mm_add_ps(energy, _mm_mul_ps(x, x));
+            }
+            
+            float lanes[4];
+            _mm_storeu_ps(lanes, min);
+            _min = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+            _mm_storeu_ps(lanes, max);
+            _max = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+            _mm_storeu_ps(lanes, energy);
+            _energy += static_cast<double>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+        }
+#endif
+        for (; i < count; ++i)
+        {
+            _min = std::min(_min, samples[i]);
+            _max = std::max(_max, samples[i]);
+            _energy += static_cast<double>(samples[i]) * samples[i];
+        }
+    }
+    
+    inline void close()
+    {
+        _peaks.push_back({_min, _max, static_cast<float>(_energy / (_frames * _channels))});
+        _frames = 0;
+        reset();
+    }
+    
+    inline void reset()
+    {
+        _min = std::numeric_limits<float>::max();
+        _max = std::numeric_limits<float>::lowest();
+        _energy = 0.0;
+    }
+    
+    std::size_t _channels;
+    std::vector<Peak> _peaks;
+    std::size_t _frames;
+    float _min;
+    float _max;
+    double _energy;
+};
+
+// The bins of the frames in [first, last) and the frame decoding stopped at.
+struct Range
+{
+    std::vector<Peak> peaks;
+    int64_t end;
+};
+
+// Decodes the frames in [first, last) on a decoder of its own. It seeks to a
+// little before the first frame and follows the timestamp of the first
+// frame decoded from there, so frames before the first are dropped and any
+// skipped by the seek are taken as silence.
+inline Range decode(std::string const& path, int64_t first, int64_t last)
+{
+    AudioDecoder decoder{path};
+    auto const& stream = decoder.audioStream();
+    auto const& codec = decoder.audioCodec();
+    auto rate = codec.sampleRate();
+    auto channels = static_cast<std::size_t>(codec.channels());
+    if (first > 0)
+    {
+        decoder.seek(stream.startTime() + std::max(0.0, static_cast<double>(first) / rate - Preroll));
+    }
+    
+    Converter converter{codec, 0, ext::swr::Quality::High};
+    Summary summary{codec.channels()};
+    av::Frame frame;
+    
+    auto anchored = first == 0;
+    int64_t position = 0;
+    int64_t next = first;
+    auto feed = [&](int count)
+    {
+        if (count <= 0)
+        {
+            return;
+        }
+        
+        auto end = position + count;
+        if (position > next)
+        {
+            auto gap = std::min(position, last) - next;
+            summary.silence(static_cast<std::size_t>(gap));
+            next += gap;
+        }
+        auto from = std::max(position, next);
+        auto to = std::min(end, last);
+        if (from < to)
+        {
+            summary.add(converter.data() + (from - position) * channels, static_cast<std::size_t>(to - from));
+            next = to;
+        }
+        position = end;
+    };
+    
+    while (next < last && decoder.readAudioFrame(frame))
+    {
+        if (!anchored)
+        {
+            if (frame.timestamp() == AV_NOPTS_VALUE)
+            {
+                throw std::runtime_error("Failed to find the position after seeking.");
+            }
+            position = std::llround((frame.timestamp() * stream.timeBase() - stream.startTime()) * rate);
+            anchored = true;
+        }
+        feed(converter.convert(frame));
+    }
+    if (next < last)
+    {
+        feed(converter.flush());
+    }
+    
+    return {summary.finish(), next};
+}
+
+// The next coarser level: extremes of extremes and the mean of the powers.
+inline std::vector<Peak> merge(std::vector<Peak> const& peaks)
+{
+    std::vector<Peak> result((peaks.size() + Factor - 1) / Factor);
+    for (std::size_t i = 0; i < result.size(); ++i)
+    {
+        auto begin = i * Factor;
+        auto end = std::min(begin + Factor, peaks.size());
+        auto& peak = result[i];
+        peak = peaks[begin];
+        for (auto j = begin + 1; j < end; ++j)
+        {
+            peak.min = std::min(peak.min, peaks[j].min);
+            peak.max = std::max(peak.max, peaks[j].max);
+            peak.power += peaks[j].power;
+        }
+        peak.power /= end - begin;
+    }
+    return result;
+}
+
+inline std::vector<Bin> quantize(std::vector<Peak> const& peaks)
+{
+    auto convert = [](float value)
+    {
+        return static_cast<int16_t>(std::lrint(std::min(1.0f, std::max(-1.0f, value)) * 32767.0f));
+    };
+    
+    std::vector<Bin> result;
+    result.reserve(peaks.size());
+    for (auto const& peak: peaks)
+    {
+        result.push_back({convert(peak.min), convert(peak.max), convert(std::sqrt(peak.power))});
+    }
+    return result;
+}
+
+// Splits a file into time ranges that are decoded in parallel, up to the
+// given number of chunks of at least MinimumChunk seconds each. Chunk
+// boundaries fall on bin boundaries, so bins are never split between
+// decoders. Files that cannot seek or do not know their duration are
+// decoded in one piece.
+inline Peaks generate(std::string const& path, ThreadPool& pool, unsigned int chunks)
+{
+    Peaks result{0, 0, 0, 1, {}};
+    double duration;
+    auto seekable = true;
+    {
+        AudioDecoder probe{path};
+        result.sampleRate = probe.audioCodec().sampleRate();
+        result.channels = probe.audioCodec().channels();
+        duration = probe.duration();
+        try
+        {
+            probe.seek(probe.audioStream().startTime() + duration / 2);
+        }
+        catch (std::runtime_error&)
+        {
+            seekable = false;
+        }
+    }
+    
+    auto total = duration > 0.0 ? std::llround(duration * result.sampleRate) : 0;
+    if (seekable && total > 0)
+    {
+        auto longest = static_cast<unsigned int>(std::max(1.0, duration / MinimumChunk));
+        result.chunks = std::max(1u, std::min(chunks, longest));
+    }
+    
+    auto count = static_cast<int64_t>(result.chunks);
+    auto chunkFrames = ((total + count - 1) / count + BinFrames - 1) / BinFrames * BinFrames;
+    std::vector<Range> ranges(result.chunks);
+    try
+    {
+        pool.parallelFor(result.chunks, [&](unsigned int i)
+        {
+            auto first = i * chunkFrames;
+            auto last = i + 1 < result.chunks ? first + chunkFrames : std::numeric_limits<int64_t>::max();
+            ranges[i] = decode(path, first, last);
+        });
+    }
+    catch (std::runtime_error& e)
+    {
+        // Without timestamps after seeking, there is no telling where a
+        // chunk starts.
+        if (result.chunks == 1)
+        {
+            throw;
+        }
+        vf::log::info("Decoding %s in one piece: %s", path, e.what());
+        result.chunks = 1;
+        ranges.assign(1, decode(path, 0, std::numeric_limits<int64_t>::max()));
+    }
+    
+    // A chunk that ended early is padded with silence if a later one still
+    // found frames.
+    std::vector<Peak> peaks;
+    for (unsigned int i = 0; i < result.chunks; ++i)
+    {
+        auto& range = ranges[i];
+        if (range.peaks.empty())
+        {
+            continue;
+        }
+        peaks.resize(static_cast<std::size_t>(i * chunkFrames / BinFrames), Peak{0.0f, 0.0f, 0.0f});
+        peaks.insert(peaks.end(), range.peaks.begin(), range.peaks.end());
+        result.frames = static_cast<uint64_t>(range.end);
+    }
+    
+    while (true)
+    {
+        result.levels.push_back(quantize(peaks));
+        if (peaks.size() <= ScreenBins)
+        {
+            break;
+        }
+        peaks = merge(peaks);
+    }
+    return result;
+}
+
+inline void write(std::string const& path, Peaks const& peaks)
+{
+    Header header{};
+    std::memcpy(header.magic, Magic, sizeof(header.magic));
+    header.version = Version;
+    header.sampleRate = static_cast<uint32_t>(peaks.sampleRate);
+    header.channels = static_cast<uint32_t>(peaks.channels);
+    header.binFrames = BinFrames;
+    header.factor = Factor;
+    header.levelCount = static_cast<uint32_t>(peaks.levels.size());
+    header.frames = peaks.frames;
+    header.levelsOffset = sizeof(Header);
+    
+    std::vector<Level> levels;
+    auto offset = header.levelsOffset + peaks.levels.size() * sizeof(Level);
+    for (auto const& bins: peaks.levels)
+    {
+        levels.push_back({offset, bins.size()});
+        offset += bins.size() * sizeof(Bin);
+    }
+    
+    auto temporary = boost::filesystem::unique_path(path + ".%%%%%%.tmp");
+    {
+        std::ofstream stream{temporary.string(), std::ios::binary | std::ios::trunc};
+        stream.write(reinterpret_cast<char const*>(&header), sizeof(header));
+        stream.write(reinterpret_cast<char const*>(levels.data()), levels.size() * sizeof(Level));
+        for (auto const& bins: peaks.levels)
+        {
+            stream.write(reinterpret_cast<char const*>(bins.data()), bins.size() * sizeof(Bin));
+        }
+        if (!stream)
+        {
+            throw std::runtime_error(vf::format("Failed to write peak file %s.", path));
+        }
+    }
+    boost::filesystem::rename(temporary, path);
+}
+
+} // peaks
+} // vf
+
+#endif // VF_PEAKS_HPP_INCLUDED
\ No newline at end of file
@@ -0,0 +1,463 @@
+#ifndef VF_PIPELINE_HPP_INCLUDED
+#define VF_PIPELINE_HPP_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "audio_decoder.hpp"
+#include "converter.hpp"
+#include "downmix.hpp"
+#include "dsp.hpp"
+#include "queue.hpp"
+#include "realtime.hpp"
+#include "stretch.hpp"
+
+namespace vf {
+
+// Runs demuxing and decoding of an AudioDecoder on two threads of their own.
+// The demuxer fills a packet queue bounded by size and duration. The decoder
+// resamples to float, changes the tempo if asked to, runs the DSP chain on
+// all channels of the source, and mixes them down to stereo while quantizing
+// into blocks of output samples. It queues them for the output stage, which
+// pulls them with read(). Full queues block the stage that feeds them. Slow
+// storage only stalls the decoder once the packet queue has run dry. With a
+// jitter buffer, the decoder waits for that many seconds of packets before it
+// starts and whenever the queue ran dry, so a network stream that arrives in
+// bursts plays without gaps.
+class Pipeline
+{
+public:
+    struct Options
+    {
+        std::size_t packetBytes;
+        double packetDuration;
+        std::size_t blocks;
+        // If positive, the output queue holds this many seconds of blocks
+        // instead of a number of them.
+        double blocksDuration;
+        int decodeCpu;
+        bool lockMemory;
+        int sampleRate;
+        ext::swr::Quality quality;
+        dsp::Chain::Settings dsp;
+        bool quantize;
+        std::size_t blockFrames;
+        double speed;
+        std::vector<downmix::Matrix> downmix;
+        double jitter;
+    };
+    
+    // The time is when the samples of the block were decoded. With memory
+    // locking, the lock travels with the storage it keeps resident.
+    struct Block
+    {
+        std::vector<uint8_t> data;
+        int sampleRate;
+        std::chrono::steady_clock::time_point time;
+        std::unique_ptr<realtime::MemoryLock> lock;
+    };
+    
+    Pipeline(AudioDecoder& decoder, Options const& options):
+        _options(options),
+        _decoder(decoder),
+        _converter{decoder.audioCodec(), options.sampleRate, options.quality},
+        _format{convert(av::SampleFormat::S16, downmix::Outputs)},
+        _mixer{downmix::select(options.downmix, decoder.audioCodec().channelLayout(), _converter.channels())},
+        _stretch{_converter.channels(), _converter.outputRate(), options.speed},
+        _chain{_converter.channels(), _converter.outputRate(), options.dsp},
+        _packets{{std::numeric_limits<std::size_t>::max(), options.packetBytes, options.packetDuration}},
+        _blocks{options.blocksDuration > 0.0 ? BoundedQueue<Block>::Limits{std::numeric_limits<std::size_t>::max(), std::numeric_limits<std::size_t>::max(), options.blocksDuration} : BoundedQueue<Block>::Items(options.blocks)},
+        // A block is only allocated when none can be reused, so at most one
+        // per queued block plus the two held by decoder and output exist.
+        _recycled{BoundedQueue<Block>::Items(options.blocksDuration > 0.0 ? std::numeric_limits<std::size_t>::max() : options.blocks + 2)},
+        _demuxError{},
+        _decodeError{},
+        _rebuffers{0},
+        _arenaLock{},
+        _relocks{0},
+        _demuxThread{},
+        _decodeThread{}
+    {
+        // The limiter flushes the frames it holds back into the same buffer.
+        _converter.reserve(static_cast<int>(_chain.latency()));
+        
+        if (_options.lockMemory)
+        {
+            lockMemory();
+        }
+        
+        _demuxThread = std::thread{[this] { demux(); }};
+        _decodeThread = std::thread{[this] { decode(); }};
+    }
+    
+    Pipeline(Pipeline const& other) = delete;
+    Pipeline& operator=(Pipeline const& other) = delete;
+    
+    ~Pipeline()
+    {
+        _packets.clear();
+        _blocks.clear();
+        _decoder.interrupt();
+        
+        _demuxThread.join();
+        _decodeThread.join();
+    }
+    
+    inline al::Format format() const
+    {
+        return _format;
+    }
+    
+    // Channels of the blocks, which are mixed down to stereo.
+    inline int channels() const
+    {
+        return downmix::Outputs;
+    }
+    
+    inline int sampleRate() const
+    {
+        return _converter.outputRate();
+    }
+    
+    // Waits for the next block; returns false at the end of the stream.
+    bool read(Block& block)
+    {
+        if (_blocks.pop(block))
+        {
+            return true;
+        }
+        
+        if (_demuxError)
+        {
+            std::rethrow_exception(_demuxError);
+        }
+        if (_decodeError)
+        {
+            std::rethrow_exception(_decodeError);
+        }
+        return false;
+    }
+    
+    // Hands a block back to the decoder to reuse its storage.
+    inline void recycle(Block block)
+    {
+        _recycled.push(std::move(block));
+    }
+    
+    // Times the decoder found the packets run out and refilled the jitter
+    // buffer before going on.
+    inline unsigned long rebuffers() const
+    {
+        return _rebuffers.load(std::memory_order_relaxed);
+    }
+    
+    // Times read() found no block ready and had to wait for the decoder.
+    inline unsigned long underruns() const
+    {
+        return _blocks.popWaits();
+    }
+
+private:
+    // Keeps the conversion buffer and a full set of preallocated blocks
+    // resident, so the decoder neither allocates nor faults in steady state.
+    // Blocks are sized for all the conversion buffer holds, at the slowest
+    // tempo. Storage that still grows past that, for a frame larger than the
+    // codec announced, moves and is locked again where it landed, which the
+    // statistics count.
+    void lockMemory()
+    {
+        lockArena();
+        
+        auto frames = _converter.arena().capacity() / (static_cast<std::size_t>(_converter.channels()) * sizeof(float));
+        if (_options.blockFrames > 0)
+        {
+            frames = std::min(frames, _options.blockFrames);
+        }
+        
+        // Slowing down makes blocks longer.
+        auto samples = static_cast<int>(static_cast<double>(frames) / std::min(1.0, _options.speed));
+        auto blockBytes = av_samples_get_buffer_size(nullptr, downmix::Outputs, samples, _options.quantize ? AV_SAMPLE_FMT_S16 : AV_SAMPLE_FMT_FLT, 1);
+        for (std::size_t i = 0; i < _options.blocks + 2; ++i)
+        {
+            Block block;
+            block.data.resize(blockBytes);
+            lock(block);
+            _recycled.push(std::move(block));
+        }
+        _relocks.store(0, std::memory_order_relaxed);
+    }
+    
+    // Locks the conversion buffer again if converting a larger frame moved
+    // it. The old lock goes first, as it may share a page with the new one.
+    inline void lockArena()
+    {
+        auto const& arena = _converter.arena();
+        if (_arenaLock && _arenaLock->data() == arena.data())
+        {
+            return;
+        }
+        
+        _arenaLock.reset();
+        _arenaLock.reset(new realtime::MemoryLock{arena.data(), arena.capacity()});
+        _relocks.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    // Locks the storage of a block if it is new or moved when it grew.
+    inline void lock(Block& block)
+    {
+        if (block.lock && block.lock->data() == block.data.data() && block.lock->size() >= block.data.capacity())
+        {
+            return;
+        }
+        
+        block.lock.reset();
+        block.lock.reset(new realtime::MemoryLock{block.data.data(), block.data.capacity()});
+        _relocks.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    void demux()
+    {
+        VF_TRACE_THREAD("demux");
+        
+        try
+        {
+            auto timeBase = _decoder.audioStream().timeBase();
+            
+            av::Packet packet;
+            while (_decoder.readPacket(packet))
+            {
+                packet.duplicate();
+                
+                auto size = static_cast<std::size_t>(packet.size());
+                auto duration = packet.duration() * timeBase;
+                if (!_packets.push(std::move(packet), size, duration))
+                {
+                    break;
+                }
+            }
+        }
+        catch (...)
+        {
+            _demuxError = std::current_exception();
+        }
+        _packets.close();
+    }
+    
+    void decode()
+    {
+        VF_TRACE_THREAD("decode");
+        
+        if (_options.decodeCpu >= 0)
+        {
+            realtime::pin(_options.decodeCpu);
+        }
+        
+        try
+        {
+            av::Frame srcFrame;
+            av::Packet packet;
+            auto running = true;
+            auto started = false;
+            while (running)
+            {
+                // The jitter buffer fills at the start and whenever the
+                // packets ran out; only the latter counts as rebuffering.
+                if (_options.jitter > 0.0 && _packets.prefill(_options.jitter) && started)
+                {
+                    _rebuffers.fetch_add(1, std::memory_order_relaxed);
+                }
+                started = true;
+                
+                if (!_packets.pop(packet))
+                {
+                    break;
+                }
+                if (_decoder.decodePacket(packet, srcFrame))
+                {
+                    running = emit(resample(&srcFrame));
+                }
+            }
+            
+            if (running && emit(resample(nullptr)) && stretched(true))
+            {
+                auto frames = _chain.flush(samples());
+                queue(samples(), frames, false);
+            }
+        }
+        catch (...)
+        {
+            _decodeError = std::current_exception();
+            _packets.clear();
+        }
+        _blocks.close();
+    }
+    
+    inline float* samples()
+    {
+        return _converter.data();
+    }
+    
+    // Converts a frame, or drains the converter without one.
+    inline int resample(av::Frame const* frame)
+    {
+        auto frames = frame ? _converter.convert(*frame) : _converter.flush();
+        if (_options.lockMemory)
+        {
+            lockArena();
+        }
+        return frames;
+    }
+    
+    // Passes converted samples on, through the time-stretch if the tempo
+    // changes.
+    bool emit(int frames)
+    {
+        if (frames <= 0)
+        {
+            return true;
+        }
+        if (!_stretch.active())
+        {
+            return queue(samples(), static_cast<std::size_t>(frames));
+        }
+        
+        _stretch.push(samples(), static_cast<std::size_t>(frames));
+        return stretched(false);
+    }
+    
+    // Passes on what the time-stretch has ready, or everything it holds at
+    // the end of the stream.
+    bool stretched(bool last)
+    {
+        if (!_stretch.active())
+        {
+            return true;
+        }
+        if (last)
+        {
+            _stretch.flush();
+        }
+        
+        auto frames = _stretch.available();
+        auto result = queue(_stretch.data(), frames);
+        _stretch.consume(frames);
+        return result;
+    }
+    
+    // Processes samples and queues them for the output stage, as one block
+    // or in blocks of blockFrames frames.
+    bool queue(float* data, std::size_t frames, bool process = true)
+    {
+        if (frames == 0)
+        {
+            return true;
+        }
+        
+        if (process)
+        {
+            _chain.process(data, frames);
+        }
+        
+        auto time = std::chrono::steady_clock::now();
+        auto total = frames;
+        auto step = _options.blockFrames > 0 ? _options.blockFrames : total;
+        for (std::size_t offset = 0; offset < total; offset += step)
+        {
+            auto channels = static_cast<std::size_t>(_converter.channels());
+            auto source = data + offset * channels;
+            auto count = std::min(step, total - offset);
+            auto samples = count * downmix::Outputs;
+            
+            Block block;
+            _recycled.tryPop(block);
+            if (_options.quantize)
+            {
+                block.data.resize(samples * sizeof(int16_t));
+                auto target = reinterpret_cast<int16_t*>(block.data.data());
+                if (_mixer.identity())
+                {
+                    dsp::quantize(source, target, samples);
+                }
+                else
+                {
+                    _mixer.process(source, count, target);
+                }
+            }
+            else
+            {
+                block.data.resize(samples * sizeof(float));
+                auto target = reinterpret_cast<float*>(block.data.data());
+                if (_mixer.identity())
+                {
+                    std::memcpy(target, source, samples * sizeof(float));
+                }
+                else
+                {
+                    _mixer.process(source, count, target);
+                }
+            }
+            if (_options.lockMemory)
+            {
+                lock(block);
+            }
+            block.sampleRate = _converter.outputRate();
+            block.time = time;
+            
+            if (!_blocks.push(std::move(block), 0, static_cast<double>(count) / _converter.outputRate()))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    Options _options;
+    AudioDecoder& _decoder;
+    Converter _converter;
+    al::Format _format;
+    downmix::Mixer _mixer;
+    dsp::TimeStretch _stretch;
+    dsp::Chain _chain;
+    
+    BoundedQueue<av::Packet> _packets;
+    BoundedQueue<Block> _blocks;
+    BoundedQueue<Block> _recycled;
+    
+    std::exception_ptr _demuxError;
+    std::exception_ptr _decodeError;
+    std::atomic<unsigned long> _rebuffers;
+    
+    std::unique_ptr<realtime::MemoryLock> _arenaLock;
+    std::atomic<unsigned long> _relocks;
+    
+    std::thread _demuxThread;
+    std::thread _decodeThread;
+    
+    friend std::ostream& operator<<(std::ostream& os, Pipeline const& pipeline)
+    {
+        os << vf::format(
+            "Pipeline: demuxer waited %d times, decoder waited %d times for packets and %d times for room, rebuffered %d times, output waited %d times, limiter reduced by up to %.1f dB, conversion buffer of %d bytes, memory locked again %d times",
+            pipeline._packets.pushWaits(),
+            pipeline._packets.popWaits(),
+            pipeline._blocks.pushWaits(),
+            pipeline._rebuffers.load(std::memory_order_relaxed),
+            pipeline._blocks.popWaits(),
+            -20.0 * std::log10(pipeline._chain.limiter().reduction()),
+            pipeline._converter.arena().capacity(),
+            pipeline._relocks.load(std::memory_order_relaxed)
+        ) << std::endl;
+        
+        return os;
+    }
+};
+
+} // vf
+
+#endif // VF_PIPELINE_HPP_INCLUDED
\ No newline at end of file
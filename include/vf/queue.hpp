@@ -0,0 +1,207 @@
+#ifndef VF_QUEUE_HPP_INCLUDED
+#define VF_QUEUE_HPP_INCLUDED
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <limits>
+#include <mutex>
+
+namespace vf {
+
+// A blocking FIFO between two pipeline stages. Besides the number of items,
+// the queue can be bounded by the total size and duration of its items.
+// A push blocks while any limit is reached, which gives the producing stage
+// backpressure; an item is always admitted into an empty queue so a single
+// oversized item cannot stall the pipeline. After close(), pushing fails and
+// popping drains the remaining items.
+template<typename T>
+class BoundedQueue
+{
+public:
+    struct Limits
+    {
+        std::size_t items;
+        std::size_t bytes;
+        double duration;
+    };
+    
+    static Limits Items(std::size_t items)
+    {
+        return {items, std::numeric_limits<std::size_t>::max(), std::numeric_limits<double>::infinity()};
+    }
+    
+    explicit BoundedQueue(Limits limits):
+        _limits(limits),
+        _items{},
+        _bytes{0},
+        _duration{0.0},
+        _closed{false},
+        _mutex{},
+        _notEmpty{},
+        _notFull{},
+        _pushWaits{0},
+        _popWaits{0}
+    {}
+    
+    BoundedQueue(BoundedQueue const& other) = delete;
+    BoundedQueue& operator=(BoundedQueue const& other) = delete;
+    
+    bool push(T item, std::size_t bytes = 0, double duration = 0.0)
+    {
+        std::unique_lock<std::mutex> lock{_mutex};
+        
+        if (!_closed && full())
+        {
+            ++_pushWaits;
+            _notFull.wait(lock, [this] { return _closed || !full(); });
+        }
+        if (_closed)
+        {
+            return false;
+        }
+        
+        _items.push_back(Item{std::move(item), bytes, duration});
+        _bytes += bytes;
+        _duration += duration;
+        
+        lock.unlock();
+        _notEmpty.notify_one();
+        return true;
+    }
+    
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock{_mutex};
+        
+        if (!_closed && _items.empty())
+        {
+            ++_popWaits;
+            _notEmpty.wait(lock, [this] { return _closed || !_items.empty(); });
+        }
+        
+        return take(item, lock);
+    }
+    
+    // If the queue is empty, waits until its items add up to the duration,
+    // or it is full or closed. Returns whether it had to wait.
+    bool prefill(double duration)
+    {
+        std::unique_lock<std::mutex> lock{_mutex};
+        if (!_items.empty() || _closed)
+        {
+            return false;
+        }
+        
+        _notEmpty.wait(lock, [this, duration] { return _closed || full() || _duration >= duration; });
+        return true;
+    }
+    
+    bool tryPop(T& item)
+    {
+        std::unique_lock<std::mutex> lock{_mutex};
+        return take(item, lock);
+    }
+    
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock{_mutex};
+            _closed = true;
+        }
+        _notEmpty.notify_all();
+        _notFull.notify_all();
+    }
+    
+    // Closes the queue and drops everything still in it.
+    void clear()
+    {
+        std::deque<Item> items;
+        {
+            std::lock_guard<std::mutex> lock{_mutex};
+            _closed = true;
+            _items.swap(items);
+            _bytes = 0;
+            _duration = 0.0;
+        }
+        _notEmpty.notify_all();
+        _notFull.notify_all();
+    }
+    
+    inline std::size_t size() const
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        return _items.size();
+    }
+    
+    // Number of times a push had to wait for room.
+    inline unsigned long pushWaits() const
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        return _pushWaits;
+    }
+    
+    // Number of times a pop had to wait for an item.
+    inline unsigned long popWaits() const
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        return _popWaits;
+    }
+
+private:
+    struct Item
+    {
+        T value;
+        std::size_t bytes;
+        double duration;
+    };
+    
+    inline bool full() const
+    {
+        return !_items.empty() && (
+            _items.size() >= _limits.items ||
+            _bytes >= _limits.bytes ||
+            _duration >= _limits.duration
+        );
+    }
+    
+    bool take(T& item, std::unique_lock<std::mutex>& lock)
+    {
+        if (_items.empty())
+        {
+            return false;
+        }
+        
+        auto& front = _items.front();
+        item = std::move(front.value);
+        _bytes -= front.bytes;
+        _duration -= front.duration;
+        _items.pop_front();
+        
+        if (_items.empty())
+        {
+            _bytes = 0;
+            _duration = 0.0;
+        }
+        
+        lock.unlock();
+        _notFull.notify_one();
+        return true;
+    }
+    
+    Limits _limits;
+    std::deque<Item> _items;
+    std::size_t _bytes;
+    double _duration;
+    bool _closed;
+    mutable std::mutex _mutex;
+    std::condition_variable _notEmpty;
+    std::condition_variable _notFull;
+    
+    unsigned long _pushWaits;
+    unsigned long _popWaits;
+};
+
+} // vf
+
+#endif // VF_QUEUE_HPP_INCLUDED
\ No newline at end of file
@@ -0,0 +1,272 @@
+#ifndef VF_REALTIME_HPP_INCLUDED
+#define VF_REALTIME_HPP_INCLUDED
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "config.hpp"
+
+#if defined(PLATFORM_LINUX)
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#endif
+
+namespace vf {
+namespace realtime {
+
+enum class Policy
+{
+    Other,
+    Fifo,
+    RoundRobin,
+};
+
+inline char const* name(Policy policy)
+{
+    switch (policy)
+    {
+        case Policy::Fifo: return "SCHED_FIFO";
+        case Policy::RoundRobin: return "SCHED_RR";
+        default: return "SCHED_OTHER";
+    }
+}
+
+inline Policy parse(std::string const& name)
+{
+    if (name == "fifo") return Policy::Fifo;
+    if (name == "rr") return Policy::RoundRobin;
+    if (name == "" || name == "other") return Policy::Other;
+    throw std::runtime_error("Unknown scheduling policy " + name);
+}
+
+// Moves the calling thread to the requested policy. If that is not permitted
+// (no CAP_SYS_NICE or RLIMIT_RTPRIO), the other real-time policy is tried
+// before the thread is left as it was. Returns the policy in effect.
+inline Policy schedule(Policy policy, int priority)
+{
+#if defined(PLATFORM_LINUX)
+    if (policy != Policy::Other)
+    {
+        Policy candidates[] = {policy, policy == Policy::Fifo ? Policy::RoundRobin : Policy::Fifo};
+        for (auto candidate: candidates)
+        {
+            auto native = candidate == Policy::Fifo ? SCHED_FIFO : SCHED_RR;
+            
+            sched_param param{};
+            param.sched_priority = std::max(sched_get_priority_min(native), std::min(priority, sched_get_priority_max(native)));
+            if (pthread_setschedparam(pthread_self(), native, &param) == 0)
+            {
+                return candidate;
+            }
+        }
+    }
+#endif
+    return Policy::Other;
+}
+
+// Pins the calling thread to a single CPU.
+inline bool pin(int cpu)
+{
+#if defined(PLATFORM_LINUX)
+    if (cpu >= 0 && cpu < CPU_SETSIZE)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+#endif
+    return false;
+}
+
+// Keeps a range of memory resident for as long as the lock exists.
+class MemoryLock
+{
+public:
+    MemoryLock(void const* data, std::size_t size):
+        _data{data},
+        _size{size},
+        _locked{false}
+    {
+#if defined(PLATFORM_LINUX)
+        _locked = _size > 0 && mlock(_data, _size) == 0;
+#endif
+    }
+    
+    MemoryLock(MemoryLock&& other):
+        _data{other._data},
+        _size{other._size},
+        _locked{other._locked}
+    {
+        other._locked = false;
+    }
+    
+    MemoryLock(MemoryLock const& other) = delete;
+    MemoryLock& operator=(MemoryLock const& other) = delete;
+    
+    ~MemoryLock()
+    {
+#if defined(PLATFORM_LINUX)
+        if (_locked)
+        {
+            munlock(_data, _size);
+        }
+#endif
+    }
+    
+    inline bool locked() const
+    {
+        return _locked;
+    }
+    
+    inline void const* data() const
+    {
+        return _data;
+    }
+    
+    inline std::size_t size() const
+    {
+        return _size;
+    }
+
+private:
+    void const* _data;
+    std::size_t _size;
+    bool _locked;
+};
+
+// Tracks how late a thread wakes up compared to when it asked to. Updated by
+// the waiting thread only, readable from any thread.
+class WakeLatency
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    
+    WakeLatency():
+        _count{0},
+        _total{0},
+        _worst{0}
+    {}
+    
+    template<typename TDuration>
+    void sleep(TDuration duration)
+    {
+        auto deadline = Clock::now() + duration;
+        std::this_thread::sleep_until(deadline);
+        
+        auto late = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - deadline).count();
+        if (late < 0)
+        {
+            late = 0;
+        }
+        
+        _count.store(_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        _total.store(_total.load(std::memory_order_relaxed) + late, std::memory_order_relaxed);
+        if (late > _worst.load(std::memory_order_relaxed))
+        {
+            _worst.store(late, std::memory_order_relaxed);
+        }
+    }
+    
+    inline long long worst() const
+    {
+        return _worst.load(std::memory_order_relaxed);
+    }
+    
+    inline double average() const
+    {
+        auto count = _count.load(std::memory_order_relaxed);
+        return count > 0 ? static_cast<double>(_total.load(std::memory_order_relaxed)) / count : 0.0;
+    }
+
+private:
+    std::atomic<unsigned long> _count;
+    std::atomic<long long> _total;
+    std::atomic<long long> _worst;
+};
+
+// Distribution of latencies in buckets 5 % apart, from 1 us to about 10 s.
+// Updated by one thread only, readable from any thread.
+class LatencyHistogram
+{
+public:
+    static constexpr std::size_t Buckets = 340;
+    
+    LatencyHistogram():
+        _counts{},
+        _total{0},
+        _worst{0.0}
+    {
+        for (auto& count: _counts)
+        {
+            count.store(0, std::memory_order_relaxed);
+        }
+    }
+    
+    void record(double seconds)
+    {
+        auto index = static_cast<std::size_t>(std::log(std::max(1.0, seconds * 1e6)) / std::log(Ratio));
+        auto& count = _counts[index < Buckets ? index : Buckets - 1];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        _total.store(_total.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (seconds > _worst.load(std::memory_order_relaxed))
+        {
+            _worst.store(seconds, std::memory_order_relaxed);
+        }
+    }
+    
+    inline unsigned long count() const
+    {
+        return _total.load(std::memory_order_relaxed);
+    }
+    
+    inline double worst() const
+    {
+        return _worst.load(std::memory_order_relaxed);
+    }
+    
+    // Upper edge in seconds of the bucket that reaches the given fraction of
+    // all samples, or 0 without samples.
+    double percentile(double fraction) const
+    {
+        auto total = count();
+        if (total == 0)
+        {
+            return 0.0;
+        }
+        
+        auto target = static_cast<unsigned long>(std::ceil(fraction * total));
+        unsigned long seen = 0;
+        for (std::size_t i = 0; i < Buckets; ++i)
+        {
+            seen += _counts[i].load(std::memory_order_relaxed);
+            if (seen >= target)
+            {
+                return std::min(worst(), std::pow(Ratio, static_cast<double>(i + 1)) * 1e-6);
+            }
+        }
+        return worst();
+    }
+
+private:
+    static constexpr double Ratio = 1.05;
+    
+    std::array<std::atomic<unsigned long>, Buckets> _counts;
+    std::atomic<unsigned long> _total;
+    std::atomic<double> _worst;
+};
+
+} // realtime
+} // vf
+
+#endif // VF_REALTIME_HPP_INCLUDED
\ No newline at end of file
@@ -0,0 +1,747 @@
+#ifndef VF_SHARED_CACHE_HPP_INCLUDED
+#define VF_SHARED_CACHE_HPP_INCLUDED
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+
+#include "config.hpp"
+#include "disk_cache.hpp"
+#include "ext/al.hpp"
+#include "format.hpp"
+
+namespace vf {
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "Shared memory needs lock-free atomics!");
+
+// Shares decoded audio between the processes of a host through POSIX shared
+// memory. A directory object holds a table of reader leases and a fixed
+// table of slots; each source is an object of its own named after its slot
+// generation, holding the samples exactly as they are uploaded. The first
+// process to decode a source claims a slot for it and writes the samples
+// straight into its object while it plays them. Later ones see the slot
+// being written and decode on their own without publishing, or map it
+// read-only instead of decoding once it is ready.
+//
+// The directory takes no locks. A slot goes from empty to writing to ready
+// by compare-and-swap, and back through evicting. A slot being written
+// records its owner process and the bytes it reserved under the budget so
+// far. Readers take a lease naming the slot and count themselves into it
+// before they map it, and give both back when they unmap it. When the
+// budget runs out, ready slots that nobody reads are evicted, least
+// recently used first; mappings outlive the removal of their object, so
+// eviction never pulls samples from under a reader. When there is nothing
+// left to evict, the leases and slots of processes that died are reclaimed.
+// The budget is set by the first process to open the directory. A new
+// object is all zeros, which is an empty directory.
+//
+// A process that dies halfway through claiming a lease or a slot may still
+// leave a little behind; reset() removes the directory with everything in
+// it.
+class SharedCache
+{
+public:
+    static constexpr std::size_t Slots = 1024;
+    static constexpr std::size_t Leases = 512;
+    static constexpr uint64_t Magic = 0x1a0a0d4d48534656; // "VFSHM\r\n\x1a"
+    static constexpr uint32_t Version = 2;
+    
+    // Writers reserve room under the budget in steps of this many bytes.
+    static constexpr std::size_t ReserveStep = 1024 * 1024;
+    
+    enum State: uint32_t
+    {
+        Empty,
+        Writing,
+        Ready,
+        Evicting,
+    };
+    
+    // The fields after the atomics are only written while the slot is
+    // being written, and only read while it is ready. While it is being
+    // written, the size is the room reserved for it.
+    struct Slot
+    {
+        std::atomic<uint32_t> state;
+        std::atomic<int32_t> readers;
+        std::atomic<uint64_t> fingerprint;
+        std::atomic<uint64_t> used;
+        uint64_t generation;
+        uint64_t size;
+        uint32_t format;
+        uint32_t sampleRate;
+        uint32_t channels;
+        std::atomic<int32_t> owner;
+        uint32_t reserved[2];
+    };
+    
+    static_assert(sizeof(Slot) == 64, "Wrong size!");
+    
+    // A reader's claim on a slot, so the count of a reader that died can be
+    // taken back. The slot is its index plus one, or zero for none.
+    struct Lease
+    {
+        std::atomic<int32_t> pid;
+        std::atomic<uint32_t> slot;
+    };
+    
+    static_assert(sizeof(Lease) == 8, "Wrong size!");
+    
+    struct Directory
+    {
+        std::atomic<uint64_t> magic;
+        std::atomic<uint32_t> version;
+        uint32_t reserved;
+        std::atomic<uint64_t> capacity;
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> clock;
+        std::atomic<uint64_t> generations;
+        uint8_t padding[16];
+        Lease leases[Leases];
+        Slot slots[Slots];
+    };
+    
+    static_assert(sizeof(Directory) == 64 + Leases * sizeof(Lease) + Slots * sizeof(Slot), "Wrong size!");
+    
+    // A published source mapped read-only into memory. The slot stays
+    // pinned for as long as the entry lives.
+    class Entry
+    {
+    public:
+        Entry(Entry const& other) = delete;
+        Entry& operator=(Entry const& other) = delete;
+        
+        ~Entry()
+        {
+            _slot.readers.fetch_sub(1);
+            release(_lease);
+        }
+        
+        inline ext::al::Format format() const
+        {
+            return static_cast<ext::al::Format>(_slot.format);
+        }
+        
+        inline int sampleRate() const
+        {
+            return static_cast<int>(_slot.sampleRate);
+        }
+        
+        inline uint8_t const* data() const
+        {
+            return static_cast<uint8_t const*>(_region.get_address());
+        }
+        
+        inline std::size_t size() const
+        {
+            return static_cast<std::size_t>(_slot.size);
+        }
+    
+    private:
+        friend class SharedCache;
+        
+        Entry(Slot& slot, Lease& lease, std::string const& name):
+            _slot(slot),
+            _lease(lease),
+            _object{boost::interprocess::open_only, name.c_str(), boost::interprocess::read_only},
+            _region{_object, boost::interprocess::read_only, 0, static_cast<std::size_t>(slot.size)}
+        {}
+        
+        Slot& _slot;
+        Lease& _lease;
+        boost::interprocess::shared_memory_object _object;
+        boost::interprocess::mapped_region _region;
+    };
+    
+    // Writes samples straight into the object of a slot claimed for them,
+    // reserving room under the budget as they grow. The object is as large
+    // as the budget from the start, which costs nothing until room in it is
+    // reserved. A writer that outgrows the budget, or goes away uncommitted, gives
+    // the slot up again.
+    class Writer
+    {
+    public:
+        Writer(Writer const& other) = delete;
+        Writer& operator=(Writer const& other) = delete;
+        
+        ~Writer()
+        {
+            if (_slot != nullptr)
+            {
+                _cache.abandon(*_slot);
+            }
+        }
+        
+        inline void write(uint8_t const* data, std::size_t size)
+        {
+            if (_slot == nullptr)
+            {
+                return;
+            }
+            
+            if (_size + size > _reserved && !grow(_size + size))
+            {
+                _cache.abandon(*_slot);
+                _slot = nullptr;
+                return;
+            }
+            std::memcpy(static_cast<uint8_t*>(_region.get_address()) + _size, data, size);
+            _size += size;
+        }
+        
+        bool commit()
+        {
+            if (_slot == nullptr || _size == 0)
+            {
+                return false;
+            }
+            
+            _cache.complete(*_slot, _size, _reserved);
+            _slot = nullptr;
+            return true;
+        }
+    
+    private:
+        friend class SharedCache;
+        
+        Writer(SharedCache& cache, Slot& slot):
+            _cache(cache),
+            _slot{&slot},
+            _object{boost::interprocess::create_only, cache.object(slot.generation).c_str(), boost::interprocess::read_write},
+            _region{},
+            _size{0},
+            _reserved{0}
+        {
+            using namespace boost::interprocess;
+            
+            _object.truncate(static_cast<offset_t>(cache.capacity()));
+            mapped_region region{_object, read_write, 0, cache.capacity()};
+            _region.swap(region);
+        }
+        
+        // Reserves enough room for the size, rounded up to a whole step,
+        // and has the file system back it, so that a full /dev/shm fails
+        // here rather than with SIGBUS on a write into the mapping. The
+        // slot records the reservation only once it is made, so a writer
+        // that dies in between leaks it rather than giving back more than
+        // it took.
+        bool grow(std::size_t size)
+        {
+            auto reserved = (size + ReserveStep - 1) / ReserveStep * ReserveStep;
+            reserved = reserved < _cache.capacity() ? reserved : _cache.capacity();
+            if (reserved < size || !_cache.reserve(reserved - _reserved))
+            {
+                return false;
+            }
+#if defined(PLATFORM_LINUX)
+            if (posix_fallocate(_object.get_mapping_handle().handle, static_cast<off_t>(_reserved), static_cast<off_t>(reserved - _reserved)) != 0)
+            {
+                _cache._directory->bytes.fetch_sub(reserved - _reserved);
+                return false;
+            }
+#endif
+            
+            _slot->size = reserved;
+            _reserved = reserved;
+            return true;
+        }
+        
+        SharedCache& _cache;
+        Slot* _slot;
+        boost::interprocess::shared_memory_object _object;
+        boost::interprocess::mapped_region _region;
+        std::size_t _size;
+        std::size_t _reserved;
+    };
+    
+    // Opens the directory of the given name, creating it if it does not
+    // exist yet. A capacity of zero disables the cache.
+    SharedCache(std::string const& name, std::size_t capacity):
+        _name{name},
+        _object{},
+        _region{},
+        _directory{nullptr},
+        _hits{0},
+        _misses{0},
+        _publications{0},
+        _concurrent{0},
+        _evictions{0},
+        _reclaims{0}
+    {
+        if (capacity == 0)
+        {
+            return;
+        }
+        
+        using namespace boost::interprocess;
+        try
+        {
+            shared_memory_object object{create_only, _name.c_str(), read_write};
+            object.truncate(sizeof(Directory));
+            _object.swap(object);
+        }
+        catch (interprocess_exception&)
+        {
+            shared_memory_object object{open_only, _name.c_str(), read_write};
+            _object.swap(object);
+            
+            // The creator may not have sized it yet.
+            offset_t size = 0;
+            for (int i = 0; i < 1000 && (!_object.get_size(size) || size < static_cast<offset_t>(sizeof(Directory))); ++i)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            if (size < static_cast<offset_t>(sizeof(Directory)))
+            {
+                throw std::runtime_error(vf::format("Shared cache %s is not a directory.", _name));
+            }
+        }
+        
+        mapped_region region{_object, read_write, 0, sizeof(Directory)};
+        _region.swap(region);
+        _directory = static_cast<Directory*>(_region.get_address());
+        
+        // Generations start at the time the directory was created, so the
+        // objects of one that was reset never clash with those of the next.
+        uint64_t magic = 0;
+        uint32_t version = 0;
+        uint64_t budget = 0;
+        uint64_t generations = 0;
+        _directory->magic.compare_exchange_strong(magic, Magic);
+        _directory->version.compare_exchange_strong(version, Version);
+        _directory->capacity.compare_exchange_strong(budget, capacity);
+        _directory->generations.compare_exchange_strong(generations, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+        if ((magic != 0 && magic != Magic) || (version != 0 && version != Version))
+        {
+            throw std::runtime_error(vf::format("Shared cache %s has an incompatible version.", _name));
+        }
+    }
+    
+    SharedCache(SharedCache const& other) = delete;
+    SharedCache& operator=(SharedCache const& other) = delete;
+    
+    // Removes the directory of the given name and the objects of all its
+    // slots, whatever state they are in. Processes that still have it open
+    // carry on with it unnamed. Returns false if there was no directory.
+    static bool reset(std::string const& name)
+    {
+        using namespace boost::interprocess;
+        try
+        {
+            shared_memory_object handle{open_only, name.c_str(), read_write};
+            offset_t size = 0;
+            if (handle.get_size(size) && size >= static_cast<offset_t>(sizeof(Directory)))
+            {
+                mapped_region region{handle, read_write, 0, sizeof(Directory)};
+                auto directory = static_cast<Directory const*>(region.get_address());
+                if (directory->magic.load() == Magic && directory->version.load() == Version)
+                {
+                    for (auto const& slot: directory->slots)
+                    {
+                        if (slot.state.load() != Empty)
+                        {
+                            shared_memory_object::remove(object(name, slot.generation).c_str());
+                        }
+                    }
+                }
+            }
+        }
+        catch (interprocess_exception&)
+        {
+        }
+        return shared_memory_object::remove(name.c_str());
+    }
+    
+    inline bool enabled() const
+    {
+        return _directory != nullptr;
+    }
+    
+    // The budget of the directory, which may differ from the one asked for.
+    inline std::size_t capacity() const
+    {
+        return enabled() ? static_cast<std::size_t>(_directory->capacity.load()) : 0;
+    }
+    
+    std::unique_ptr<Entry const> find(DiskCache::Source const& source)
+    {
+        if (!enabled())
+        {
+            return {};
+        }
+        
+        auto fingerprint = source.fingerprint();
+        Lease* lease = nullptr;
+        for (std::size_t i = 0; i < Slots; ++i)
+        {
+            auto index = (fingerprint + i) % Slots;
+            auto& slot = _directory->slots[index];
+            if (!matches(slot, fingerprint))
+            {
+                continue;
+            }
+            if (lease == nullptr && (lease = acquire()) == nullptr)
+            {
+                break;
+            }
+            
+            // Counting in first and checking again keeps an evictor from
+            // taking the slot unseen.
+            lease->slot.store(static_cast<uint32_t>(index + 1));
+            slot.readers.fetch_add(1);
+            if (!matches(slot, fingerprint))
+            {
+                slot.readers.fetch_sub(1);
+                lease->slot.store(0);
+                continue;
+            }
+            
+            try
+            {
+                std::unique_ptr<Entry> entry{new Entry{slot, *lease, object(slot.generation)}};
+                slot.used.store(_directory->clock.fetch_add(1) + 1);
+                ++_hits;
+                return std::move(entry);
+            }
+            catch (boost::interprocess::interprocess_exception&)
+            {
+                slot.readers.fetch_sub(1);
+                lease->slot.store(0);
+            }
+        }
+        
+        if (lease != nullptr)
+        {
+            release(*lease);
+        }
+        ++_misses;
+        return {};
+    }
+    
+    // Claims a slot for a source about to be decoded. Returns null if
+    // another process is writing or has published the source already.
+    std::unique_ptr<Writer> writer(DiskCache::Source const& source, ext::al::Format format, int sampleRate, int channels)
+    {
+        if (!enabled())
+        {
+            return {};
+        }
+        
+        auto slot = claim(source.fingerprint());
+        if (slot == nullptr)
+        {
+            return {};
+        }
+        slot->format = static_cast<uint32_t>(format);
+        slot->sampleRate = static_cast<uint32_t>(sampleRate);
+        slot->channels = static_cast<uint32_t>(channels);
+        
+        try
+        {
+            return std::unique_ptr<Writer>{new Writer{*this, *slot}};
+        }
+        catch (boost::interprocess::interprocess_exception&)
+        {
+            abandon(*slot);
+            return {};
+        }
+    }
+
+private:
+    inline bool matches(Slot const& slot, uint64_t fingerprint) const
+    {
+        return slot.state.load() == Ready && slot.fingerprint.load() == fingerprint;
+    }
+    
+    // Whether the slot holds the source or a live process writes it. The
+    // slot of a writer that died is given up on the way.
+    bool published(Slot& slot, uint64_t fingerprint)
+    {
+        if (slot.fingerprint.load() != fingerprint)
+        {
+            return false;
+        }
+        
+        auto state = slot.state.load();
+        if (state == Writing && !alive(slot.owner.load()))
+        {
+            if (abandon(slot))
+            {
+                ++_reclaims;
+            }
+            return false;
+        }
+        return state == Ready || state == Writing;
+    }
+    
+    inline std::string object(uint64_t generation) const
+    {
+        return object(_name, generation);
+    }
+    
+    static std::string object(std::string const& name, uint64_t generation)
+    {
+        return vf::format("%s.%016x", name, generation);
+    }
+    
+    static bool alive(int32_t pid)
+    {
+        return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+    }
+    
+    Lease* acquire()
+    {
+        auto pid = static_cast<int32_t>(getpid());
+        for (auto& lease: _directory->leases)
+        {
+            int32_t expected = 0;
+            if (lease.pid.load() == 0 && lease.pid.compare_exchange_strong(expected, pid))
+            {
+                return &lease;
+            }
+        }
+        return nullptr;
+    }
+    
+    static void release(Lease& lease)
+    {
+        lease.slot.store(0);
+        lease.pid.store(0);
+    }
+    
+    // Takes a slot that is empty as being written for the source, unless
+    // the source is found on the way. Of two processes that claim the same
+    // source at once, the one further along the probe sequence backs off.
+    Slot* claim(uint64_t fingerprint)
+    {
+        for (int attempt = 0; attempt < 2; ++attempt)
+        {
+            for (std::size_t i = 0; i < Slots; ++i)
+            {
+                auto& slot = _directory->slots[(fingerprint + i) % Slots];
+                if (published(slot, fingerprint))
+                {
+                    ++_concurrent;
+                    return nullptr;
+                }
+                
+                uint32_t expected = Empty;
+                if (!slot.state.compare_exchange_strong(expected, Writing))
+                {
+                    continue;
+                }
+                
+                slot.owner.store(static_cast<int32_t>(getpid()));
+                slot.generation = _directory->generations.fetch_add(1) + 1;
+                slot.size = 0;
+                slot.fingerprint.store(fingerprint);
+                
+                for (std::size_t j = 0; j < i; ++j)
+                {
+                    if (published(_directory->slots[(fingerprint + j) % Slots], fingerprint))
+                    {
+                        abandon(slot);
+                        ++_concurrent;
+                        return nullptr;
+                    }
+                }
+                return &slot;
+            }
+            
+            // Every slot is taken; make room for one.
+            evict();
+        }
+        return nullptr;
+    }
+    
+    // Makes a slot that was written ready, giving back the room reserved
+    // beyond its size.
+    void complete(Slot& slot, std::size_t size, std::size_t reserved)
+    {
+        _directory->bytes.fetch_sub(reserved - size);
+        slot.size = size;
+        slot.used.store(_directory->clock.fetch_add(1) + 1);
+        slot.owner.store(0);
+        slot.state.store(Ready);
+        ++_publications;
+    }
+    
+    // Gives up a slot that is being written, with its object and the room
+    // reserved for it. Returns false if it was not being written anymore.
+    bool abandon(Slot& slot)
+    {
+        uint32_t expected = Writing;
+        if (!slot.state.compare_exchange_strong(expected, Evicting))
+        {
+            return false;
+        }
+        
+        boost::interprocess::shared_memory_object::remove(object(slot.generation).c_str());
+        _directory->bytes.fetch_sub(slot.size);
+        slot.fingerprint.store(0);
+        slot.owner.store(0);
+        slot.state.store(Empty);
+        return true;
+    }
+    
+    // Adds the size to the bytes published, evicting until they fit the
+    // budget. Fails if not enough slots can be evicted.
+    bool reserve(uint64_t size)
+    {
+        auto capacity = _directory->capacity.load();
+        auto bytes = _directory->bytes.fetch_add(size) + size;
+        for (std::size_t attempt = 0; bytes > capacity && attempt < Slots; ++attempt)
+        {
+            if (!evict())
+            {
+                break;
+            }
+            bytes = _directory->bytes.load();
+        }
+        
+        if (bytes > capacity)
+        {
+            _directory->bytes.fetch_sub(size);
+            return false;
+        }
+        return true;
+    }
+    
+    // Evicts the least recently used slot that nobody reads. A slot that a
+    // reader counted itself into meanwhile is left alone. Without a
+    // candidate, reclaims what processes that died hold instead. Returns
+    // false if there was nothing to do.
+    bool evict()
+    {
+        Slot* victim = nullptr;
+        auto oldest = std::numeric_limits<uint64_t>::max();
+        for (auto& slot: _directory->slots)
+        {
+            if (slot.state.load() == Ready && slot.readers.load() == 0 && slot.used.load() < oldest)
+            {
+                victim = &slot;
+                oldest = slot.used.load();
+            }
+        }
+        if (victim == nullptr)
+        {
+            return reclaim();
+        }
+        
+        uint32_t expected = Ready;
+        if (!victim->state.compare_exchange_strong(expected, Evicting))
+        {
+            return true;
+        }
+        if (victim->readers.load() != 0)
+        {
+            victim->state.store(Ready);
+            return true;
+        }
+        
+        boost::interprocess::shared_memory_object::remove(object(victim->generation).c_str());
+        _directory->bytes.fetch_sub(victim->size);
+        victim->fingerprint.store(0);
+        victim->state.store(Empty);
+        ++_evictions;
+        return true;
+    }
+    
+    // Takes back the reader counts of leases whose process died, and gives
+    // up the slots such processes were writing. A lease is marked while it
+    // is taken back, so only one process does. Counts never drop below
+    // zero, in case a reader died before it counted itself in.
+    bool reclaim()
+    {
+        auto reclaimed = false;
+        for (auto& lease: _directory->leases)
+        {
+            auto pid = lease.pid.load();
+            if (pid <= 0 || alive(pid) || !lease.pid.compare_exchange_strong(pid, -1))
+            {
+                continue;
+            }
+            
+            auto index = lease.slot.load();
+            if (index > 0)
+            {
+                auto& readers = _directory->slots[index - 1].readers;
+                auto count = readers.load();
+                while (count > 0 && !readers.compare_exchange_weak(count, count - 1))
+                {
+                }
+            }
+            release(lease);
+            ++_reclaims;
+            reclaimed = true;
+        }
+        
+        for (auto& slot: _directory->slots)
+        {
+            if (slot.state.load() == Writing && slot.owner.load() > 0 && !alive(slot.owner.load()) && abandon(slot))
+            {
+                ++_reclaims;
+                reclaimed = true;
+            }
+        }
+        return reclaimed;
+    }
+    
+    std::string _name;
+    boost::interprocess::shared_memory_object _object;
+    boost::interprocess::mapped_region _region;
+    Directory* _directory;
+    
+    std::atomic<unsigned long> _hits;
+    std::atomic<unsigned long> _misses;
+    std::atomic<unsigned long> _publications;
+    std::atomic<unsigned long> _concurrent;
+    std::atomic<unsigned long> _evictions;
+    std::atomic<unsigned long> _reclaims;
+    
+    friend std::ostream& operator<<(std::ostream& os, SharedCache const& cache)
+    {
+        if (!cache.enabled())
+        {
+            return os;
+        }
+        
+        std::size_t entries = 0;
+        for (auto const& slot: cache._directory->slots)
+        {
+            entries += slot.state.load() == Ready ? 1 : 0;
+        }
+        os << vf::format(
+            "Shared Cache: %d hits, %d misses, %d published, %d left to another process, %d evicted, %d reclaimed from dead processes, %d entries with %.1f of %.1f MiB on the host",
+            cache._hits.load(),
+            cache._misses.load(),
+            cache._publications.load(),
+            cache._concurrent.load(),
+            cache._evictions.load(),
+            cache._reclaims.load(),
+            entries,
+            cache._directory->bytes.load() / (1024.0 * 1024.0),
+            cache._directory->capacity.load() / (1024.0 * 1024.0)
+        ) << std::endl;
+        
+        return os;
+    }
+};
+
+} // vf
+
+#endif // VF_SHARED_CACHE_HPP_INCLUDED
\ No newline at end of file
@@ -0,0 +1,240 @@
+#ifndef VF_STRETCH_HPP_INCLUDED
+#define VF_STRETCH_HPP_INCLUDED
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include "dsp.hpp"
+
+namespace vf {
+namespace dsp {
+
+// Changes the tempo of interleaved float samples without changing their
+// pitch, by waveform similarity overlap-add (WSOLA). The output is built
+// from windows of the input that overlap by half. Consecutive windows are
+// taken speed times half a window apart in the input, each shifted by up to
+// the tolerance to where it best continues the previous one, so periodic
+// waveforms line up and the overlap adds without phase cancellation. The
+// search compares a mono mix by normalized cross-correlation.
+//
+// Input is pushed in blocks of any size; output is taken like that of the
+// crossfade. Storage is reused once it has grown to the block size.
+class TimeStretch
+{
+public:
+    TimeStretch(int channels, int sampleRate, double speed, double window = 0.02, double tolerance = 0.006):
+        _channels{channels},
+        _speed{speed},
+        _hop{std::max<std::size_t>(16, static_cast<std::size_t>(window * sampleRate / 2))},
+        _tolerance{static_cast<std::size_t>(tolerance * sampleRate)},
+        _window(2 * _hop),
+        _input{},
+        _mono{},
+        _offset{0},
+        _nominal{0.0},
+        _previous{0},
+        _started{false},
+        _overlap(_hop * channels, 0.0f),
+        _output{},
+        _begin{0}
+    {
+        // A periodic Hann window, so windows half a length apart sum to one.
+        auto pi = static_cast<float>(M_PI);
+        for (std::size_t i = 0; i < _window.size(); ++i)
+        {
+            _window[i] = 0.5f - 0.5f * std::cos(2.0f * pi * i / _window.size());
+        }
+    }
+    
+    inline double speed() const
+    {
+        return _speed;
+    }
+    
+    // Whether the tempo changes at all.
+    inline bool active() const
+    {
+        return _speed != 1.0;
+    }
+    
+    void push(float const* samples, std::size_t frames)
+    {
+        _input.insert(_input.end(), samples, samples + frames * _channels);
+        for (std::size_t i = 0; i < frames; ++i)
+        {
+            auto sum = 0.0f;
+            for (int c = 0; c < _channels; ++c)
+            {
+                sum += samples[i * _channels + c];
+            }
+            _mono.push_back(sum);
+        }
+        
+        while (step())
+        {
+        }
+        discard();
+    }
+    
+    // Ends the stream: the input still held back is stretched as if
+    // followed by silence, and the last window fades out.
+    void flush()
+    {
+        auto end = _offset + _mono.size();
+        auto padding = 2 * _hop + _tolerance + static_cast<std::size_t>(std::ceil(_speed * _hop));
+        _input.resize(_input.size() + padding * _channels, 0.0f);
+        _mono.resize(_mono.size() + padding, 0.0f);
+        
+        while ((!_started || static_cast<std::size_t>(std::llround(_nominal)) < end) && step())
+        {
+        }
+        _output.insert(_output.end(), _overlap.begin(), _overlap.end());
+        
+        std::fill(_overlap.begin(), _overlap.end(), 0.0f);
+        _input.clear();
+        _mono.clear();
+        _offset = 0;
+        _nominal = 0.0;
+        _previous = 0;
+        _started = false;
+    }
+    
+    inline std::size_t available() const
+    {
+        return (_output.size() - _begin) / _channels;
+    }
+    
+    inline float* data()
+    {
+        return _output.data() + _begin;
+    }
+    
+    // Drops frames taken from the output, compacting the storage once half
+    // of it is taken.
+    void consume(std::size_t frames)
+    {
+        _begin += frames * _channels;
+        if (2 * _begin >= _output.size())
+        {
+            _output.erase(_output.begin(), _output.begin() + _begin);
+            _begin = 0;
+        }
+    }
+
+private:
+    // Adds the next window to the output if all input it may be taken from
+    // is there. Positions count frames from the start of the stream.
+    bool step()
+    {
+        auto length = _window.size();
+        auto end = _offset + _mono.size();
+        
+        std::size_t start;
+        if (!_started)
+        {
+            if (end < length)
+            {
+                return false;
+            }
+            start = 0;
+            _started = true;
+        }
+        else
+        {
+            auto center = static_cast<std::size_t>(std::llround(_nominal));
+            if (center + _tolerance + length > end)
+            {
+                return false;
+            }
+            start = search(center);
+        }
+        
+        auto const* window = &_input[(start - _offset) * _channels];
+        auto offset = _output.size();
+        _output.resize(offset + _hop * _channels);
+        auto* output = &_output[offset];
+        for (std::size_t i = 0; i < _hop; ++i)
+        {
+            for (int c = 0; c < _channels; ++c)
+            {
+                auto k = i * _channels + c;
+                output[k] = _overlap[k] + window[k] * _window[i];
+                _overlap[k] = window[_hop * _channels + k] * _window[_hop + i];
+            }
+        }
+        
+        _previous = start;
+        _nominal += _speed * _hop;
+        return true;
+    }
+    
+    // The start within the tolerance of the center whose first half best
+    // matches the half window that followed the previous one in the input.
+    std::size_t search(std::size_t center)
+    {
+        auto low = std::max(_offset, center > _tolerance ? center - _tolerance : 0);
+        auto high = center + _tolerance;
+        auto const* target = &_mono[_previous + _hop - _offset];
+        
+        auto const* candidate = &_mono[low - _offset];
+        double energy = dot(candidate, candidate, _hop);
+        
+        auto best = low;
+        auto bestScore = -std::numeric_limits<double>::max();
+        for (auto start = low; start <= high; ++start, ++candidate)
+        {
+            auto score = dot(candidate, target, _hop) / std::sqrt(std::max(energy, 1e-9));
+            if (score > bestScore)
+            {
+                bestScore = score;
+                best = start;
+            }
+            energy += static_cast<double>(candidate[_hop]) * candidate[_hop] - static_cast<double>(candidate[0]) * candidate[0];
+        }
+        return best;
+    }
+    
+    // Drops input that no later window or comparison can reach.
+    void discard()
+    {
+        if (!_started)
+        {
+            return;
+        }
+        
+        auto center = static_cast<std::size_t>(std::llround(_nominal));
+        auto keep = std::min(center > _tolerance ? center - _tolerance : 0, _previous + _hop);
+        auto frames = keep > _offset ? keep - _offset : 0;
+        if (2 * frames >= _mono.size())
+        {
+            _input.erase(_input.begin(), _input.begin() + frames * _channels);
+            _mono.erase(_mono.begin(), _mono.begin() + frames);
+            _offset += frames;
+        }
+    }
+    
+    int _channels;
+    double _speed;
+    std::size_t _hop;
+    std::size_t _tolerance;
+    std::vector<float> _window;
+    
+    std::vector<float> _input;
+    std::vector<float> _mono;
+    std::size_t _offset;
+    double _nominal;
+    std::size_t _previous;
+    bool _started;
+    
+    std::vector<float> _overlap;
+    std::vector<float> _output;
+    std::size_t _begin;
+};
+
+} // dsp
+} // vf
+
+#endif // VF_STRETCH_HPP_INCLUDED
\ No newline at end of file
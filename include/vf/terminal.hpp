@@ -0,0 +1,152 @@
+#ifndef VF_TERMINAL_HPP_INCLUDED
+#define VF_TERMINAL_HPP_INCLUDED
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <thread>
+
+#include "config.hpp"
+
+#if defined(PLATFORM_LINUX) || defined(PLATFORM_APPLE)
+
+#define TERMINAL_POSIX
+
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#endif
+
+namespace vf {
+namespace terminal {
+
+// Keys besides the characters typed.
+enum Key
+{
+    Up = 0x100,
+    Down,
+    Right,
+    Left,
+};
+
+// Reads single keys from standard input on a thread of its own, for as long
+// as it lives. The terminal is switched to unbuffered input without echo and
+// restored afterwards. Without a terminal on standard input, nothing is read.
+class Keyboard
+{
+public:
+    explicit Keyboard(std::function<void(int)> handler):
+        _handler{std::move(handler)},
+        _active{false},
+        _running{true},
+        _thread{}
+    {
+#if defined(TERMINAL_POSIX)
+        if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &_saved) != 0)
+        {
+            return;
+        }
+        
+        auto raw = _saved;
+        raw.c_lflag &= ~static_cast<tcflag_t>(ICANON | ECHO);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) != 0)
+        {
+            return;
+        }
+        
+        _active = true;
+        _thread = std::thread{[this] { run(); }};
+#endif
+    }
+    
+    Keyboard(Keyboard const& other) = delete;
+    Keyboard& operator=(Keyboard const& other) = delete;
+    
+    ~Keyboard()
+    {
+#if defined(TERMINAL_POSIX)
+        if (_active)
+        {
+            _running.store(false, std::memory_order_relaxed);
+            _thread.join();
+            tcsetattr(STDIN_FILENO, TCSANOW, &_saved);
+        }
+#endif
+    }
+    
+    inline bool active() const
+    {
+        return _active;
+    }
+
+private:
+#if defined(TERMINAL_POSIX)
+    // Waits for input in short slices so that the thread notices when it is
+    // asked to stop. Arrow keys arrive as the sequences ESC [ A to ESC [ D.
+    void run()
+    {
+        unsigned char pending[3];
+        std::size_t count = 0;
+        
+        while (_running.load(std::memory_order_relaxed))
+        {
+            pollfd descriptor{STDIN_FILENO, POLLIN, 0};
+            if (poll(&descriptor, 1, 50) <= 0)
+            {
+                // A lone escape is just that.
+                if (count > 0)
+                {
+                    _handler(pending[0]);
+                    count = 0;
+                }
+                continue;
+            }
+            
+            unsigned char byte;
+            if (read(STDIN_FILENO, &byte, 1) != 1)
+            {
+                break;
+            }
+            
+            if (count == 0 && byte != 0x1b)
+            {
+                _handler(byte);
+                continue;
+            }
+            
+            pending[count++] = byte;
+            if (count == 2 && byte != '[')
+            {
+                count = 0;
+            }
+            else if (count == 3)
+            {
+                count = 0;
+                switch (byte)
+                {
+                    case 'A': _handler(Up); break;
+                    case 'B': _handler(Down); break;
+                    case 'C': _handler(Right); break;
+                    case 'D': _handler(Left); break;
+                    default: break;
+                }
+            }
+        }
+    }
+    
+    termios _saved;
+#endif
+
+    std::function<void(int)> _handler;
+    bool _active;
+    std::atomic<bool> _running;
+    std::thread _thread;
+};
+
+} // terminal
+} // vf
+
+#endif // VF_TERMINAL_HPP_INCLUDED
\ No newline at end of file
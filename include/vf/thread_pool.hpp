@@ -0,0 +1,128 @@
+#ifndef VF_THREAD_POOL_HPP_INCLUDED
+#define VF_THREAD_POOL_HPP_INCLUDED
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace vf {
+
+class ThreadPool
+{
+public:
+    static unsigned int DefaultSize()
+    {
+        auto size = std::thread::hardware_concurrency();
+        return size > 0 ? size : 1;
+    }
+    
+    explicit ThreadPool(unsigned int size = DefaultSize()):
+        _workers{},
+        _tasks{},
+        _mutex{},
+        _condition{},
+        _stopped{false}
+    {
+        for (unsigned int i = 0; i < size; ++i)
+        {
+            _workers.emplace_back([this] { run(); });
+        }
+    }
+    
+    ThreadPool(ThreadPool const& other) = delete;
+    ThreadPool& operator=(ThreadPool const& other) = delete;
+    
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock{_mutex};
+            _stopped = true;
+        }
+        _condition.notify_all();
+        
+        for (auto& worker: _workers)
+        {
+            worker.join();
+        }
+    }
+    
+    inline unsigned int size() const
+    {
+        return static_cast<unsigned int>(_workers.size());
+    }
+    
+    template<typename TFunction>
+    std::future<typename std::result_of<TFunction()>::type> submit(TFunction function)
+    {
+        using result_type = typename std::result_of<TFunction()>::type;
+        
+        auto task = std::make_shared<std::packaged_task<result_type()>>(std::move(function));
+        auto result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock{_mutex};
+            _tasks.emplace([task] { (*task)(); });
+        }
+        _condition.notify_one();
+        
+        return result;
+    }
+    
+    // Invokes function(index) for every index in [0, count) and blocks until
+    // all calls have returned. Exceptions are rethrown on the calling thread.
+    template<typename TFunction>
+    void parallelFor(unsigned int count, TFunction function)
+    {
+        std::vector<std::future<void>> results;
+        results.reserve(count);
+        
+        for (unsigned int index = 0; index < count; ++index)
+        {
+            results.push_back(submit([&function, index] { function(index); }));
+        }
+        for (auto& result: results)
+        {
+            result.wait();
+        }
+        for (auto& result: results)
+        {
+            result.get();
+        }
+    }
+
+private:
+    void run()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock{_mutex};
+                _condition.wait(lock, [this] { return _stopped || !_tasks.empty(); });
+                
+                if (_stopped && _tasks.empty())
+                {
+                    return;
+                }
+                
+                task = std::move(_tasks.front());
+                _tasks.pop();
+            }
+            task();
+        }
+    }
+    
+    std::vector<std::thread> _workers;
+    std::queue<std::function<void()>> _tasks;
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    bool _stopped;
+};
+
+} // vf
+
+#endif // VF_THREAD_POOL_HPP_INCLUDED
\ No newline at end of file
@@ -0,0 +1,315 @@
+#ifndef VF_TRACE_HPP_INCLUDED
+#define VF_TRACE_HPP_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "format.hpp"
+
+// Tracing is compiled in with VF_TRACE and still has to be enabled at run
+// time. Until then, every traced scope costs a single branch.
+#if defined(VF_TRACE)
+
+#define VF_TRACE_CONCAT_(a, b) a##b
+#define VF_TRACE_CONCAT(a, b) VF_TRACE_CONCAT_(a, b)
+#define VF_TRACE_SCOPE(name) ::vf::trace::Scope VF_TRACE_CONCAT(traceScope, __LINE__){name}
+#define VF_TRACE_INSTANT(name) ::vf::trace::instant(name)
+#define VF_TRACE_THREAD(name) ::vf::trace::thread(name)
+
+#else
+
+#define VF_TRACE_SCOPE(name)
+#define VF_TRACE_INSTANT(name)
+#define VF_TRACE_THREAD(name)
+
+#endif
+
+namespace vf {
+namespace trace {
+
+using Clock = std::chrono::steady_clock;
+
+#if defined(VF_TRACE)
+static constexpr bool Available = true;
+#else
+static constexpr bool Available = false;
+#endif
+
+// Names are string literals, so an event is three words. An instant event
+// ends where it begins.
+struct Event
+{
+    char const* name;
+    int64_t begin;
+    int64_t end;
+};
+
+// The most recent events of one thread. Only the thread itself writes to
+// its buffer; it is read once tracing is done.
+class Buffer
+{
+public:
+    Buffer(int thread, std::size_t capacity):
+        _thread{thread},
+        _name{vf::format("thread %d", thread)},
+        _events(capacity),
+        _count{0}
+    {}
+    
+    inline void push(Event const& event)
+    {
+        _events[_count % _events.size()] = event;
+        ++_count;
+    }
+    
+    inline int thread() const
+    {
+        return _thread;
+    }
+    
+    inline std::string const& name() const
+    {
+        return _name;
+    }
+    
+    inline void name(std::string const& name)
+    {
+        _name = name;
+    }
+    
+    inline std::size_t size() const
+    {
+        return std::min(_count, _events.size());
+    }
+    
+    inline std::size_t overwritten() const
+    {
+        return _count - size();
+    }
+    
+    // Events in the order they were recorded.
+    inline Event const& operator[](std::size_t index) const
+    {
+        return _events[(_count - size() + index) % _events.size()];
+    }
+
+private:
+    int _thread;
+    std::string _name;
+    std::vector<Event> _events;
+    std::size_t _count;
+};
+
+namespace detail {
+
+struct State
+{
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+    std::vector<Buffer*> released;
+    std::size_t capacity;
+    int64_t start;
+};
+
+inline State& state()
+{
+    static State instance;
+    return instance;
+}
+
+// Constant initialized, so checking it needs no guard.
+inline std::atomic<bool>& enabled()
+{
+    static std::atomic<bool> flag{false};
+    return flag;
+}
+
+inline int64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// Threads get a buffer when they first record an event and give it back
+// when they exit. A new thread takes over a released buffer, so a player
+// that starts threads for every file keeps a bounded number of them.
+struct Handle
+{
+    Buffer* buffer;
+    
+    ~Handle()
+    {
+        if (buffer)
+        {
+            auto& s = state();
+            std::lock_guard<std::mutex> lock{s.mutex};
+            s.released.push_back(buffer);
+        }
+    }
+};
+
+inline Buffer& buffer()
+{
+    thread_local Handle handle{nullptr};
+    if (handle.buffer == nullptr)
+    {
+        auto& s = state();
+        std::lock_guard<std::mutex> lock{s.mutex};
+        if (s.released.empty())
+        {
+            s.buffers.emplace_back(new Buffer{static_cast<int>(s.buffers.size()), s.capacity});
+            handle.buffer = s.buffers.back().get();
+        }
+        else
+        {
+            handle.buffer = s.released.back();
+            s.released.pop_back();
+        }
+    }
+    return *handle.buffer;
+}
+
+} // detail
+
+inline bool enabled()
+{
+    return detail::enabled().load(std::memory_order_relaxed);
+}
+
+// Starts recording with room for the given number of events per thread.
+inline void enable(std::size_t capacity = 16384)
+{
+    auto& s = detail::state();
+    {
+        std::lock_guard<std::mutex> lock{s.mutex};
+        s.capacity = capacity;
+        s.start = detail::now();
+    }
+    detail::enabled().store(true, std::memory_order_release);
+}
+
+inline void disable()
+{
+    detail::enabled().store(false, std::memory_order_release);
+}
+
+// Names the calling thread in the timeline.
+inline void thread(std::string const& name)
+{
+    if (enabled())
+    {
+        detail::buffer().name(name);
+    }
+}
+
+inline void instant(char const* name)
+{
+    if (enabled())
+    {
+        auto time = detail::now();
+        detail::buffer().push({name, time, time});
+    }
+}
+
+// Records the time from construction to destruction as one event.
+class Scope
+{
+public:
+    explicit Scope(char const* name):
+        _name{enabled() ? name : nullptr},
+        _begin{0}
+    {
+        if (_name)
+        {
+            _begin = detail::now();
+        }
+    }
+    
+    Scope(Scope const& other) = delete;
+    Scope& operator=(Scope const& other) = delete;
+    
+    ~Scope()
+    {
+        if (_name)
+        {
+            detail::buffer().push({_name, _begin, detail::now()});
+        }
+    }
+
+private:
+    char const* _name;
+    int64_t _begin;
+};
+
+struct Summary
+{
+    std::size_t events;
+    std::size_t threads;
+    std::size_t overwritten;
+};
+
+// Stops recording and writes all events in the Chrome trace event format,
+// which chrome://tracing and Perfetto load as a timeline. The threads that
+// were traced have to be done by now.
+inline Summary dump(std::string const& path)
+{
+    disable();
+    
+    auto& s = detail::state();
+    std::lock_guard<std::mutex> lock{s.mutex};
+    
+    std::ofstream stream{path, std::ios::trunc};
+    if (!stream)
+    {
+        throw std::runtime_error(vf::format("Failed to open trace file %s.", path));
+    }
+    
+    auto microseconds = [&](int64_t time)
+    {
+        return static_cast<double>(time - s.start) / 1000.0;
+    };
+    
+    Summary summary{0, s.buffers.size(), 0};
+    auto separator = "\n";
+    stream << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    for (auto const& buffer: s.buffers)
+    {
+        stream << separator << vf::format("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", buffer->thread(), buffer->name());
+        separator = ",\n";
+        
+        for (std::size_t i = 0; i < buffer->size(); ++i)
+        {
+            auto const& event = (*buffer)[i];
+            if (event.begin == event.end)
+            {
+                stream << separator << vf::format("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}", event.name, microseconds(event.begin), buffer->thread());
+            }
+            else
+            {
+                stream << separator << vf::format("{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}", event.name, microseconds(event.begin), (event.end - event.begin) / 1000.0, buffer->thread());
+            }
+        }
+        summary.events += buffer->size();
+        summary.overwritten += buffer->overwritten();
+    }
+    stream << "\n]}\n";
+    
+    if (!stream)
+    {
+        throw std::runtime_error(vf::format("Failed to write trace file %s.", path));
+    }
+    return summary;
+}
+
+} // trace
+} // vf
+
+#endif // VF_TRACE_HPP_INCLUDED
\ No newline at end of file
@@ -2,11 +2,85 @@
 
 #define BUFFER_COUNT 4
 #define BUFFER_SIZE 20480
+#define LOW_LATENCY_BUFFER_COUNT 3
+#define LOW_LATENCY_BLOCK_FRAMES 256
+#define LOW_LATENCY_POLL_INTERVAL 200
+#define NULL_SINK_RATE 48000
+#define KEY_SEEK_STEP 5.0
+#define KEY_VOLUME_STEP 0.1f
+#define KEY_VOLUME_MAX 2.0f
+
+#if defined(VF_SOAK)
+
+// Counts allocations for the soak test. Only the play_soak target replaces
+// the operators, so the player pays nothing for them.
+void* operator new(std::size_t size)
+{
+    vf::memory::counters().allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto pointer = std::malloc(size > 0 ? size : 1))
+    {
+        return pointer;
+    }
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* pointer) noexcept
+{
+    if (pointer != nullptr)
+    {
+        vf::memory::counters().deallocations.fetch_add(1, std::memory_order_relaxed);
+        std::free(pointer);
+    }
+}
+
+#endif
 
 struct options_t
 {
-    std::string path;
+    std::vector<std::string> paths;
     float volume;
+    int repeat;
+    std::size_t cacheSize;
+    std::string cacheDirectory;
+    std::size_t sharedCacheSize;
+    std::string sharedCacheName;
+    bool sharedCacheReset;
+    std::size_t queueSize;
+    double queueDuration;
+    double jitterBuffer;
+    std::string realtime;
+    int priority;
+    int outputCpu;
+    int decodeCpu;
+    swr::Quality resampler;
+    std::string replaygain;
+    bool limit;
+    std::vector<vf::eq::Filter> equalizer;
+    std::vector<vf::downmix::Matrix> downmix;
+    double crossfade;
+    vf::dsp::Curve crossfadeCurve;
+    bool lowLatency;
+    double speed;
+    std::string sink;
+    bool interactive;
+#if defined(VF_SOAK)
+    double soak;
+    double soakThreshold;
+#endif
+    std::string benchmark;
+    bool analyze;
+    std::string loudnessCache;
+    bool allStreams;
+    bool peaks;
+    std::string library;
+    bool scan;
+    unsigned int jobs;
+    bool daemon;
+    std::string socket;
+    std::string send;
+    vf::log::Level logLevel;
+    std::string trace;
+    bool stats;
 };
 
 std::unique_ptr<options_t> process_options(int argc, char *argv[])
@@ -14,11 +88,53 @@ std::unique_ptr<options_t> process_options(int argc, char *argv[])
     po::options_description generic("Options");
     generic.add_options()
         ("volume,v", po::value<float>()->default_value(1.0f), "Set playback volume.")
+        ("repeat,r", po::value<int>()->default_value(1), "Play the files this many times.")
+        ("cache-size", po::value<std::size_t>()->default_value(0), "Keep up to this many MiB of decoded audio in memory.")
+        ("cache-dir", po::value<std::string>()->default_value(""), "Keep decoded audio in this directory across runs.")
+        ("shared-cache", po::value<std::size_t>()->default_value(0), "Share up to this many MiB of decoded audio in memory with the other processes on this host. The first process to open the cache sets its size.")
+        ("shared-cache-name", po::value<std::string>()->default_value("play-cache"), "Name of the shared memory cache.")
+        ("shared-cache-reset", "Remove the shared memory cache with everything published in it, including what crashed processes left behind, and exit.")
+        ("queue-size", po::value<std::size_t>()->default_value(1024), "Read ahead up to this many KiB of compressed audio.")
+        ("queue-duration", po::value<double>()->default_value(2.0), "Read ahead up to this many seconds of compressed audio.")
+        ("jitter-buffer", po::value<double>()->default_value(1000.0), "Buffer this many milliseconds of an http:// stream before playing it, and again whenever it runs dry.")
+        ("realtime", po::value<std::string>()->default_value(""), "Run output on a real-time policy (fifo, rr) and lock buffers in memory.")
+        ("priority", po::value<int>()->default_value(50), "Real-time priority of the output thread.")
+        ("output-cpu", po::value<int>()->default_value(-1), "Pin the output thread to this CPU.")
+        ("decode-cpu", po::value<int>()->default_value(-1), "Pin the decoding threads to this CPU.")
+        ("resampler", po::value<std::string>()->default_value("high"), "Resampler quality (fast, medium, high, best).")
+        ("replaygain", po::value<std::string>()->default_value("off"), "Apply ReplayGain from tags (off, track, album).")
+        ("limiter", po::value<bool>()->default_value(true), "Limit peaks after applying gain.")
+        ("eq", po::value<std::string>()->default_value(""), "Apply the equalizer filters in this file, one per line as \"type frequency q gain\" with type peak, lowshelf, highshelf, lowpass or highpass.")
+        ("downmix", po::value<std::string>()->default_value(""), "Mix sources down to stereo with the matrices in this file instead of the standard ones, one row per line as the number of channels followed by a gain for each, left row first.")
+        ("crossfade", po::value<double>()->default_value(0.0), "Fade each file into the next over this many seconds.")
+        ("crossfade-curve", po::value<std::string>()->default_value("power"), "Crossfade curve (linear, power, scurve).")
+        ("low-latency", "Keep as little audio queued as is safe, in small blocks, and poll the output more often.")
+        ("speed", po::value<double>()->default_value(1.0), "Play faster or slower without changing the pitch, from 0.5 to 4 times.")
+        ("sink", po::value<std::string>()->default_value("openal"), "Play to OpenAL or discard the output as fast as it is produced (openal, null).")
+        ("interactive,i", "Control playback from the keyboard: space pauses, left and right seek by 5 seconds, up and down change the volume, n skips to the next file and q quits.")
+#if defined(VF_SOAK)
+        ("soak", po::value<double>()->default_value(0.0), "Play the files through the null sink over and over for this many hours of audio, and fail if memory keeps growing.")
+        ("soak-threshold", po::value<double>()->default_value(16.0), "MiB the resident size may grow after the first soak pass.")
+#endif
+        ("benchmark", po::value<std::string>(), "Measure the cost of a processing stage (resampler, dsp, eq, downmix, stretch) and exit.")
+        ("analyze", "Measure the EBU R128 loudness of the files and exit. Directories are searched recursively.")
+        ("all-streams", "Analyze every audio stream of a file in a single pass instead of the best one.")
+        ("loudness-cache", po::value<std::string>()->default_value(""), "Keep loudness results in this file across runs.")
+        ("peaks", "Write a multi-resolution waveform of each file next to it, decoding parts of the file in parallel, and exit.")
+        ("library", po::value<std::string>()->default_value(""), "Library index file. Without paths, the whole library is played.")
+        ("scan", "Scan the directories into the library index and exit. Unchanged files are not probed again.")
+        ("jobs,j", po::value<unsigned int>()->default_value(vf::ThreadPool::DefaultSize()), "Analyze or scan this many files, or decode this many parts of a file for peaks, at once.")
+        ("daemon", "Keep running and play what is sent to the control socket.")
+        ("socket", po::value<std::string>()->default_value((fs::temp_directory_path() / "play.sock").string()), "Control socket of the daemon.")
+        ("send", po::value<std::string>(), "Send a command (play, enqueue, next, stop, pause, resume, seek, position, volume, stats, quit) with the paths or value as arguments to the daemon.")
+        ("log-level", po::value<std::string>()->default_value("warning"), "Log messages up to this level (error, warning, info, debug).")
+        ("trace", po::value<std::string>()->default_value(""), "Record the timeline of pipeline events and write it to this file in the Chrome trace format.")
+        ("stats", "Print statistics when done.")
         ("help,h", "Print help message.")
     ;
     po::options_description hidden("Hidden Options");
     hidden.add_options()
-        ("path", po::value<std::string>()->default_value("", ""), "Path to audio file.")
+        ("path", po::value<std::vector<std::string>>()->default_value({}, ""), "Paths to audio files, or arguments to the command sent.")
     ;
     
     po::options_description all("All Options");
@@ -35,275 +151,1837 @@ std::unique_ptr<options_t> process_options(int argc, char *argv[])
     
     if (vm.count("help"))
     {
-        std::cout << "Usage: play [options] [path]" << std::endl;
+        std::cout << "Usage: play [options] [path...]" << std::endl;
         std::cout << generic;
         return {};
     }
     
     auto result = std::make_unique<options_t>();
-    result->path = vm["path"].as<std::string>();
+    result->paths = vm["path"].as<std::vector<std::string>>();
     result->volume = vm["volume"].as<float>();
+    result->repeat = vm["repeat"].as<int>();
+    result->cacheSize = vm["cache-size"].as<std::size_t>() * 1024 * 1024;
+    result->cacheDirectory = vm["cache-dir"].as<std::string>();
+    result->sharedCacheSize = vm["shared-cache"].as<std::size_t>() * 1024 * 1024;
+    result->sharedCacheName = vm["shared-cache-name"].as<std::string>();
+    result->sharedCacheReset = vm.count("shared-cache-reset") > 0;
+    result->queueSize = vm["queue-size"].as<std::size_t>() * 1024;
+    result->queueDuration = vm["queue-duration"].as<double>();
+    result->jitterBuffer = vm["jitter-buffer"].as<double>() / 1000.0;
+    result->realtime = vm["realtime"].as<std::string>();
+    result->priority = vm["priority"].as<int>();
+    result->outputCpu = vm["output-cpu"].as<int>();
+    result->decodeCpu = vm["decode-cpu"].as<int>();
+    result->resampler = swr::parse(vm["resampler"].as<std::string>());
+    result->replaygain = vm["replaygain"].as<std::string>();
+    result->limit = vm["limiter"].as<bool>();
+    if (!vm["eq"].as<std::string>().empty())
+    {
+        result->equalizer = vf::eq::load(vm["eq"].as<std::string>());
+    }
+    if (!vm["downmix"].as<std::string>().empty())
+    {
+        result->downmix = vf::downmix::load(vm["downmix"].as<std::string>());
+    }
+    result->crossfade = vm["crossfade"].as<double>();
+    result->crossfadeCurve = vf::dsp::parse(vm["crossfade-curve"].as<std::string>());
+    result->lowLatency = vm.count("low-latency") > 0;
+    result->speed = vm["speed"].as<double>();
+    if (result->speed < 0.5 || result->speed > 4.0)
+    {
+        throw std::runtime_error("speed must be between 0.5 and 4");
+    }
+    result->sink = vm["sink"].as<std::string>();
+    result->interactive = vm.count("interactive") > 0;
+#if defined(VF_SOAK)
+    result->soak = vm["soak"].as<double>();
+    result->soakThreshold = vm["soak-threshold"].as<double>();
+#endif
+    result->benchmark = vm.count("benchmark") ? vm["benchmark"].as<std::string>() : "";
+    result->analyze = vm.count("analyze") > 0;
+    result->loudnessCache = vm["loudness-cache"].as<std::string>();
+    result->allStreams = vm.count("all-streams") > 0;
+    result->peaks = vm.count("peaks") > 0;
+    result->library = vm["library"].as<std::string>();
+    result->scan = vm.count("scan") > 0;
+    result->jobs = std::max(1u, vm["jobs"].as<unsigned int>());
+    result->daemon = vm.count("daemon") > 0;
+    result->socket = vm["socket"].as<std::string>();
+    result->send = vm.count("send") ? vm["send"].as<std::string>() : "";
+    result->logLevel = vf::log::parse(vm["log-level"].as<std::string>());
+    result->trace = vm["trace"].as<std::string>();
+    result->stats = vm.count("stats") > 0;
     return result;
 }
 
 namespace vf {
 
-class AudioDecoder
+// Feeds blocks of PCM to a single streaming source. Each block is uploaded to
+// the next free buffer; once all buffers are queued, writing sleeps until the
+// source has processed one. Playback starts as soon as the queue is full and
+// is restarted whenever the source ran dry, unless it was paused. The idle
+// function runs while waiting and may pause, resume or interrupt playback.
+// A null output has no device and takes blocks as fast as they come.
+//
+// For every block the output estimates when it will be heard: the audio
+// queued ahead of it, less what the source has played, plus the latency of
+// the device where AL_SOFT_source_latency reports it. Added to the time
+// since the block was decoded, that is its end-to-end latency.
+//
+// The same measurement of the source keeps a playback clock in step with
+// the device, so the position in the current stream can be read from any
+// thread without touching OpenAL.
+class Output
 {
 public:
-    AudioDecoder(std::string const& path):
-        _formatContext{av::FormatContext::Null},
-        _audioStream{},
-        _audioCodecContext{av::CodecContext::Null}
+    using Clock = std::chrono::steady_clock;
+    
+    // Blocks without a decoding time count from when they are written.
+    struct Block
     {
-        _formatContext.open(path);
-        _formatContext.maxAnalyzeDuration(1.5);
-        _formatContext.findStreamInfo();
-        
-        _audioStream = av::Stream{_formatContext.findBestStream(av::MediaType::Audio)};
-        _audioCodecContext.open(_audioStream);
+        al::Format format;
+        void const* data;
+        int size;
+        int sampleRate;
+        Clock::time_point time;
+    };
+    
+    Output(std::size_t bufferCount, int sampleRate, bool null = false, Clock::duration pollInterval = std::chrono::milliseconds(1)):
+        _sampleRate{sampleRate},
+        _buffers(null ? 0 : bufferCount),
+        _source{null ? nullptr : new al::Source{}},
+        _sourceLatency{null ? al::SourceLatency{al::SourceLatency::Null} : al::SourceLatency{}},
+        _free{},
+        _queued{},
+        _started{false},
+        _paused{false},
+        _interrupted{false},
+        _idle{},
+        _pollInterval{pollInterval},
+        _played{0.0},
+        _processed{0.0},
+        _clock{},
+        _underruns{0},
+        _wakeLatency{},
+        _deviceLatency{-1.0},
+        _latency{}
+    {
+        for (auto const& buffer: _buffers)
+        {
+            _free.push_back(buffer.id());
+        }
     }
     
-    ~AudioDecoder()
+    inline void gain(float value)
     {
-        _audioCodecContext.close();
-        
-        _formatContext.close();
+        if (_source)
+        {
+            _source->gain(value);
+        }
     }
-
-    inline av::CodecContext& audioCodec()
+    
+    // Seconds of audio written so far.
+    inline double played() const
     {
-        return _audioCodecContext;
+        return _played;
     }
     
-    inline av::CodecContext const& audioCodec() const
+    // Seconds into the stream that is playing, as far as it has been heard.
+    // Safe to call from any thread.
+    inline double position() const
     {
-        return _audioCodecContext;
+        return _clock.position();
     }
-
-    bool readAudioFrame(av::Frame& frame)
+    
+    // Makes the blocks written from now on start at the given position, in
+    // seconds, of a new stream that they play at the given speed.
+    inline void mark(double origin, double speed = 1.0)
+    {
+        _clock.mark(_played, origin, speed);
+    }
+    
+    // Rate that blocks should have to be played without resampling in
+    // OpenAL, or 0 if unknown.
+    inline int sampleRate() const
+    {
+        return _sampleRate;
+    }
+    
+    inline void idle(std::function<void()> function)
+    {
+        _idle = std::move(function);
+    }
+    
+    inline bool interrupted() const
     {
-        av::Packet packet;
-        while (true)
+        return _interrupted;
+    }
+    
+    inline bool paused() const
+    {
+        return _paused;
+    }
+    
+    // Returns false without writing if playback has been interrupted.
+    bool write(Block const& block)
+    {
+        poll();
+        
+        if (!_source)
         {
-            try
+            while (_paused && !_interrupted)
             {
-                while (true)
-                {
-                    _formatContext.readFrame(packet);
-                    if (packet.streamIndex() == _audioStream.index())
-                    {
-                        break;
-                    }
-                }
+                _wakeLatency.sleep(_pollInterval);
+                poll();
             }
-            catch (std::runtime_error&)
+            if (_interrupted)
             {
                 return false;
             }
-            
-            if(_audioCodecContext.decodeAudio(frame, packet))
+            _played += duration(block);
+            sync();
+            return true;
+        }
+        
+        ALuint buffer;
+        if (!_free.empty())
+        {
+            buffer = _free.back();
+            _free.pop_back();
+        }
+        else
+        {
+            VF_TRACE_SCOPE("wait");
+            while (!_interrupted && _source->buffersProcessed() == 0)
+            {
+                _wakeLatency.sleep(_pollInterval);
+                sync();
+                poll();
+            }
+            if (_interrupted)
             {
-                return true;
+                return false;
             }
+            buffer = _source->unqueueBuffer();
+            _processed += _queued.front();
+            _queued.pop_front();
+        }
+        
+        {
+            VF_TRACE_SCOPE("alBufferData");
+            alBufferData(buffer, static_cast<ALenum>(block.format), block.data, block.size, block.sampleRate);
         }
+        measure(block);
+        _source->queueBuffer(buffer);
+        _queued.push_back(duration(block));
+        _played += duration(block);
         
-        return false;
+        if (_free.empty() && !_paused && _source->state() != AL_PLAYING)
+        {
+            if (_started)
+            {
+                VF_TRACE_INSTANT("underrun");
+                ++_underruns;
+            }
+            _started = true;
+            _source->play();
+        }
+        sync();
+        return true;
+    }
+    
+    // Waits until everything queued so far has been played.
+    void drain()
+    {
+        if (!_source)
+        {
+            return;
+        }
+        if (!_paused && _source->buffersQueued() > 0 && _source->state() != AL_PLAYING)
+        {
+            _source->play();
+        }
+        while (!_interrupted && (_paused || _source->state() == AL_PLAYING))
+        {
+            _wakeLatency.sleep(_pollInterval);
+            sync();
+            poll();
+        }
+        sync();
+    }
+    
+    void pause()
+    {
+        _paused = true;
+        if (_source)
+        {
+            _source->pause();
+        }
+        sync();
+    }
+    
+    void resume()
+    {
+        _paused = false;
+        if (_source && _source->buffersQueued() > 0)
+        {
+            _source->play();
+        }
+        sync();
+    }
+    
+    // Stops playback at once and drops everything queued. Writing fails
+    // until reset() is called.
+    void interrupt()
+    {
+        _interrupted = true;
+        if (_source)
+        {
+            _source->stop();
+            while (_source->buffersProcessed() > 0)
+            {
+                _free.push_back(_source->unqueueBuffer());
+                _processed += _queued.front();
+                _queued.pop_front();
+            }
+        }
+        _started = false;
+        sync();
+    }
+    
+    inline void reset()
+    {
+        _interrupted = false;
     }
     
+    // Keeps the feeder loop on a real-time policy and the given CPU, and
+    // reports what was achieved.
+    void schedule(realtime::Policy policy, int priority, int cpu)
+    {
+        if (cpu >= 0 && !realtime::pin(cpu))
+        {
+            vf::log::warning("Failed to pin output thread to CPU %d.", cpu);
+        }
+        
+        auto achieved = realtime::schedule(policy, priority);
+        std::cout << vf::format("Scheduling: %s", realtime::name(achieved));
+        if (achieved != policy)
+        {
+            std::cout << vf::format(" (%s not permitted)", realtime::name(policy));
+        }
+        std::cout << std::endl;
+    }
+
 private:
-    av::FormatContext _formatContext;
-    av::Stream _audioStream;
-    av::CodecContext _audioCodecContext;
+    inline void poll()
+    {
+        if (_idle)
+        {
+            _idle();
+        }
+    }
+    
+    static inline double duration(Block const& block)
+    {
+        return static_cast<double>(block.size) / al::frameSize(block.format) / block.sampleRate;
+    }
+    
+    // How far the device has played, in seconds since the output was
+    // created. The offset of the source counts from the first buffer still
+    // queued, processed or not, and is in seconds rather than samples since
+    // buffers may differ in rate. A stopped source has played everything.
+    void sync()
+    {
+        if (!_source)
+        {
+            _clock.update(_played, _played, false);
+            return;
+        }
+        
+        auto state = _source->state();
+        if (state == AL_STOPPED)
+        {
+            _clock.update(_played, _played, false);
+            return;
+        }
+        
+        double offset = 0.0;
+        double latency = 0.0;
+        if (!_sourceLatency.query(*_source, offset, latency))
+        {
+            offset = _source->secondsOffset();
+        }
+        _clock.update(std::max(_processed, _processed + offset - latency), _played, state == AL_PLAYING);
+    }
+    
+    // Records when the block about to be queued will be heard.
+    void measure(Block const& block)
+    {
+        auto now = Clock::now();
+        
+        double offset = 0.0;
+        double latency = 0.0;
+        if (_sourceLatency.query(*_source, offset, latency))
+        {
+            _deviceLatency = latency;
+        }
+        else
+        {
+            offset = _source->secondsOffset();
+        }
+        
+        auto ahead = -offset + latency;
+        for (auto queued: _queued)
+        {
+            ahead += queued;
+        }
+        
+        auto decoded = block.time == Clock::time_point{} ? now : block.time;
+        _latency.record(std::chrono::duration<double>(now - decoded).count() + std::max(0.0, ahead));
+    }
+    
+    int _sampleRate;
+    std::vector<al::Buffer> _buffers;
+    std::unique_ptr<al::Source> _source;
+    al::SourceLatency _sourceLatency;
+    std::vector<ALuint> _free;
     
-    friend std::ostream& operator<<(std::ostream& os, AudioDecoder const& decoder)
+    // Durations of the buffers on the source, in the order they play.
+    std::deque<double> _queued;
+    
+    bool _started;
+    bool _paused;
+    bool _interrupted;
+    std::function<void()> _idle;
+    Clock::duration _pollInterval;
+    double _played;
+    
+    // Seconds of audio unqueued after playing, and the clock derived from
+    // it.
+    double _processed;
+    PlaybackClock _clock;
+    
+    unsigned long _underruns;
+    realtime::WakeLatency _wakeLatency;
+    double _deviceLatency;
+    realtime::LatencyHistogram _latency;
+    
+    friend std::ostream& operator<<(std::ostream& os, Output const& output)
     {
         os << vf::format(
-            "Audio: %s (%d, %d)",
-            decoder.audioCodec().codec().longName(),
-            decoder.audioCodec().channels(),
-            decoder.audioCodec().sampleRate()
+            "Output: %d underruns, wake latency %.1f us average, %d us worst",
+            output._underruns,
+            output._wakeLatency.average(),
+            output._wakeLatency.worst()
+        ) << std::endl;
+        
+        if (output._latency.count() > 0)
+        {
+            os << vf::format(
+                "Latency: %.1f ms p50, %.1f ms p95, %.1f ms p99, %.1f ms worst over %d blocks, device %s",
+                output._latency.percentile(0.50) * 1e3,
+                output._latency.percentile(0.95) * 1e3,
+                output._latency.percentile(0.99) * 1e3,
+                output._latency.worst() * 1e3,
+                output._latency.count(),
+                output._deviceLatency >= 0.0 ? vf::format("%.1f ms", output._deviceLatency * 1e3) : "unknown"
+            ) << std::endl;
+        }
+        
+        os << vf::format(
+            "Clock: %d corrections, %d snaps, worst error %.2f ms",
+            output._clock.corrections(),
+            output._clock.snaps(),
+            output._clock.worstError() * 1e3
         ) << std::endl;
         
         return os;
     }
 };
 
-al::Format convert(av::SampleFormat format, int channels)
+}
+
+std::size_t buffer_count(options_t const& options)
+{
+    return options.lowLatency ? LOW_LATENCY_BUFFER_COUNT : BUFFER_COUNT;
+}
+
+// Bytes of PCM in the given format to upload per output buffer.
+std::size_t buffer_size(options_t const& options, al::Format format)
+{
+    return options.lowLatency ? LOW_LATENCY_BLOCK_FRAMES * static_cast<std::size_t>(al::frameSize(format)) : BUFFER_SIZE;
+}
+
+void play(vf::Output& output, al::Format format, int sampleRate, uint8_t const* data, std::size_t size, double start, std::size_t chunk)
 {
-    switch (format)
+    auto frameBytes = static_cast<std::size_t>(al::frameSize(format));
+    auto first = std::min(size, static_cast<std::size_t>(start * sampleRate) * frameBytes);
+    for (std::size_t offset = first; offset < size; offset += chunk)
     {
-        case av::SampleFormat::U8:
-        case av::SampleFormat::U8P:
+        auto count = std::min<std::size_t>(chunk, size - offset);
+        if (!output.write({format, data + offset, static_cast<int>(count), sampleRate, {}}))
         {
-            switch (channels)
-            {
-                case 1: return al::Format::MONO8;
-                case 2: return al::Format::STEREO8;
-                default: break;
-            }
             break;
         }
-        case av::SampleFormat::S16:
-        case av::SampleFormat::S16P:
-            switch (channels)
-            {
-                case 1: return al::Format::MONO16;
-                case 2: return al::Format::STEREO16;
-                default: break;
-            }
-            break;
-        default: break;
     }
-    throw std::runtime_error("Incompatible format.");
 }
 
+// Gain from the ReplayGain tags of the source, falling back from album to
+// track gain.
+float replaygain(vf::AudioDecoder const& decoder, std::string const& mode)
+{
+    if (mode == "off")
+    {
+        return 1.0f;
+    }
+    if (mode != "track" && mode != "album")
+    {
+        throw std::runtime_error(vf::format("unknown ReplayGain mode %s", mode));
+    }
+    
+    auto value = mode == "album" ? decoder.tag("REPLAYGAIN_ALBUM_GAIN") : "";
+    if (value.empty())
+    {
+        value = decoder.tag("REPLAYGAIN_TRACK_GAIN");
+    }
+    return value.empty() ? 1.0f : vf::dsp::decibelsToGain(std::strtof(value.c_str(), nullptr));
 }
-/*
-void log_callback(void* ptr, int level, const char* fmt, va_list vl)
+
+// Describes everything besides the source that decoded output depends on.
+std::string variant(options_t const& options, vf::Output const& output)
 {
-    static int print_prefix = 0;
-    char line[1024];
-    av_log_format_line(ptr, level, fmt, vl, line, sizeof(line), &print_prefix);
-    std::cout << line << std::endl;
+    return vf::format(
+        "%d %s %g %s %d %g %s %s",
+        output.sampleRate(),
+        swr::name(options.resampler),
+        options.volume,
+        options.replaygain,
+        options.limit,
+        options.speed,
+        vf::eq::describe(options.equalizer),
+        vf::downmix::describe(options.downmix)
+    );
 }
-*/
-void reserve(int nb_samples, uint8_t** data, int* max_nb_samples)
+
+// Network streams read ahead at least twice the jitter buffer, so it can
+// fill while the decoder takes from it. With a duration, the blocks are
+// bounded by the audio they hold rather than by their number.
+vf::Pipeline::Options pipeline_options(options_t const& options, vf::AudioDecoder const& decoder, int sampleRate, std::size_t blocks, bool quantize, double duration = 0.0)
 {
-    if (*max_nb_samples < nb_samples)
-    {
-        av_freep(data);
-        
-        int linesize;
-        if (av_samples_alloc(data, &linesize, 2, nb_samples, AV_SAMPLE_FMT_S16, 1) < 0)
-        {
-            throw std::runtime_error("Failed to allocate buffer.");
-        }
-        
-        *max_nb_samples = nb_samples;
-    }
+    auto jitter = decoder.network() ? options.jitterBuffer : 0.0;
+    return {
+        options.queueSize,
+        std::max(options.queueDuration, 2.0 * jitter),
+        blocks,
+        duration,
+        options.decodeCpu,
+        !options.realtime.empty(),
+        sampleRate,
+        options.resampler,
+        {options.volume * replaygain(decoder, options.replaygain), options.limit, options.equalizer},
+        quantize,
+        options.lowLatency ? LOW_LATENCY_BLOCK_FRAMES : 0u,
+        options.speed,
+        options.downmix,
+        jitter
+    };
 }
 
-void play(options_t const& options)
+// Plays a file from the given position in seconds. Only complete playbacks
+// from the start are cached. Cached audio has the speed applied, so the
+// position within it is scaled. Network streams are never cached and cannot
+// seek, so they always play from where they are.
+void play(fs::path const& path, options_t const& options, vf::Output& output, vf::PcmCache& cache, vf::DiskCache& diskCache, vf::SharedCache& sharedCache, double start = 0.0)
 {
-    fs::path path{options.path};
-    if (!(fs::exists(path) && fs::is_regular_file(path)))
+    auto network = vf::http::isUrl(path.string());
+    if (network)
     {
-        throw std::runtime_error(vf::format("invalid path to audio file %s", path));
+        start = 0.0;
     }
-/*
-    av_log_set_level(AV_LOG_ERROR);
-    av_log_set_callback(log_callback);
-*/
-    av_register_all();
-    avcodec_register_all();
     
-    vf::AudioDecoder decoder{path.string()};
+    vf::PcmCache::Key key{path.string(), network ? 0 : fs::last_write_time(path), variant(options, output)};
+    output.mark(start, options.speed);
     
-    swr::Context ctx{decoder.audioCodec()};
-/*
-    if (decoder.audioCodec().sampleFormat() == av::SampleFormat::U8P)
+    vf::DiskCache::Source source{path.string(), 0, key.modified, key.variant};
+    if (!network)
     {
-        decoder.audioCodec().requestSampleFormat(av::SampleFormat::U8);
+        if (auto clip = cache.find(key))
+        {
+            play(output, clip->format, clip->sampleRate, clip->data.data(), clip->data.size(), start / options.speed, buffer_size(options, clip->format));
+            return;
+        }
+        
+        source = {fs::absolute(path).string(), fs::file_size(path), key.modified, key.variant};
+        
+        if (auto entry = sharedCache.find(source))
+        {
+            play(output, entry->format(), entry->sampleRate(), entry->data(), entry->size(), start / options.speed, buffer_size(options, entry->format()));
+            return;
+        }
+        
+        if (auto entry = diskCache.find(source))
+        {
+            play(output, entry->format(), entry->sampleRate(), entry->data(), entry->size(), start / options.speed, buffer_size(options, entry->format()));
+            return;
+        }
     }
-    if (decoder.audioCodec().sampleFormat() == av::SampleFormat::S16P)
+    
+    vf::AudioDecoder decoder{path.string()};
+    if (start > 0.0)
     {
-        decoder.audioCodec().requestSampleFormat(av::SampleFormat::S16);
+        decoder.seek(start);
     }
-*/
-    al::Device device;
-    al::Context context{device};
-    al::Context::MakeCurrent(context);
     
-    al::util::printErrors();
+    vf::Pipeline pipeline{decoder, pipeline_options(options, decoder, output.sampleRate(), buffer_count(options), true)};
     
-    alListener3f(AL_POSITION, 0.0f, 0.0f, 0.0f);
-    alListener3f(AL_VELOCITY, 0.0f, 0.0f, 0.0f);
-    alListenerf(AL_GAIN, options.volume);
+    auto format = pipeline.format();
     
-    std::vector<al::Buffer> buffers(BUFFER_COUNT);
-    al::Source source;
+    // Only clips that fit into the cache as a whole are collected.
+    auto clip = std::make_shared<vf::PcmClip>();
+    clip->format = format;
+    clip->sampleRate = pipeline.sampleRate();
+    auto caching = !network && cache.capacity() > 0 && start <= 0.0;
     
-    al::util::printErrors();
-/*
-    av::Packet packet;
-    int buffer_size = AVCODEC_MAX_AUDIO_FRAME_SIZE + FF_INPUT_BUFFER_PADDING_SIZE;
-    uint8_t buffer[buffer_size];
-    packet.data(buffer);
-    packet.size(buffer_size);
-*/
-    av::Frame srcFrame;
-    av::Frame dstFrame{av::SampleFormat::S16, 2, AVCODEC_MAX_AUDIO_FRAME_SIZE};
+    auto writer = !network && start <= 0.0 ? diskCache.writer(source, format, clip->sampleRate, pipeline.channels()) : nullptr;
+    auto publisher = !network && start <= 0.0 ? sharedCache.writer(source, format, clip->sampleRate, pipeline.channels()) : nullptr;
     
-    auto format = vf::convert(static_cast<av::SampleFormat>(dstFrame.format()), dstFrame.channels());
+    vf::Pipeline::Block block;
+    while (pipeline.read(block))
+    {
+        auto size = static_cast<int>(block.data.size());
+        
+        if (!output.write({format, block.data.data(), size, block.sampleRate, block.time}))
+        {
+            return;
+        }
+        
+        if (writer)
+        {
+            writer->write(block.data.data(), size);
+        }
+        
+        if (publisher)
+        {
+            publisher->write(block.data.data(), size);
+        }
+        
+        if (caching)
+        {
+            if (clip->data.size() + size > cache.capacity())
+            {
+                caching = false;
+                clip.reset();
+            }
+            else
+            {
+                clip->data.insert(clip->data.end(), block.data.begin(), block.data.end());
+            }
+        }
+        
+        pipeline.recycle(std::move(block));
+    }
     
-    //int max_nb_samples = 0;
-    //uint8_t* data[1] = {nullptr};
+    if (options.stats)
+    {
+        std::cout << pipeline;
+        if (auto stream = decoder.network())
+        {
+            std::cout << *stream;
+        }
+    }
     
-    for (auto& buffer: buffers)
+    if (writer)
     {
-        if (!decoder.readAudioFrame(srcFrame)) return;
-//*/
-        auto samples = ctx.convert(srcFrame, dstFrame); dstFrame.sampleRate(srcFrame.sampleRate());
-        auto size = av_samples_get_buffer_size(nullptr, 2, samples, AV_SAMPLE_FMT_S16, 1);
-        //std::cout << size <<std::endl;
- 
-        buffer.data(format, dstFrame.data(), size, dstFrame.sampleRate());
-/*/
-        auto size = decoder.audioCodec().getBufferSize(srcFrame.numberSamples());
-        buffer.data(format, srcFrame.data(), size, srcFrame.sampleRate());
-//*/
-        source.queueBuffer(buffer);
+        writer->commit();
     }
     
-    source.play();
+    if (publisher)
+    {
+        publisher->commit();
+    }
     
-    al::util::printErrors();
+    if (caching)
+    {
+        cache.insert(key, std::move(clip));
+    }
+}
 
-    while (true)
+// Plays the files back to back, each fading into the next. The pipeline of
+// the next file is started along with the current one. Its blocks are bounded
+// by duration, with room for the whole fade on top of what the output
+// buffers hold, whatever the size of the blocks. So both decoders run ahead
+// of the output and the fade needs no more output buffers than a hard cut.
+// Caches are bypassed since the fade works on float samples before
+// quantization.
+void play_crossfaded(std::vector<fs::path> const& paths, options_t const& options, vf::Output& output)
+{
+    struct track_t
     {
-        int num = 0;
-        while (true)
+        track_t(fs::path const& path, options_t const& options, int sampleRate, double duration):
+            decoder{path.string()},
+            pipeline{decoder, pipeline_options(options, decoder, sampleRate, buffer_count(options), false, duration)}
+        {}
+        
+        vf::AudioDecoder decoder;
+        vf::Pipeline pipeline;
+    };
+    
+    if (paths.empty())
+    {
+        return;
+    }
+    
+    // Both sides of a fade have to share the rate.
+    auto sampleRate = output.sampleRate() > 0 ? output.sampleRate() : 44100;
+    auto length = static_cast<std::size_t>(options.crossfade * sampleRate);
+    auto format = vf::convert(av::SampleFormat::S16, 2);
+    auto buffered = static_cast<double>(buffer_count(options) * buffer_size(options, format)) / al::frameSize(format) / sampleRate;
+    auto duration = options.crossfade + buffered;
+    
+    vf::dsp::Crossfade crossfade{2, length, options.crossfadeCurve};
+    std::vector<int16_t> samples;
+    
+    // Returns false once the output stops taking samples.
+    auto flush = [&](bool last) -> bool
+    {
+        auto frames = crossfade.available(last);
+        auto chunk = buffer_size(options, format) / (2 * sizeof(int16_t));
+        for (std::size_t offset = 0; offset < frames; offset += chunk)
         {
-			num = source.buffersProcessed();
-            if (num > 0) break;
-			std::this_thread::yield();
-		}
+            auto count = std::min(chunk, frames - offset);
+            samples.resize(count * 2);
+            vf::dsp::quantize(crossfade.data() + offset * 2, samples.data(), samples.size());
+            if (!output.write({format, samples.data(), static_cast<int>(samples.size() * sizeof(int16_t)), sampleRate, {}}))
+            {
+                return false;
+            }
+        }
+        crossfade.consume(frames);
+        return true;
+    };
+    
+    std::unique_ptr<track_t> next{new track_t{paths.front(), options, sampleRate, duration}};
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        auto current = std::move(next);
+        if (i + 1 < paths.size())
+        {
+            next.reset(new track_t{paths[i + 1], options, sampleRate, duration});
+        }
         
-        while (num--)
+        crossfade.next();
+        
+        vf::Pipeline::Block block;
+        auto playing = true;
+        while (playing && !output.interrupted() && current->pipeline.read(block))
         {
-            if (!decoder.readAudioFrame(srcFrame)) return;
+            crossfade.push(reinterpret_cast<float const*>(block.data.data()), block.data.size() / (2 * sizeof(float)));
+            current->pipeline.recycle(std::move(block));
+            playing = flush(false);
+        }
         
-			auto buffer = source.unqueueBuffer();
-//*/
-            auto samples = ctx.convert(srcFrame, dstFrame); dstFrame.sampleRate(srcFrame.sampleRate());
-            auto size = av_samples_get_buffer_size(nullptr, 2, samples, AV_SAMPLE_FMT_S16, 1);
-            //std::cout << size << std::endl;
-            
-            alBufferData(buffer, static_cast<ALenum>(format), dstFrame.data(), size, dstFrame.sampleRate());
-/*/
-            auto size = decoder.audioCodec().getBufferSize(srcFrame.numberSamples());
-            alBufferData(buffer, static_cast<ALenum>(format), srcFrame.data(), size, srcFrame.sampleRate());
-//*/
-            
-            
-            source.queueBuffer(buffer);
+        crossfade.end();
+        
+        if (options.stats)
+        {
+            std::cout << current->pipeline;
         }
         
-        if (source.state() != AL_PLAYING)
+        if (!playing || output.interrupted())
         {
-            source.play();
+            return;
         }
     }
+    flush(true);
 }
 
-int main(int argc, char *argv[])
+// Opens the device and sets up the output and caches for the function, then
+// waits for the output to finish.
+template<typename TFunction>
+void with_output(options_t const& options, TFunction function)
 {
-    try
+    av_register_all();
+    avcodec_register_all();
+    
+    auto null = options.sink == "null";
+    if (!null && options.sink != "openal")
     {
-        if(auto options = process_options(argc, argv))
-        {
-            play(*options);
+        throw std::runtime_error(vf::format("unknown sink %s", options.sink));
+    }
+    
+    std::unique_ptr<al::Device> device;
+    std::unique_ptr<al::Context> context;
+    if (!null)
+    {
+        device.reset(new al::Device{});
+        context.reset(new al::Context{*device});
+        al::Context::MakeCurrent(*context);
+        
+        al::util::printErrors();
+        
+        alListener3f(AL_POSITION, 0.0f, 0.0f, 0.0f);
+        alListener3f(AL_VELOCITY, 0.0f, 0.0f, 0.0f);
+        alListenerf(AL_GAIN, 1.0f);
+    }
+    
+    auto pollInterval = options.lowLatency ? vf::Output::Clock::duration{std::chrono::microseconds(LOW_LATENCY_POLL_INTERVAL)} : vf::Output::Clock::duration{std::chrono::milliseconds(1)};
+    vf::Output output{buffer_count(options), null ? NULL_SINK_RATE : device->frequency(), null, pollInterval};
+    
+    if (!options.realtime.empty() || options.outputCpu >= 0)
+    {
+        output.schedule(vf::realtime::parse(options.realtime), options.priority, options.outputCpu);
+    }
+    vf::PcmCache cache{options.cacheSize};
+    vf::DiskCache diskCache{options.cacheDirectory};
+    vf::SharedCache sharedCache{options.sharedCacheName, options.sharedCacheSize};
+    
+    al::util::printErrors();
+    
+    VF_TRACE_THREAD("output");
+    function(output, cache, diskCache, sharedCache);
+    
+    output.drain();
+    
+    al::util::printErrors();
+    
+    if (options.stats)
+    {
+        std::cout << output;
+        std::cout << cache;
+        std::cout << diskCache;
+        std::cout << sharedCache;
+    }
+}
+
+// The files and http:// streams given, or all readable files of the library
+// if none are.
+std::vector<fs::path> playlist(options_t const& options)
+{
+    std::vector<fs::path> paths;
+    for (auto const& option: options.paths)
+    {
+        fs::path path{option};
+        if (!vf::http::isUrl(option) && !(fs::exists(path) && fs::is_regular_file(path)))
+        {
+            throw std::runtime_error(vf::format("invalid path to audio file %s", path));
+        }
+        paths.push_back(path);
+    }
+    if (paths.empty() && !options.library.empty())
+    {
+        vf::Library library{options.library};
+        for (std::size_t i = 0; i < library.size(); ++i)
+        {
+            auto const& record = library.record(i);
+            if ((record.flags & vf::Library::Unreadable) == 0)
+            {
+                paths.emplace_back(library.string(record.path));
+            }
+        }
+    }
+    return paths;
+}
+
+// Turns a key into an action for the output thread.
+void post_key(vf::control::Actions& actions, int key)
+{
+    using Type = vf::control::Action::Type;
+    switch (key)
+    {
+        case ' ': actions.post(Type::Pause); break;
+        case vf::terminal::Left: actions.post(Type::Seek, -KEY_SEEK_STEP); break;
+        case vf::terminal::Right: actions.post(Type::Seek, KEY_SEEK_STEP); break;
+        case vf::terminal::Up: actions.post(Type::Volume, KEY_VOLUME_STEP); break;
+        case vf::terminal::Down: actions.post(Type::Volume, -KEY_VOLUME_STEP); break;
+        case 'n': actions.post(Type::Next); break;
+        case 'q': actions.post(Type::Quit); break;
+        default: break;
+    }
+}
+
+// With keyboard control, keys are read on a thread of their own and applied
+// by the output thread whenever it writes or waits, the same way the daemon
+// applies commands. Seeking restarts the file from the new position, which
+// crossfaded playback does not support.
+void play(options_t const& options)
+{
+    auto paths = playlist(options);
+    
+    with_output(options, [&](vf::Output& output, vf::PcmCache& cache, vf::DiskCache& diskCache, vf::SharedCache& sharedCache)
+    {
+        auto crossfading = options.crossfade > 0.0;
+        auto seek = -1.0;
+        auto quit = false;
+        auto gain = 1.0f;
+        
+        vf::control::Actions actions;
+        std::unique_ptr<vf::terminal::Keyboard> keyboard;
+        if (options.interactive)
+        {
+            keyboard.reset(new vf::terminal::Keyboard{[&actions](int key) { post_key(actions, key); }});
+            if (!keyboard->active())
+            {
+                vf::log::warning("Standard input is not a terminal, keys are ignored.");
+            }
+            
+            output.idle([&]
+            {
+                using Type = vf::control::Action::Type;
+                actions.apply([&](vf::control::Action const& action)
+                {
+                    switch (action.type)
+                    {
+                        case Type::Pause:
+                            if (output.paused())
+                            {
+                                output.resume();
+                            }
+                            else
+                            {
+                                output.pause();
+                            }
+                            break;
+                        case Type::Seek:
+                            if (!crossfading)
+                            {
+                                seek = std::max(0.0, output.position() + action.value);
+                                output.interrupt();
+                            }
+                            break;
+                        case Type::Volume:
+                            gain = std::max(0.0f, std::min(KEY_VOLUME_MAX, gain + static_cast<float>(action.value)));
+                            output.gain(gain);
+                            break;
+                        case Type::Next:
+                            if (!crossfading)
+                            {
+                                output.interrupt();
+                            }
+                            break;
+                        case Type::Quit:
+                            quit = true;
+                            output.interrupt();
+                            break;
+                    }
+                });
+            });
+        }
+        
+        if (crossfading)
+        {
+            std::vector<fs::path> playlist;
+            for (int i = 0; i < options.repeat; ++i)
+            {
+                playlist.insert(playlist.end(), paths.begin(), paths.end());
+            }
+            play_crossfaded(playlist, options, output);
+        }
+        else
+        {
+            for (int i = 0; i < options.repeat && !quit; ++i)
+            {
+                for (std::size_t j = 0; j < paths.size() && !quit; ++j)
+                {
+                    for (auto start = 0.0; start >= 0.0 && !quit; start = seek)
+                    {
+                        seek = -1.0;
+                        output.reset();
+                        play(paths[j], options, output, cache, diskCache, sharedCache, start);
+                    }
+                }
+            }
+        }
+        
+        // Keys stay live until the last block has been heard.
+        if (keyboard)
+        {
+            output.drain();
+            output.idle(nullptr);
+            
+            if (options.stats)
+            {
+                std::cout << actions;
+            }
+        }
+    });
+}
+
+#if defined(VF_SOAK)
+
+// Plays the files through the null sink over and over until the given hours
+// of audio have been played, sampling memory after every pass. Everything
+// allocated on the first pass, caches and pools included, is the baseline;
+// growth beyond the threshold after that fails the run.
+void soak(options_t const& options)
+{
+    auto paths = playlist(options);
+    if (paths.empty())
+    {
+        throw std::runtime_error("nothing to soak");
+    }
+    
+    auto nullOptions = options;
+    nullOptions.sink = "null";
+    
+    with_output(nullOptions, [&](vf::Output& output, vf::PcmCache& cache, vf::DiskCache& diskCache, vf::SharedCache& sharedCache)
+    {
+        auto const& counters = vf::memory::counters();
+        auto start = std::chrono::steady_clock::now();
+        std::size_t baseline = 0;
+        std::size_t resident = 0;
+        
+        for (int pass = 1; output.played() < options.soak * 3600.0; ++pass)
+        {
+            auto played = output.played();
+            for (auto const& path: paths)
+            {
+                play(path, nullOptions, output, cache, diskCache, sharedCache);
+            }
+            if (output.played() <= played)
+            {
+                throw std::runtime_error("soak pass played nothing");
+            }
+            
+            resident = vf::memory::residentBytes();
+            if (pass == 1)
+            {
+                baseline = resident;
+            }
+            
+            std::cout << vf::format(
+                "Soak: pass %d, %.2f h of audio in %.1f s, %.1f MiB resident, %d allocations, %d live",
+                pass,
+                output.played() / 3600.0,
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+                resident / 1048576.0,
+                counters.allocations.load(std::memory_order_relaxed),
+                counters.live()
+            ) << std::endl;
+        }
+        
+        auto growth = (static_cast<double>(resident) - static_cast<double>(baseline)) / 1048576.0;
+        if (growth > options.soakThreshold)
+        {
+            throw std::runtime_error(vf::format("resident memory grew by %.1f MiB after the first pass", growth));
+        }
+    });
+}
+
+#endif
+
+// What the daemon plays, changed by commands.
+struct session_t
+{
+    std::deque<fs::path> queue;
+    bool playing;
+    double seek;
+    bool quit;
+};
+
+// Applies a command on the playback thread and returns the reply.
+std::string apply(vf::control::Command const& command, session_t& session, vf::Output& output, std::function<void(std::ostream&)> const& stats)
+{
+    auto const& name = command.name;
+    
+    if (name == "play" || name == "enqueue")
+    {
+        fs::path path{command.argument};
+        if (!fs::is_regular_file(path))
+        {
+            return vf::format("error invalid path to audio file %s", path);
+        }
+        if (name == "play")
+        {
+            session.queue.clear();
+            output.interrupt();
+            output.resume();
+        }
+        session.queue.push_back(path);
+    }
+    else if (name == "next")
+    {
+        output.interrupt();
+    }
+    else if (name == "stop")
+    {
+        session.queue.clear();
+        output.interrupt();
+    }
+    else if (name == "pause")
+    {
+        output.pause();
+    }
+    else if (name == "resume")
+    {
+        output.resume();
+    }
+    else if (name == "seek")
+    {
+        if (!session.playing)
+        {
+            return "error nothing to seek in";
+        }
+        // Signed values seek relative to the position being heard.
+        auto value = std::stod(command.argument);
+        auto relative = !command.argument.empty() && (command.argument[0] == '+' || command.argument[0] == '-');
+        session.seek = std::max(0.0, relative ? output.position() + value : value);
+        output.interrupt();
+    }
+    else if (name == "position")
+    {
+        if (!session.playing)
+        {
+            return "error nothing playing";
+        }
+        return vf::format("ok %.3f", output.position());
+    }
+    else if (name == "volume")
+    {
+        output.gain(std::stof(command.argument));
+    }
+    else if (name == "stats")
+    {
+        std::ostringstream stream;
+        stats(stream);
+        auto text = stream.str();
+        std::replace(text.begin(), text.end(), '\n', ';');
+        return "ok " + text;
+    }
+    else if (name == "quit")
+    {
+        session.quit = true;
+        session.queue.clear();
+        output.interrupt();
+    }
+    else
+    {
+        return vf::format("error unknown command %s", name);
+    }
+    return "ok";
+}
+
+// Keeps the device open and plays what it is told over the control socket.
+// Commands are applied on the playback thread between blocks and while it
+// waits for a free buffer, so they take effect within about a millisecond.
+void serve(options_t const& options)
+{
+    vf::control::CommandQueue commands{vf::control::CommandQueue::Items(64)};
+    vf::control::Server server{options.socket, commands};
+    
+    std::cout << vf::format("Listening on %s", options.socket) << std::endl;
+    
+    with_output(options, [&](vf::Output& output, vf::PcmCache& cache, vf::DiskCache& diskCache, vf::SharedCache& sharedCache)
+    {
+        session_t session{{}, false, -1.0, false};
+        
+        auto stats = [&](std::ostream& os)
+        {
+            os << output << cache << diskCache << sharedCache << server;
+        };
+        auto handle = [&](std::shared_ptr<vf::control::Command> const& command)
+        {
+            try
+            {
+                command->reply.set_value(apply(*command, session, output, stats));
+            }
+            catch (std::exception& e)
+            {
+                command->reply.set_value(vf::format("error %s", e.what()));
+            }
+        };
+        
+        output.idle([&]
+        {
+            std::shared_ptr<vf::control::Command> command;
+            while (commands.tryPop(command))
+            {
+                handle(command);
+            }
+        });
+        
+        std::shared_ptr<vf::control::Command> command;
+        while (!session.quit)
+        {
+            if (session.queue.empty())
+            {
+                if (commands.pop(command))
+                {
+                    handle(command);
+                }
+                continue;
+            }
+            
+            auto path = session.queue.front();
+            session.queue.pop_front();
+            
+            // A seek restarts the file from the new position.
+            session.playing = true;
+            for (auto start = 0.0; start >= 0.0 && !session.quit; start = session.seek)
+            {
+                session.seek = -1.0;
+                output.reset();
+                try
+                {
+                    play(path, options, output, cache, diskCache, sharedCache, start);
+                }
+                catch (std::exception& e)
+                {
+                    vf::log::error("Failed to play %s: %s.", path.string(), e.what());
+                }
+            }
+            session.playing = false;
+        }
+        
+        output.idle(nullptr);
+        
+        commands.close();
+        while (commands.pop(command))
+        {
+            command->reply.set_value("error shutting down");
+        }
+    });
+    
+    if (options.stats)
+    {
+        std::cout << server;
+    }
+}
+
+// Sends the command to the daemon, once per argument. Several files given
+// to play are played in turn.
+void send(options_t const& options)
+{
+    std::vector<std::string> arguments{options.paths};
+    if (arguments.empty())
+    {
+        arguments.push_back("");
+    }
+    
+    for (std::size_t i = 0; i < arguments.size(); ++i)
+    {
+        auto const& argument = arguments[i];
+        
+        auto line = options.send == "play" && i > 0 ? std::string{"enqueue"} : options.send;
+        if (!argument.empty())
+        {
+            // The daemon resolves paths against its own working directory.
+            line += " " + (fs::exists(argument) ? fs::absolute(argument).string() : argument);
+        }
+        
+        auto start = vf::control::Clock::now();
+        auto reply = vf::control::send(options.socket, line);
+        auto elapsed = std::chrono::duration<double, std::milli>(vf::control::Clock::now() - start).count();
+        
+        if (reply.compare(0, 5, "error") == 0)
+        {
+            throw std::runtime_error(reply.substr(reply.find(' ') + 1));
+        }
+        
+        std::cout << reply;
+        if (options.stats)
+        {
+            std::cout << vf::format(" (%.2f ms)", elapsed);
+        }
+        std::cout << std::endl;
+    }
+}
+
+vf::loudness::Result measure_loudness(fs::path const& path)
+{
+    vf::AudioDecoder decoder{path.string()};
+    auto const& codec = decoder.audioCodec();
+    
+    vf::Converter converter{codec, 0, swr::Quality::High};
+    av::Frame srcFrame;
+    vf::loudness::Meter meter{codec.channels(), codec.sampleRate()};
+    
+    auto process = [&](int count)
+    {
+        if (count > 0)
+        {
+            meter.process(converter.data(), static_cast<std::size_t>(count));
+        }
+    };
+    
+    while (decoder.readAudioFrame(srcFrame))
+    {
+        process(converter.convert(srcFrame));
+    }
+    process(converter.flush());
+    
+    return meter.result();
+}
+
+// Measures every audio stream of the file in a single pass, each stream
+// decoded on a thread of its own. Nothing is decoded if all streams are in
+// the cache.
+std::vector<std::pair<int, vf::loudness::Result>> measure_stream_loudness(fs::path const& path, options_t const& options, vf::loudness::Cache& cache)
+{
+    struct meter_t
+    {
+        explicit meter_t(av::Stream const& stream):
+            converter{stream, 0, swr::Quality::High},
+            meter{stream.channels(), stream.sampleRate()}
+        {}
+        
+        void process(int count)
+        {
+            if (count > 0)
+            {
+                meter.process(converter.data(), static_cast<std::size_t>(count));
+            }
+        }
+        
+        vf::Converter converter;
+        vf::loudness::Meter meter;
+    };
+    
+    auto size = fs::file_size(path);
+    auto modified = fs::last_write_time(path);
+    auto fingerprint = [&](int index)
+    {
+        return vf::fingerprint(path.string(), size, modified, vf::format("stream %d", index));
+    };
+    
+    vf::Demuxer demuxer{path.string(), {options.queueSize, options.queueDuration}};
+    
+    std::vector<std::pair<int, vf::loudness::Result>> results;
+    for (int i = 0; i < demuxer.streamCount(); ++i)
+    {
+        if (demuxer.stream(i).type() == av::MediaType::Audio)
+        {
+            results.emplace_back(i, vf::loudness::Result{});
+        }
+    }
+    if (results.empty())
+    {
+        throw std::runtime_error("no audio streams");
+    }
+    
+    auto cached = true;
+    for (auto& result: results)
+    {
+        cached = cache.find(fingerprint(result.first), result.second) && cached;
+    }
+    if (cached)
+    {
+        return results;
+    }
+    
+    // Meters are created once the decoders are open and the sample format
+    // of each stream is settled.
+    std::vector<std::unique_ptr<meter_t>> meters(static_cast<std::size_t>(demuxer.streamCount()));
+    for (auto const& result: results)
+    {
+        auto* slot = &meters[static_cast<std::size_t>(result.first)];
+        demuxer.select(result.first, [slot](av::Frame const& frame)
+        {
+            auto& m = **slot;
+            m.process(m.converter.convert(frame));
+        });
+        slot->reset(new meter_t{demuxer.stream(result.first)});
+    }
+    
+    demuxer.start();
+    demuxer.wait();
+    
+    for (auto& result: results)
+    {
+        auto& m = *meters[static_cast<std::size_t>(result.first)];
+        m.process(m.converter.flush());
+        result.second = m.meter.result();
+        cache.insert(fingerprint(result.first), result.second);
+    }
+    return results;
+}
+
+void analyze(options_t const& options)
+{
+    std::vector<fs::path> paths;
+    for (auto const& option: options.paths)
+    {
+        fs::path path{option};
+        if (fs::is_directory(path))
+        {
+            for (fs::recursive_directory_iterator it{path}, end; it != end; ++it)
+            {
+                if (fs::is_regular_file(it->path()))
+                {
+                    paths.push_back(it->path());
+                }
+            }
+        }
+        else if (fs::is_regular_file(path))
+        {
+            paths.push_back(path);
+        }
+        else
+        {
+            throw std::runtime_error(vf::format("invalid path to audio file %s", path));
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    
+    av_log_set_level(AV_LOG_QUIET);
+    av_register_all();
+    avcodec_register_all();
+    av::registerLockManager();
+    
+    vf::loudness::Cache cache{options.loudnessCache};
+    vf::ThreadPool pool{options.jobs};
+    
+    // Stream -1 stands for the best audio stream of a file. Every stream is
+    // cached under a fingerprint of its own.
+    using results_t = std::vector<std::pair<int, vf::loudness::Result>>;
+    
+    std::vector<std::future<results_t>> results;
+    results.reserve(paths.size());
+    for (auto const& path: paths)
+    {
+        results.push_back(pool.submit([&cache, &options, path]
+        {
+            auto absolute = fs::absolute(path);
+            if (options.allStreams)
+            {
+                return measure_stream_loudness(absolute, options, cache);
+            }
+            
+            auto fingerprint = vf::fingerprint(absolute.string(), fs::file_size(absolute), fs::last_write_time(absolute));
+            vf::loudness::Result result;
+            if (!cache.find(fingerprint, result))
+            {
+                result = measure_loudness(absolute);
+                cache.insert(fingerprint, result);
+            }
+            return results_t{{-1, result}};
+        }));
+    }
+    
+    // Results are printed in order as they become ready, so a slow file only
+    // holds back the output, never the workers.
+    std::size_t failures = 0;
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        try
+        {
+            for (auto const& stream: results[i].get())
+            {
+                auto const& result = stream.second;
+                std::cout << vf::format(
+                    "%6.1f LUFS %5.1f LU %5.1f dBTP  %s",
+                    result.integrated,
+                    result.range,
+                    result.truePeak,
+                    paths[i].string()
+                );
+                if (stream.first >= 0)
+                {
+                    std::cout << vf::format(" #%d", stream.first);
+                }
+                std::cout << std::endl;
+            }
+        }
+        catch (std::exception& e)
+        {
+            vf::log::warning("Skipped %s: %s.", paths[i].string(), e.what());
+            ++failures;
+        }
+    }
+    
+    cache.save();
+    
+    if (options.stats)
+    {
+        std::cout << vf::format("Analyzed %d files, %d skipped, %d jobs", paths.size() - failures, failures, options.jobs) << std::endl;
+    }
+}
+
+// Writes the peaks of every file to the file name with .peaks appended.
+// Files are done one after the other, each split into more chunks than
+// there are jobs so that chunks that decode slowly do not hold back the
+// rest.
+void peaks(options_t const& options)
+{
+    av_log_set_level(AV_LOG_QUIET);
+    av_register_all();
+    avcodec_register_all();
+    av::registerLockManager();
+    
+    vf::ThreadPool pool{options.jobs};
+    
+    std::size_t failures = 0;
+    for (auto const& option: options.paths)
+    {
+        fs::path path{option};
+        try
+        {
+            if (!fs::is_regular_file(path))
+            {
+                throw std::runtime_error("not a file");
+            }
+            
+            auto start = std::chrono::steady_clock::now();
+            auto peaks = vf::peaks::generate(path.string(), pool, 4 * options.jobs);
+            auto output = path.string() + ".peaks";
+            vf::peaks::write(output, peaks);
+            auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            
+            std::cout << output << std::endl;
+            if (options.stats)
+            {
+                std::cout << vf::format(
+                    "Peaks: %.1f s of audio, %d levels, %d chunks, %.2f s (%.0fx)",
+                    static_cast<double>(peaks.frames) / peaks.sampleRate,
+                    peaks.levels.size(),
+                    peaks.chunks,
+                    elapsed,
+                    static_cast<double>(peaks.frames) / peaks.sampleRate / elapsed
+                ) << std::endl;
+            }
+        }
+        catch (std::exception& e)
+        {
+            vf::log::warning("Skipped %s: %s.", path.string(), e.what());
+            ++failures;
+        }
+    }
+    
+    if (failures > 0)
+    {
+        throw std::runtime_error(vf::format("failed to write peaks for %d files", failures));
+    }
+}
+
+void scan(options_t const& options)
+{
+    if (options.library.empty())
+    {
+        throw std::runtime_error("scanning requires a library index file");
+    }
+    
+    av_log_set_level(AV_LOG_QUIET);
+    av_register_all();
+    avcodec_register_all();
+    av::registerLockManager();
+    
+    vf::Library library{options.library};
+    vf::ThreadPool pool{options.jobs};
+    library.scan(options.paths, pool);
+    
+    std::cout << library;
+}
+
+void reset_shared_cache(options_t const& options)
+{
+    if (vf::SharedCache::reset(options.sharedCacheName))
+    {
+        std::cout << "Removed shared cache " << options.sharedCacheName << "." << std::endl;
+    }
+    else
+    {
+        std::cout << "No shared cache " << options.sharedCacheName << "." << std::endl;
+    }
+}
+
+void benchmark_resampler()
+{
+    auto const inputRate = 44100;
+    auto const outputRate = 48000;
+    auto const seconds = 10.0;
+    auto const chunk = 1024;
+    
+    auto input = vf::benchmark::signal(inputRate, 2, seconds);
+    auto frames = static_cast<int>(input.size() / 2);
+    
+    std::vector<int16_t> output(2 * (chunk * outputRate / inputRate + 256));
+    
+    std::cout << vf::format("Resampling %d Hz to %d Hz, stereo float to S16", inputRate, outputRate) << std::endl;
+    
+    for (auto quality: {swr::Quality::Fast, swr::Quality::Medium, swr::Quality::High, swr::Quality::Best})
+    {
+        auto elapsed = vf::benchmark::measure([&]
+        {
+            swr::Context ctx{AV_CH_LAYOUT_STEREO, av::SampleFormat::FLT, inputRate, outputRate, quality};
+            
+            auto dst = reinterpret_cast<uint8_t*>(output.data());
+            for (int offset = 0; offset < frames; offset += chunk)
+            {
+                auto src = reinterpret_cast<uint8_t const*>(input.data() + 2 * offset);
+                ctx.convert(&src, std::min(chunk, frames - offset), &dst, static_cast<int>(output.size() / 2));
+            }
+        });
+        
+        vf::benchmark::report(swr::name(quality), elapsed, seconds);
+    }
+}
+
+void benchmark_dsp()
+{
+    auto const sampleRate = 48000;
+    auto const seconds = 10.0;
+    
+    auto const input = vf::benchmark::signal(sampleRate, 2, seconds);
+    std::vector<int16_t> output(input.size());
+    
+    auto const frames = input.size() / 2;
+    auto const block = static_cast<std::size_t>(1024);
+    std::vector<float> samples(2 * block);
+    
+    std::cout << vf::format("Processing %d Hz stereo in blocks of %d frames", sampleRate, block) << std::endl;
+    
+    auto run = [&](std::string const& name, vf::dsp::Chain::Settings const& settings)
+    {
+        auto elapsed = vf::benchmark::measure([&]
+        {
+            vf::dsp::Chain chain{2, sampleRate, settings};
+            for (std::size_t offset = 0; offset < frames; offset += block)
+            {
+                auto count = std::min(block, frames - offset);
+                std::copy(input.begin() + 2 * offset, input.begin() + 2 * (offset + count), samples.begin());
+                chain.process(samples.data(), count);
+                vf::dsp::quantize(samples.data(), output.data() + 2 * offset, 2 * count);
+            }
+        });
+        vf::benchmark::report(name, elapsed, seconds);
+    };
+    
+    run("quantize", {1.0f, false});
+    run("gain + quantize", {2.0f, false});
+    run("gain + limiter + quantize", {2.0f, true});
+    run("gain + eq + limiter + quantize", {2.0f, true, {{vf::eq::Type::LowShelf, 120.0, 0.71, 3.0}, {vf::eq::Type::Peak, 2500.0, 2.0, 1.5}, {vf::eq::Type::HighShelf, 8000.0, 0.71, -1.0}}});
+}
+
+// Mixing down and quantizing in one pass against a pass for each.
+void benchmark_downmix()
+{
+    auto const sampleRate = 48000;
+    auto const seconds = 10.0;
+    auto const block = static_cast<std::size_t>(1024);
+    
+    std::cout << vf::format("Mixing %d Hz down to stereo S16 in blocks of %d frames", sampleRate, block) << std::endl;
+    
+    for (auto channels: {1, 6, 8})
+    {
+        auto const input = vf::benchmark::signal(sampleRate, channels, seconds);
+        auto const frames = input.size() / channels;
+        vf::downmix::Mixer mixer{vf::downmix::standard(0, channels)};
+        std::vector<float> mixed(2 * block);
+        std::vector<int16_t> output(2 * frames);
+        
+        auto separate = vf::benchmark::measure([&]
+        {
+            for (std::size_t offset = 0; offset < frames; offset += block)
+            {
+                auto count = std::min(block, frames - offset);
+                mixer.process(input.data() + offset * channels, count, mixed.data());
+                vf::dsp::quantize(mixed.data(), output.data() + 2 * offset, 2 * count);
+            }
+        });
+        vf::benchmark::report(vf::format("%d channels, two passes", channels), separate, seconds);
+        
+        auto fused = vf::benchmark::measure([&]
+        {
+            for (std::size_t offset = 0; offset < frames; offset += block)
+            {
+                auto count = std::min(block, frames - offset);
+                mixer.process(input.data() + offset * channels, count, output.data() + 2 * offset);
+            }
+        });
+        vf::benchmark::report(vf::format("%d channels, fused", channels), fused, seconds);
+    }
+}
+
+// Costs are per filter and channel, so they show how well the lanes of the
+// cascade fill up as filters and channels are added.
+void benchmark_eq()
+{
+    auto const sampleRate = 48000;
+    auto const seconds = 10.0;
+    auto const block = static_cast<std::size_t>(vf::dsp::Chain::BatchFrames);
+    
+    // A typical correction: rumble filter, shelves and a few peaks.
+    std::vector<vf::eq::Filter> const filters{
+        {vf::eq::Type::HighPass, 25.0, 0.71, 0.0},
+        {vf::eq::Type::LowShelf, 120.0, 0.71, 3.0},
+        {vf::eq::Type::Peak, 400.0, 1.0, -2.0},
+        {vf::eq::Type::Peak, 2500.0, 2.0, 1.5},
+        {vf::eq::Type::HighShelf, 8000.0, 0.71, -1.0},
+        {vf::eq::Type::Peak, 60.0, 1.4, 2.0},
+        {vf::eq::Type::Peak, 1000.0, 0.7, -1.0},
+        {vf::eq::Type::LowPass, 18000.0, 0.71, 0.0},
+    };
+    
+    std::cout << vf::format("Filtering %d Hz in blocks of %d frames, cost per filter and channel", sampleRate, block) << std::endl;
+    
+    for (auto channels: {1, 2, 6})
+    {
+        auto const input = vf::benchmark::signal(sampleRate, channels, seconds);
+        auto const frames = input.size() / channels;
+        std::vector<float> samples(input.size());
+        
+        for (std::size_t count: {1, 2, 4, 8})
+        {
+            std::vector<vf::eq::Filter> chosen(filters.begin(), filters.begin() + count);
+            std::copy(input.begin(), input.end(), samples.begin());
+            
+            auto elapsed = vf::benchmark::measure([&]
+            {
+                vf::eq::Cascade cascade{channels, sampleRate, chosen};
+                for (std::size_t offset = 0; offset < frames; offset += block)
+                {
+                    cascade.process(samples.data() + offset * channels, std::min(block, frames - offset));
+                }
+            });
+            vf::benchmark::report(vf::format("%d channels, %d filters", channels, count), elapsed / (channels * count), seconds);
+        }
+    }
+}
+
+// Costs are per second of playback, which at a speed of 4 takes four
+// seconds of input.
+void benchmark_stretch()
+{
+    auto const sampleRate = 48000;
+    auto const seconds = 10.0;
+    
+    auto const input = vf::benchmark::signal(sampleRate, 2, seconds);
+    auto const frames = input.size() / 2;
+    auto const block = static_cast<std::size_t>(1024);
+    
+    std::cout << vf::format("Time-stretching %d Hz stereo in blocks of %d frames", sampleRate, block) << std::endl;
+    
+    for (auto speed: {0.5, 0.75, 1.25, 1.5, 2.0, 3.0, 4.0})
+    {
+        auto elapsed = vf::benchmark::measure([&]
+        {
+            vf::dsp::TimeStretch stretch{2, sampleRate, speed};
+            for (std::size_t offset = 0; offset < frames; offset += block)
+            {
+                stretch.push(input.data() + 2 * offset, std::min(block, frames - offset));
+                stretch.consume(stretch.available());
+            }
+            stretch.flush();
+        });
+        vf::benchmark::report(vf::format("speed %.2fx", speed), elapsed, seconds / speed);
+    }
+}
+
+void benchmark(options_t const& options)
+{
+    if (options.benchmark == "resampler")
+    {
+        benchmark_resampler();
+    }
+    else if (options.benchmark == "dsp")
+    {
+        benchmark_dsp();
+    }
+    else if (options.benchmark == "stretch")
+    {
+        benchmark_stretch();
+    }
+    else if (options.benchmark == "eq")
+    {
+        benchmark_eq();
+    }
+    else if (options.benchmark == "downmix")
+    {
+        benchmark_downmix();
+    }
+    else
+    {
+        throw std::runtime_error(vf::format("unknown benchmark %s", options.benchmark));
+    }
+}
+
+// Writes the events recorded with --trace, also when the mode failed.
+void write_trace(options_t const& options)
+{
+    if (options.trace.empty())
+    {
+        return;
+    }
+    
+    auto summary = vf::trace::dump(options.trace);
+    std::cout << vf::format(
+        "Trace: %d events of %d threads written to %s, %d overwritten",
+        summary.events,
+        summary.threads,
+        options.trace,
+        summary.overwritten
+    ) << std::endl;
+}
+
+void run(options_t const& options)
+{
+    if (!options.trace.empty())
+    {
+        if (!vf::trace::Available)
+        {
+            throw std::runtime_error("tracing is not compiled in");
+        }
+        vf::trace::enable();
+    }
+    
+    try
+    {
+        if (options.sharedCacheReset)
+        {
+            reset_shared_cache(options);
+        }
+        else if (!options.benchmark.empty())
+        {
+            benchmark(options);
+        }
+        else if (options.analyze)
+        {
+            analyze(options);
+        }
+        else if (options.peaks)
+        {
+            peaks(options);
+        }
+        else if (options.scan)
+        {
+            scan(options);
+        }
+#if defined(VF_SOAK)
+        else if (options.soak > 0.0)
+        {
+            soak(options);
+        }
+#endif
+        else if (options.daemon)
+        {
+            serve(options);
+        }
+        else if (!options.send.empty())
+        {
+            send(options);
+        }
+        else
+        {
+            play(options);
+        }
+    }
+    catch (...)
+    {
+        write_trace(options);
+        throw;
+    }
+    write_trace(options);
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        if(auto options = process_options(argc, argv))
+        {
+            vf::log::Logger logger{std::cerr, options->logLevel};
+            av::routeLogs(options->logLevel);
+            
+            run(*options);
         }
     }
     catch (std::exception& e)
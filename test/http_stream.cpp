@@ -0,0 +1,452 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "vf/audio_decoder.hpp"
+#include "vf/http.hpp"
+#include "vf/pipeline.hpp"
+
+// Serves resources from a loopback server that misbehaves the way real
+// servers and networks do, and checks that http::Stream delivers every byte
+// in order, that the pipeline rebuffers after a stall, and that its jitter
+// buffer plays a bursty stream without underruns.
+
+using boost::asio::ip::tcp;
+
+namespace swr = vf::ext::swr;
+
+std::vector<uint8_t> pattern(std::size_t size)
+{
+    std::vector<uint8_t> result(size);
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        result[i] = static_cast<uint8_t>(i * 7 + i / 251);
+    }
+    return result;
+}
+
+void sleep(double seconds)
+{
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+}
+
+// Answers every connection on a thread of its own, so a stalled connection
+// does not hold up the next one. Each path has its own behaviour, which may
+// depend on how many times it was asked for.
+class Server
+{
+public:
+    static constexpr std::size_t IcyInterval = 4096;
+    
+    Server(std::vector<uint8_t> const& resource, std::vector<uint8_t> const& audio, std::vector<uint8_t> const& tone):
+        _resource(resource),
+        _audio(audio),
+        _tone(tone),
+        _service{},
+        _acceptor{_service, tcp::endpoint{boost::asio::ip::address_v4::loopback(), 0}},
+        _running{true},
+        _mutex{},
+        _requests{},
+        _connections{},
+        _thread{}
+    {
+        _thread = std::thread{[this] { run(); }};
+    }
+    
+    Server(Server const& other) = delete;
+    Server& operator=(Server const& other) = delete;
+    
+    ~Server()
+    {
+        // A connection of our own wakes the thread that waits in accept.
+        _running = false;
+        boost::system::error_code error;
+        tcp::socket socket{_service};
+        socket.connect(_acceptor.local_endpoint(), error);
+        _thread.join();
+        
+        for (auto& connection: _connections)
+        {
+            connection.join();
+        }
+    }
+    
+    std::string url(std::string const& path) const
+    {
+        return vf::format("http://127.0.0.1:%d%s", _acceptor.local_endpoint().port(), path);
+    }
+    
+    int requests(std::string const& path)
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        return _requests[path];
+    }
+
+private:
+    void run()
+    {
+        for (;;)
+        {
+            auto socket = std::make_shared<tcp::socket>(_service);
+            boost::system::error_code error;
+            _acceptor.accept(*socket, error);
+            if (!_running)
+            {
+                break;
+            }
+            if (!error)
+            {
+                _connections.emplace_back([this, socket] { serve(*socket); });
+            }
+        }
+    }
+    
+    void serve(tcp::socket& socket)
+    {
+        boost::system::error_code error;
+        boost::asio::streambuf request;
+        boost::asio::read_until(socket, request, "\r\n\r\n", error);
+        if (error)
+        {
+            return;
+        }
+        
+        std::istream stream{&request};
+        std::string method, path, line;
+        stream >> method >> path;
+        std::size_t offset = 0;
+        while (std::getline(stream, line))
+        {
+            if (line.compare(0, 13, "Range: bytes=") == 0)
+            {
+                offset = static_cast<std::size_t>(std::atoll(line.c_str() + 13));
+            }
+        }
+        
+        int attempt;
+        {
+            std::lock_guard<std::mutex> lock{_mutex};
+            attempt = ++_requests[path];
+        }
+        
+        if (path == "/redirect")
+        {
+            send(socket, vf::format("HTTP/1.0 302 Found\r\nLocation: %s\r\n\r\n", url("/drop")));
+        }
+        else if (path == "/drop")
+        {
+            // The first connection drops a third of the way in.
+            serveRange(socket, _resource, offset, attempt == 1 ? _resource.size() / 3 : _resource.size(), 0.0);
+        }
+        else if (path == "/stall")
+        {
+            // The first connection goes silent for longer than the client
+            // waits, and the client has to give up on it.
+            auto stall = attempt == 1 ? vf::http::Stream::Timeout + 1.0 : 0.0;
+            serveRange(socket, _resource, offset, _resource.size() / 2, stall);
+        }
+        else if (path == "/icy")
+        {
+            serveIcy(socket);
+        }
+        else if (path == "/tone.wav")
+        {
+            // Throttled, with a pause long enough for the decoder to run dry
+            // but short of the client's timeout.
+            serveRange(socket, _tone, offset, _tone.size() / 4, 1.0, 0.005);
+        }
+        else if (path == "/bursty")
+        {
+            // Twice as fast as it plays on average, with gaps shorter than
+            // the jitter buffer.
+            serveBursts(socket, _tone, 4800, 0.15);
+        }
+        else
+        {
+            send(socket, "HTTP/1.0 404 Not Found\r\n\r\n");
+        }
+    }
+    
+    // Sends the resource from the offset the client asked for and stalls for
+    // the given time once it reaches the pause offset; without a stall, the
+    // connection ends there instead. Pieces go out with a delay if asked to.
+    void serveRange(tcp::socket& socket, std::vector<uint8_t> const& data, std::size_t offset, std::size_t pause, double stall, double delay = 0.0)
+    {
+        if (offset > 0)
+        {
+            send(socket, vf::format("HTTP/1.0 206 Partial Content\r\nContent-Length: %d\r\nContent-Range: bytes %d-%d/%d\r\n\r\n", data.size() - offset, offset, data.size() - 1, data.size()));
+        }
+        else
+        {
+            send(socket, vf::format("HTTP/1.0 200 OK\r\nContent-Length: %d\r\n\r\n", data.size()));
+        }
+        
+        static std::size_t const Piece = 1024;
+        for (auto position = offset; position < data.size(); )
+        {
+            auto end = std::min(position + Piece, data.size());
+            if (position < pause && end > pause)
+            {
+                end = pause;
+            }
+            if (!send(socket, &data[position], end - position))
+            {
+                return;
+            }
+            position = end;
+            
+            if (position == pause)
+            {
+                if (stall <= 0.0)
+                {
+                    return;
+                }
+                sleep(stall);
+            }
+            sleep(delay);
+        }
+    }
+    
+    // A radio stream with a metadata block after every interval of audio,
+    // mostly empty, sometimes announcing the next title. It is throttled, so
+    // the reader keeps catching up with it.
+    void serveIcy(tcp::socket& socket)
+    {
+        send(socket, vf::format("ICY 200 OK\r\nicy-name: Loopback\r\nicy-metaint: %d\r\n\r\n", static_cast<int>(IcyInterval)));
+        
+        for (std::size_t position = 0, block = 0; position < _audio.size(); position += IcyInterval, ++block)
+        {
+            auto size = _audio.size() - position < IcyInterval ? _audio.size() - position : IcyInterval;
+            if (!send(socket, &_audio[position], size))
+            {
+                return;
+            }
+            
+            std::string metadata;
+            if (block % 2 == 0)
+            {
+                metadata = vf::format("StreamTitle='Song %d';", block / 2);
+                metadata.resize((metadata.size() + 15) / 16 * 16, '\0');
+            }
+            metadata.insert(metadata.begin(), static_cast<char>(metadata.size() / 16));
+            if (!send(socket, metadata))
+            {
+                return;
+            }
+            sleep(0.01);
+        }
+    }
+    
+    // Sends the resource in bursts of the given size with a pause after
+    // each.
+    void serveBursts(tcp::socket& socket, std::vector<uint8_t> const& data, std::size_t burst, double pause)
+    {
+        send(socket, vf::format("HTTP/1.0 200 OK\r\nContent-Length: %d\r\n\r\n", data.size()));
+        
+        for (std::size_t position = 0; position < data.size(); position += burst)
+        {
+            if (!send(socket, &data[position], std::min(burst, data.size() - position)))
+            {
+                return;
+            }
+            sleep(pause);
+        }
+    }
+    
+    static bool send(tcp::socket& socket, uint8_t const* data, std::size_t size)
+    {
+        boost::system::error_code error;
+        boost::asio::write(socket, boost::asio::buffer(data, size), error);
+        return !error;
+    }
+    
+    static bool send(tcp::socket& socket, std::string const& text)
+    {
+        return send(socket, reinterpret_cast<uint8_t const*>(text.data()), text.size());
+    }
+    
+    std::vector<uint8_t> const& _resource;
+    std::vector<uint8_t> const& _audio;
+    std::vector<uint8_t> const& _tone;
+    
+    boost::asio::io_service _service;
+    tcp::acceptor _acceptor;
+    std::atomic<bool> _running;
+    
+    std::mutex _mutex;
+    std::map<std::string, int> _requests;
+    std::vector<std::thread> _connections;
+    std::thread _thread;
+};
+
+// Reads up to size bytes, or to the end of the stream.
+std::vector<uint8_t> readAll(vf::http::Stream& stream, std::size_t size)
+{
+    std::vector<uint8_t> result(size);
+    std::size_t count = 0;
+    while (count < size)
+    {
+        auto read = stream.read(&result[count], static_cast<int>(size - count));
+        if (read == 0)
+        {
+            break;
+        }
+        count += static_cast<std::size_t>(read);
+    }
+    result.resize(count);
+    return result;
+}
+
+bool check(char const* name, bool condition, std::string const& message)
+{
+    if (!condition)
+    {
+        std::cerr << name << ": " << message << std::endl;
+    }
+    return condition;
+}
+
+struct Playback
+{
+    std::size_t frames;
+    unsigned long rebuffers;
+    unsigned long underruns;
+};
+
+// Plays a resource through a pipeline with a jitter buffer of 250 ms. Paced,
+// blocks are taken no faster than they play, like the output does. The
+// wait for the first block is start-up, not an underrun.
+Playback play(std::string const& url, bool paced)
+{
+    vf::AudioDecoder decoder{url};
+    vf::Pipeline::Options options{
+        64 * 1024,
+        1.0,
+        4,
+        0.0,
+        -1,
+        false,
+        decoder.audioCodec().sampleRate(),
+        swr::Quality::High,
+        {1.0f, false, {}},
+        true,
+        0,
+        1.0,
+        {},
+        0.25
+    };
+    vf::Pipeline pipeline{decoder, options};
+    
+    Playback result{0, 0, 0};
+    unsigned long startup = 0;
+    vf::Pipeline::Block block;
+    while (pipeline.read(block))
+    {
+        if (result.frames == 0)
+        {
+            startup = pipeline.underruns();
+        }
+        
+        auto frames = block.data.size() / vf::al::frameSize(pipeline.format());
+        result.frames += frames;
+        pipeline.recycle(std::move(block));
+        
+        if (paced)
+        {
+            sleep(static_cast<double>(frames) / pipeline.sampleRate());
+        }
+    }
+    
+    result.rebuffers = pipeline.rebuffers();
+    result.underruns = pipeline.underruns() - startup;
+    return result;
+}
+
+bool compare(char const* name, std::vector<uint8_t> const& expected, std::vector<uint8_t> const& actual)
+{
+    if (!check(name, actual.size() == expected.size(), vf::format("read %d bytes instead of %d", actual.size(), expected.size())))
+    {
+        return false;
+    }
+    auto mismatch = std::mismatch(expected.begin(), expected.end(), actual.begin());
+    return check(name, mismatch.first == expected.end(), vf::format("byte %d differs", mismatch.first - expected.begin()));
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " tone.wav" << std::endl;
+        return EXIT_FAILURE;
+    }
+    
+    std::ifstream file{argv[1], std::ios::binary};
+    std::vector<uint8_t> tone{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+    auto resource = pattern(200 * 1024);
+    auto audio = pattern(16 * Server::IcyInterval);
+    
+    Server server{resource, audio, tone};
+    auto failures = 0;
+    
+    {
+        // Redirected to a resource whose first connection drops.
+        vf::http::Stream stream{server.url("/redirect")};
+        auto ok = compare("drop", resource, readAll(stream, resource.size() + 1));
+        ok = check("drop", stream.reconnects() >= 1, "did not reconnect") && ok;
+        ok = check("drop", server.requests("/redirect") >= 2, "did not follow the redirect again") && ok;
+        failures += ok ? 0 : 1;
+    }
+    
+    {
+        auto start = std::chrono::steady_clock::now();
+        vf::http::Stream stream{server.url("/stall")};
+        auto ok = compare("stall", resource, readAll(stream, resource.size() + 1));
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        ok = check("stall", stream.reconnects() >= 1, "did not reconnect") && ok;
+        ok = check("stall", elapsed >= vf::http::Stream::Timeout, vf::format("gave up after %.1f s", elapsed)) && ok;
+        failures += ok ? 0 : 1;
+    }
+    
+    {
+        vf::http::Stream stream{server.url("/icy")};
+        auto ok = compare("icy", audio, readAll(stream, audio.size()));
+        auto expected = vf::format("Song %d", (audio.size() / Server::IcyInterval - 1) / 2);
+        ok = check("icy", stream.title() == expected, vf::format("title is \"%s\" instead of \"%s\"", stream.title(), expected)) && ok;
+        failures += ok ? 0 : 1;
+    }
+    
+    av_register_all();
+    avcodec_register_all();
+    
+    // The header is not audio; the resampler may be off by a few frames.
+    auto frames = (tone.size() - 44) / 2;
+    
+    {
+        auto playback = play(server.url("/tone.wav"), false);
+        auto ok = check("rebuffer", playback.frames + 64 >= frames && playback.frames <= frames + 64, vf::format("decoded %d frames instead of %d", playback.frames, frames));
+        ok = check("rebuffer", playback.rebuffers >= 1, "never rebuffered") && ok;
+        failures += ok ? 0 : 1;
+    }
+    
+    {
+        auto playback = play(server.url("/bursty"), true);
+        auto ok = check("bursty", playback.frames + 64 >= frames && playback.frames <= frames + 64, vf::format("decoded %d frames instead of %d", playback.frames, frames));
+        ok = check("bursty", playback.underruns == 0, vf::format("output waited %d times", playback.underruns)) && ok;
+        failures += ok ? 0 : 1;
+    }
+    
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
\ No newline at end of file
@@ -0,0 +1,56 @@
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "vf/log.hpp"
+
+// Logs string arguments that together overflow the text of a record and
+// checks that they are cut short, and that the records queued next to it
+// come out unharmed.
+
+int main()
+{
+    std::ostringstream stream;
+    {
+        vf::log::Logger logger{stream, vf::log::Level::Debug, 4};
+        std::string path(300, 'p');
+        std::string reason(300, 'r');
+        vf::log::error("Failed to play %s: %s.", path, reason);
+        vf::log::error("Failed to play %s: %s (%s).", path, reason, "again");
+        vf::log::info("After %s %d.", "overflow", 42);
+    }
+    
+    std::istringstream lines{stream.str()};
+    std::string line;
+    std::string messages[3];
+    for (auto& message: messages)
+    {
+        if (!std::getline(lines, line))
+        {
+            std::cerr << "Missing line in:\n" << stream.str() << std::endl;
+            return EXIT_FAILURE;
+        }
+        message = line.substr(line.find(": ") + 2);
+    }
+    
+    auto failures = 0;
+    auto expected = "Failed to play " + std::string(255, 'p') + ": .";
+    if (messages[0] != expected)
+    {
+        std::cerr << "First message is \"" << messages[0] << "\"" << std::endl;
+        ++failures;
+    }
+    if (messages[1] != "Failed to play " + std::string(255, 'p') + ":  ().")
+    {
+        std::cerr << "Second message is \"" << messages[1] << "\"" << std::endl;
+        ++failures;
+    }
+    if (messages[2] != "After overflow 42.")
+    {
+        std::cerr << "Third message is \"" << messages[2] << "\"" << std::endl;
+        ++failures;
+    }
+    
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
\ No newline at end of file
@@ -0,0 +1,115 @@
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "vf/ext/av.hpp"
+
+// Scales pictures in bands and with a single context and checks that every
+// byte of the two agrees, for ratios that split into bands and one that has
+// to fall back to a single context.
+
+namespace av = vf::ext::av;
+namespace sws = vf::ext::sws;
+
+struct Case
+{
+    char const* name;
+    av::PixelFormat srcFormat;
+    int srcWidth;
+    int srcHeight;
+    av::PixelFormat dstFormat;
+    int dstWidth;
+    int dstHeight;
+    int flags;
+    bool banded;
+};
+
+int planeRows(av::Frame const& frame, int plane)
+{
+    auto descriptor = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame.format()));
+    auto shift = (plane == 1 || plane == 2) ? descriptor->log2_chroma_h : 0;
+    return (frame.height() + (1 << shift) - 1) >> shift;
+}
+
+void fill(av::Frame& frame, unsigned int seed)
+{
+    std::mt19937 random{seed};
+    for (int plane = 0; plane < 4 && frame.data(plane); ++plane)
+    {
+        auto bytes = av_image_get_linesize(static_cast<AVPixelFormat>(frame.format()), frame.width(), plane);
+        for (int row = 0; row < planeRows(frame, plane); ++row)
+        {
+            auto line = frame.data(plane) + row * frame.lineSize(plane);
+            for (int i = 0; i < bytes; ++i)
+            {
+                // Gradients with noise, so every filter tap matters.
+                line[i] = static_cast<uint8_t>((i + 3 * row) / 4 + random() % 64);
+            }
+        }
+    }
+}
+
+bool compare(Case const& test, av::Frame const& expected, av::Frame const& actual)
+{
+    for (int plane = 0; plane < 4 && expected.data(plane); ++plane)
+    {
+        auto bytes = av_image_get_linesize(static_cast<AVPixelFormat>(expected.format()), expected.width(), plane);
+        for (int row = 0; row < planeRows(expected, plane); ++row)
+        {
+            auto lhs = expected.data(plane) + row * expected.lineSize(plane);
+            auto rhs = actual.data(plane) + row * actual.lineSize(plane);
+            for (int i = 0; i < bytes; ++i)
+            {
+                if (lhs[i] != rhs[i])
+                {
+                    std::cerr << test.name << ": plane " << plane << " row " << row << " byte " << i << " is " << int{rhs[i]} << " instead of " << int{lhs[i]} << std::endl;
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    Case const cases[] = {
+        {"1080p to 720p RGBA, bilinear", av::PixelFormat::YUV420P, 1920, 1080, av::PixelFormat::RGBA, 1280, 720, SWS_BILINEAR, true},
+        {"1080p to 720p YUV, bicubic", av::PixelFormat::YUV420P, 1920, 1080, av::PixelFormat::YUV420P, 1280, 720, SWS_BICUBIC, true},
+        {"1080p to 1080p RGB24, bilinear", av::PixelFormat::YUV420P, 1920, 1080, av::PixelFormat::RGB24, 1920, 1080, SWS_BILINEAR, true},
+        {"360p to 720p BGRA, lanczos", av::PixelFormat::RGB24, 640, 360, av::PixelFormat::BGRA, 1280, 720, SWS_LANCZOS, true},
+        {"2160p to 540p RGBA, area", av::PixelFormat::RGBA, 1280, 2160, av::PixelFormat::RGBA, 640, 540, SWS_AREA, true},
+        {"720p to 1080p RGBA, bicubic", av::PixelFormat::YUV420P, 1280, 720, av::PixelFormat::RGBA, 1920, 1080, SWS_BICUBIC, false},
+    };
+    
+    auto failures = 0;
+    for (auto const& test: cases)
+    {
+        av::Frame src{test.srcFormat, test.srcWidth, test.srcHeight};
+        av::Frame expected{test.dstFormat, test.dstWidth, test.dstHeight};
+        av::Frame actual{test.dstFormat, test.dstWidth, test.dstHeight};
+        fill(src, 1);
+        fill(expected, 2);
+        fill(actual, 3);
+        
+        sws::Context single{src, expected, test.flags, 1};
+        sws::Context bands{src, actual, test.flags, 4};
+        if ((bands.threads() > 1) != test.banded)
+        {
+            std::cerr << test.name << ": scaled in " << bands.threads() << " bands" << std::endl;
+            ++failures;
+            continue;
+        }
+        
+        single.scale(src, expected);
+        bands.scale(src, actual);
+        if (!compare(test, expected, actual))
+        {
+            ++failures;
+        }
+    }
+    
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
\ No newline at end of file